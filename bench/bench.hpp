@@ -0,0 +1,168 @@
+/*
+ *  Injectors - Benchmark harness
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+ *  Tiny benchmark harness shared by the benchmark executables.
+ *  Each benchmark is calibrated to run for at least min_time, then sampled a few times; the JSON printed to stdout
+ *  has the minimum and median time per operation of every benchmark, so runs of different releases can be diffed.
+ */
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+    struct options
+    {
+        const char* filter   = nullptr;
+        double      min_time = 0.02;        // Seconds per sample
+        int         samples  = 5;
+    };
+
+    inline options& get_options()
+    {
+        static options o;
+        return o;
+    }
+
+    // Parses [filter] [--min-time ms] [--samples n]
+    inline void parse_args(int argc, char** argv)
+    {
+        auto& o = get_options();
+        for(int i = 1; i < argc; ++i)
+        {
+            if(!strcmp(argv[i], "--min-time") && i + 1 < argc)
+                o.min_time = atof(argv[++i]) / 1000.0;
+            else if(!strcmp(argv[i], "--samples") && i + 1 < argc)
+                o.samples = std::max(1, atoi(argv[++i]));
+            else
+                o.filter = argv[i];
+        }
+    }
+
+    inline bool selected(const char* name)
+    {
+        auto f = get_options().filter;
+        return f == nullptr || strstr(name, f) != nullptr;
+    }
+
+    // Keeps the compiler from optimizing @v away
+    template<class T>
+    inline void keep(const T& v)
+    {
+        asm volatile("" : : "r"(&v) : "memory");
+    }
+
+    inline double now()
+    {
+        using clock = std::chrono::steady_clock;
+        return std::chrono::duration<double>(clock::now().time_since_epoch()).count();
+    }
+
+    // State of the JSON output
+    struct output
+    {
+        bool first = true;
+
+        static output& get()
+        {
+            static output o;
+            return o;
+        }
+    };
+
+    inline const char* arch()
+    {
+    #if defined(__aarch64__)
+        return "aarch64";
+    #elif defined(__x86_64__)
+        return "x86_64";
+    #else
+        return "unknown";
+    #endif
+    }
+
+    // Starts the JSON document of the suite @suite
+    inline void begin(const char* suite)
+    {
+        printf("{\n  \"suite\": \"%s\",\n  \"context\": { \"arch\": \"%s\", \"compiler\": \"%s\" },\n  \"benchmarks\": [",
+               suite, arch(), __VERSION__);
+        output::get().first = true;
+    }
+
+    inline void end()
+    {
+        printf("\n  ]\n}\n");
+        fflush(stdout);
+    }
+
+    // Prints a result, @extra is appended as is (e.g. ", \"patches\": 100")
+    inline void report(const char* name, uint64_t iterations, double min_ns, double median_ns, const std::string& extra = "")
+    {
+        auto& out = output::get();
+        printf("%s\n    { \"name\": \"%s\", \"iterations\": %llu, \"ns_per_op_min\": %.3f, \"ns_per_op_median\": %.3f%s }",
+               out.first? "" : ",", name, (unsigned long long) iterations, min_ns, median_ns, extra.c_str());
+        out.first = false;
+        fflush(stdout);
+    }
+
+    // Runs @fn repeatedly as the benchmark @name, each call doing @items operations
+    template<class F>
+    inline void run(const char* name, F&& fn, uint64_t items = 1)
+    {
+        if(!selected(name)) return;
+        auto& o = get_options();
+
+        // Calibrate the iterations so a sample takes at least min_time
+        uint64_t iterations = 1;
+        for(;;)
+        {
+            double t = now();
+            for(uint64_t i = 0; i < iterations; ++i) fn();
+            t = now() - t;
+            if(t >= o.min_time || iterations >= (uint64_t(1) << 32)) break;
+            iterations = t > 0? std::max(iterations * 2, uint64_t(double(iterations) * o.min_time * 1.2 / t)) : iterations * 16;
+        }
+
+        std::vector<double> samples;
+        for(int s = 0; s < o.samples; ++s)
+        {
+            double t = now();
+            for(uint64_t i = 0; i < iterations; ++i) fn();
+            samples.push_back((now() - t) * 1e9 / double(iterations * items));
+        }
+
+        std::sort(samples.begin(), samples.end());
+        std::string extra;
+        if(items != 1)
+            extra = ", \"items_per_iteration\": " + std::to_string(items);
+        report(name, iterations, samples.front(), samples[samples.size() / 2], extra);
+    }
+}
@@ -0,0 +1,412 @@
+/*
+ *  Injectors - Micro-benchmarks of the patching and dispatch primitives
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+ *  Measures WriteMemory, MakeB, MakeBR, address_translator_manager::translator, the function_hooker dispatch,
+ *  patch_registry conflict checks, stub rewrites through a dual_mapping, MakeInline calls, safe-point commits
+ *  (threads parked and checked) and the code cave scanner and allocator on an anonymous read+exec region mapped
+ *  near this executable (so B/BL reach it), and prints the results as JSON.
+ *
+ *      injector_bench [filter] [--min-time ms] [--samples n]
+ *
+ *  Only benchmarks whose name contains filter are run. Nothing in the region is executed but the MakeInline
+ *  functions (on arm64 hosts only), the hook dispatch is entered through function_hooker_manager::call_hooks,
+ *  so this runs on any host.
+ */
+#include "bench.hpp"
+#include <injector/injector.hpp>
+#include <injector/hooking.hpp>
+#include <injector/assembly.hpp>
+#include <injector/maps.hpp>
+#include <injector/registry.hpp>
+#include <injector/trampoline.hpp>
+#include <injector/safepoint.hpp>
+#include <injector/cave.hpp>
+#include <injector/gvm/translator.hpp>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace injector;
+
+namespace
+{
+    // Original function of the hooked call site
+    __attribute__((noinline)) int original_function(int x)
+    {
+        bench::keep(x);
+        return x * 2;
+    }
+
+    // The read+exec region
+    struct code_region
+    {
+        uintptr_t   base = 0;
+        size_t      size = 0;
+        size_t      page = 0;
+
+        static const size_t pages       = 32;
+        static const size_t call_site   = 0x100;    // A BL original_function, hooked by the dispatch benchmarks
+        static const size_t b_site      = 0x200;    // MakeB
+        static const size_t b_dest      = 0x300;
+        static const size_t br_site     = 0x400;    // MakeBR
+        static const size_t inline_site = 0x500;    // Four NOP, RET functions 16 bytes apart, for MakeInline
+        static const size_t bulk_page   = 1;        // First page of the bulk writes
+
+        bool map()
+        {
+            page = page_size();
+            size = pages * page;
+            uintptr_t near = uintptr_t(&original_function);
+
+            void* p = MAP_FAILED;
+            for(int attempt = 0; attempt < 4 && p == MAP_FAILED; ++attempt)
+            {
+                uintptr_t hint = memory_map(0).find_free(near, size, 0x4000000, page);
+                if(hint == 0) break;
+                p = mmap((void*) hint, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+                if(p != MAP_FAILED && !arm64::is_b_range(uintptr_t(p), near))
+                    munmap(p, size), p = MAP_FAILED;
+            }
+            if(p == MAP_FAILED) return false;
+            base = uintptr_t(p);
+
+            auto code = (uint32_t*) p;
+            for(size_t i = 0; i < size / 4; ++i) code[i] = arm64::nop();
+            code[call_site / 4] = arm64::bl(base + call_site, near);
+            code[b_dest / 4]    = arm64::ret();
+            for(size_t i = 0; i < 4; ++i) code[(inline_site + i * 16) / 4 + 1] = arm64::ret();
+            mprotect(p, size, PROT_READ | PROT_EXEC);
+            return true;
+        }
+
+        memory_pointer_raw at(size_t offset) const { return raw_ptr(base + offset); }
+    };
+
+    code_region region;
+
+    /*
+     *  Memory writes
+     */
+    void bench_writes()
+    {
+        uint32_t v = 0;
+        bench::run("write/single_u32", [&] {
+            WriteMemory<uint32_t>(region.at(region.b_site), v++, true, true);
+        });
+
+        static uint8_t rw[0x100];
+        bench::run("write/single_u32_novp", [&] {
+            WriteMemory<uint32_t>(raw_ptr(&rw[0]), v++, false);
+            bench::keep(rw);
+        });
+
+        for(size_t size : { size_t(0x100), size_t(0x1000), size_t(0x10000) })
+        {
+            std::vector<uint8_t> buf(size, 0x1F);
+            size_t max = (region.pages - region.bulk_page - 1) * region.page;
+            if(size > max) continue;
+
+            char name[64];
+            snprintf(name, sizeof(name), "write/bulk_%zu", size);
+            bench::run(name, [&] {
+                WriteMemoryRaw(region.at(region.bulk_page * region.page), buf.data(), size, true, true);
+            });
+        }
+
+        uint64_t v64 = 0;
+        bench::run("write/page_straddle_u64", [&] {
+            WriteMemory<uint64_t>(region.at(2 * region.page - 4), v64++, true, true);
+        });
+    }
+
+    /*
+     *  Branch patching
+     */
+    void bench_patches()
+    {
+        bench::run("patch/MakeB", [&] {
+            bench::keep(MakeB(region.at(region.b_site), region.at(region.b_dest)));
+        });
+
+        bench::run("patch/MakeBR", [&] {
+            MakeBR(region.at(region.br_site), raw_ptr(&original_function));
+        });
+    }
+
+    /*
+     *  Rewriting generated code: through the writable view of a dual mapping, against unprotect/write/reprotect
+     */
+    void bench_stubs()
+    {
+        dual_mapping stubs(0x1000);
+        if(!stubs.is_mapped())
+        {
+            fprintf(stderr, "stub/*: memfd_create isn't available, skipped\n");
+            return;
+        }
+
+        uint32_t code[4] = { arm64::nop(), arm64::nop(), arm64::nop(), arm64::ret() };
+        bench::run("stub/rewrite_16_dual", [&] {
+            stubs.write_code(stubs.rx() + 0x100, code, sizeof(code));
+        });
+
+        bench::run("stub/rewrite_16_mprotect", [&] {
+            WriteMemoryRaw(region.at(region.bulk_page * region.page), code, sizeof(code), true, true);
+        });
+    }
+
+    /*
+     *  MakeInline overhead: calling a NOP, RET function with its NOP hooked by an empty functor, per register mask
+     *  The stubs are arm64 code, they only run on arm64 hosts.
+     */
+    struct inline_nothing
+    {
+        void operator()(reg_pack& regs) { bench::keep(regs.x0); }
+    };
+
+    void bench_inline()
+    {
+    #if defined(__aarch64__)
+        using function = void (*)();
+        auto site = [](size_t i) { return region.at(region.inline_site + i * 16); };
+        bool hooked = !MakeInline<inline_nothing, reg_mask::x_range(0, 3) | reg_mask::exact>(site(1)).is_null()
+                   && !MakeInline<inline_nothing, 0>(site(2)).is_null()
+                   && !MakeInline<inline_nothing, reg_mask::all>(site(3)).is_null();
+        if(!hooked)
+        {
+            fprintf(stderr, "stub/inline_call_*: no trampoline memory near the region, skipped\n");
+            return;
+        }
+
+        const char* names[] = { "stub/inline_call_unhooked", "stub/inline_call_x0_x3_exact", "stub/inline_call_scratch", "stub/inline_call_all" };
+        for(size_t i = 0; i < 4; ++i)
+        {
+            function f = site(i).get<void()>();
+            bench::run(names[i], [&] { f(); });
+        }
+    #else
+        fprintf(stderr, "stub/inline_call_*: arm64 only, skipped\n");
+    #endif
+    }
+
+    /*
+     *  Safe-point patching: one 12 bytes patch written with @threads other threads parked
+     */
+    void bench_safepoint()
+    {
+        for(size_t threads : { size_t(0), size_t(4), size_t(16) })
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "safepoint/commit_%zu_threads", threads);
+            if(!bench::selected(name)) continue;
+
+            // Threads waiting on a condition variable, like most of the threads of a game at any given time
+            std::mutex mutex;
+            std::condition_variable cv;
+            bool stop = false;
+            std::vector<std::thread> pool;
+            for(size_t i = 0; i < threads; ++i)
+                pool.emplace_back([&] { std::unique_lock<std::mutex> lock(mutex); cv.wait(lock, [&] { return stop; }); });
+
+            uint32_t code[3] = { arm64::nop(), arm64::nop(), arm64::nop() };
+            uint64_t max_pause = 0;
+            bench::run(name, [&] {
+                safepoint_patcher patcher;
+                patcher.add(region.base + region.br_site, code, sizeof(code));
+                max_pause = std::max(max_pause, patcher.commit().max_pause_ns);
+            });
+            fprintf(stderr, "%s: longest pause %.1f us\n", name, max_pause / 1000.0);
+
+            { std::lock_guard<std::mutex> lock(mutex); stop = true; }
+            cv.notify_all();
+            for(auto& t : pool) t.join();
+        }
+    }
+
+    /*
+     *  Code caves: scanning synthetic code (functions of 8 to 200 instructions ending with a RET, padded with zeros
+     *  or NOPs up to 16 or 64 bytes) and allocating veneers from it
+     */
+    void bench_caves()
+    {
+        const size_t words = (16 << 20) / 4;
+        std::vector<uint32_t> text(words + 4);
+        uint32_t* code = (uint32_t*) ((uintptr_t(text.data()) + 15) & ~uintptr_t(15));
+        uint32_t seed = 1;
+        for(size_t i = 0; i < words; )
+        {
+            seed = seed * 1103515245 + 12345;
+            size_t length = std::min<size_t>(8 + (seed >> 16) % 192, words - i);
+            for(size_t k = 0; k + 1 < length; ++k) code[i + k] = arm64::add_imm(0, 0, 1);
+            code[i + length - 1] = arm64::ret();
+            i += length;
+
+            size_t align = (seed & 0x100)? 64 : 16;
+            uint32_t pad = (seed & 0x200)? arm64::nop() : 0;
+            for(; i < words && (i * 4) % align != 0; ++i) code[i] = pad;
+        }
+
+        size_t caves = 0;
+        bench::run("cave/scan_16MB", [&] {
+            caves = 0;
+            cave_index::find_caves(uintptr_t(code), words * 4, 16, [&](uintptr_t, size_t) { ++caves; });
+        }, words);
+
+        if(!bench::selected("cave/allocate_12")) return;
+        cave_index index;
+        index.scan(uintptr_t(code), words * 4, 16);
+        fprintf(stderr, "cave/scan_16MB: %zu caves, %zu bytes\n", index.size(), index.free_bytes());
+
+        uintptr_t near = uintptr_t(code) + words * 2;
+        bench::run("cave/allocate_12", [&] {
+            auto p = index.allocate(12, raw_ptr(near));
+            if(!p.is_null()) index.release(p, 12);
+            bench::keep(p);
+        });
+    }
+
+    /*
+     *  Address translation
+     */
+    class bench_translator : public address_translator
+    {
+        public:
+            bench_translator(uintptr_t from, uintptr_t to)
+            {
+                for(uintptr_t i = 0; i < 16; ++i)
+                    this->map.insert(std::make_pair(raw_ptr(from + i * 0x100), raw_ptr(to + i * 0x100)));
+            }
+    };
+
+    void bench_translation()
+    {
+        for(size_t count : { size_t(1), size_t(100), size_t(10000) })
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "translate/%zu_translators", count);
+            if(!bench::selected(name)) continue;
+
+            // The first translator constructed is the last one searched
+            std::list<bench_translator> translators;
+            for(size_t i = 0; i < count; ++i)
+                translators.emplace_back(0x10000000 + i * 0x10000, 0x20000000 + i * 0x10000);
+
+            void* p = (void*) uintptr_t(0x10000000 + 0x504);
+            bench::run(name, [&] {
+                bench::keep(address_translator_manager::singleton().translator(p));
+            });
+        }
+    }
+
+    /*
+     *  Patch registry
+     */
+    void bench_registry()
+    {
+        for(size_t count : { size_t(1000), size_t(300000) })
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "registry/fill_%zu", count);
+            bench::run(name, [&] {
+                patch_registry registry;
+                for(size_t i = 0; i < count; ++i)
+                    registry.claim(0x10000000 + i * 0x40, (i % 8 == 0)? 12 : 4);
+                bench::keep(registry.size());
+            }, count);
+
+            // A patch and its restore with @count patches around
+            snprintf(name, sizeof(name), "registry/claim_release_%zu", count);
+            if(!bench::selected(name)) continue;
+
+            patch_registry registry;
+            for(size_t i = 0; i < count; ++i)
+                registry.claim(0x10000000 + i * 0x40, (i % 8 == 0)? 12 : 4);
+            uintptr_t at = 0x10000000 + (count / 2) * 0x40 + 0x20;
+            bench::run(name, [&] {
+                registry.release(registry.claim(at, 4), at, 4);
+            });
+        }
+    }
+
+    /*
+     *  Hook dispatch
+     */
+    using call_hooker = function_hooker<code_region::call_site, int(int)>;
+
+    void bench_dispatch()
+    {
+        bench::run("hooks/original", [&] {
+            bench::keep(original_function(21));
+        });
+
+        for(size_t depth = 1; depth <= 8; ++depth)
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "hooks/call_hooks_depth_%zu", depth);
+            if(!bench::selected(name)) continue;
+
+            std::list<call_hooker> hooks(depth);
+            for(auto& h : hooks)
+                h.make_call([](call_hooker::func_type next, int& x) { return next(x) + 1; });
+
+            int check = 21;
+            if(call_hooker::manager_type::call_hooks(check) != original_function(21) + int(depth))
+                fprintf(stderr, "%s: the hook chain returned a wrong value\n", name);
+
+            bench::run(name, [&] {
+                int x = 21;
+                bench::keep(call_hooker::manager_type::call_hooks(x));
+            });
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bench::parse_args(argc, argv);
+
+    if(!region.map())
+    {
+        fprintf(stderr, "failed to map the code region near the executable\n");
+        return 1;
+    }
+    SetGameBaseAddress(region.base);    // function_hooker addresses are offsets into the region
+
+    bench::begin("primitives");
+    bench_writes();
+    bench_patches();
+    bench_stubs();
+    bench_inline();
+    bench_safepoint();
+    bench_caves();
+    bench_translation();
+    bench_dispatch();
+    bench_registry();
+    bench::end();
+    return 0;
+}
@@ -0,0 +1,456 @@
+/*
+ *  Injectors - Startup patching benchmark
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+ *  Applies large synthetic patch sets (see workload.hpp) to a fake module with the per-call API, the way a mod
+ *  does at load time: every patch goes through address translation (module relative offsets), unprotection,
+ *  the write, reprotection and instruction cache maintenance. Prints the time per patch as JSON.
+ *  The same patch sets are also applied to a copy of the module in a plain buffer (buffer_backend), which is
+ *  the cost of the patching logic alone, and to a forked copy of the process (remote_backend), one syscall per
+ *  write and batched. Finally they're compiled into a binary manifest (manifest.hpp) applied in one pass, and
+ *  queued into a patch_batch (batch.hpp) written in place or installed as whole patched pages. The lazy
+ *  benchmarks time arming a patch set (lazy.hpp) and installing all of it, the worst case of a session which
+ *  runs every patched page. The async benchmarks time submitting a patch set to the async_patcher (the cost left
+ *  on the loading thread) and until it's applied. The reload benchmarks switch a live_patch_set between two sets
+ *  differing by 1% of their entries, against restoring and applying the whole set.
+ *  The undo benchmarks apply and then roll back a patch set, with one scoped_write per patch or a patch_journal.
+ *
+ *      injector_bench_startup [filter] [--min-time ms] [--samples n]
+ */
+#include "bench.hpp"
+#include "workload.hpp"
+#include <injector/injector.hpp>
+#include <injector/backend.hpp>
+#include <injector/manifest.hpp>
+#include <injector/batch.hpp>
+#include <injector/lazy.hpp>
+#include <injector/async.hpp>
+#include <injector/reload.hpp>
+#include <injector/journal.hpp>
+#include <injector/hooking.hpp>
+#include <signal.h>
+#include <sys/wait.h>
+
+using namespace injector;
+
+namespace
+{
+    // Applies @patches with the per-call API, the addresses are offsets translated through the game base address
+    void apply_per_call(const std::vector<bench::patch>& patches)
+    {
+        for(auto& p : patches)
+        {
+            memory_pointer_tr at = uintptr_t(p.offset);
+            switch(p.kind)
+            {
+                case bench::patch::nop:
+                    MakeNOP(at, p.count);
+                    break;
+
+                case bench::patch::branch:
+                    MakeB(at, uintptr_t(p.value));
+                    break;
+
+                case bench::patch::data:
+                    WriteMemory<uint32_t>(at, uint32_t(p.value), true, false);
+                    break;
+
+                case bench::patch::straddle:
+                    WriteMemory<uint64_t>(at, p.value, true, true);
+                    FlushInstructionCache(at, sizeof(uint64_t));
+                    break;
+            }
+        }
+    }
+
+    // Applies @patches to @mem, the module is based at @base
+    template<class Backend>
+    void apply_backend(basic_memory_access<Backend>& mem, uintptr_t base, const std::vector<bench::patch>& patches)
+    {
+        for(auto& p : patches)
+        {
+            uintptr_t at = base + p.offset;
+            switch(p.kind)
+            {
+                case bench::patch::nop:      mem.make_nop(at, p.count); break;
+                case bench::patch::branch:   mem.make_b(at, base + p.value); break;
+                case bench::patch::data:     mem.template write<uint32_t>(at, uint32_t(p.value)); break;
+                case bench::patch::straddle: mem.template write<uint64_t>(at, p.value, true, true); break;
+            }
+        }
+    }
+
+    void bench_workload(const char* mix_name, const bench::fake_module& module, size_t count, bench::workload_mix mix)
+    {
+        char name[96];
+        snprintf(name, sizeof(name), "startup/%s_%zu_per_call", mix_name, count);
+        if(!bench::selected(name)) return;
+
+        auto patches = bench::generate_workload(module, count, mix);
+        bench::run(name, [&] { apply_per_call(patches); }, patches.size());
+    }
+
+    void bench_workload_buffer(const bench::fake_module& module, size_t count)
+    {
+        char name[96];
+        snprintf(name, sizeof(name), "startup/mixed_%zu_buffer", count);
+        if(!bench::selected(name)) return;
+
+        std::vector<uint8_t> image((const uint8_t*) module.base, (const uint8_t*) module.base + module.size());
+        buffer_memory mem(image, module.base);
+        auto patches = bench::generate_workload(module, count);
+        bench::run(name, [&] { apply_backend(mem, module.base, patches); }, patches.size());
+    }
+
+    // The bytes written by @p
+    size_t patch_bytes(const bench::patch& p, uintptr_t base, uint8_t* out)
+    {
+        switch(p.kind)
+        {
+            case bench::patch::nop:
+                for(size_t i = 0; i < p.count; ++i)
+                {
+                    uint32_t nop = arm64::nop();
+                    memcpy(out + i * 4, &nop, 4);
+                }
+                return p.count * 4;
+            case bench::patch::branch:
+            {
+                uint32_t ins = arm64::b(base + p.offset, base + p.value);
+                memcpy(out, &ins, 4);
+                return 4;
+            }
+            case bench::patch::data:
+                memcpy(out, &p.value, 4);
+                return 4;
+            case bench::patch::straddle:
+                memcpy(out, &p.value, 8);
+                return 8;
+        }
+        return 0;
+    }
+
+    // Applies @count patches through scoped_writes and through a patch_journal, times only their undo
+    void bench_undo(const bench::fake_module& module, size_t count)
+    {
+        char scoped_name[96], journal_name[96];
+        snprintf(scoped_name, sizeof(scoped_name), "startup/undo_%zu_scoped", count);
+        snprintf(journal_name, sizeof(journal_name), "startup/undo_%zu_journal", count);
+        if(!bench::selected(scoped_name) && !bench::selected(journal_name)) return;
+
+        auto patches = bench::generate_workload(module, count);
+        std::vector<double> scoped_ns, journal_ns;
+        for(int s = 0; s < std::max(3, bench::get_options().samples); ++s)
+        {
+            std::vector<scoped_write<16>> undo(patches.size());
+            for(size_t i = 0; i < patches.size(); ++i)
+            {
+                uint8_t bytes[16];
+                size_t n = patch_bytes(patches[i], module.base, bytes);
+                undo[i].write(uintptr_t(patches[i].offset), bytes, n, true);
+            }
+
+            // Newest first, as the journal does
+            double t = bench::now();
+            for(size_t i = undo.size(); i-- > 0; )
+                undo[i].restore();
+            scoped_ns.push_back((bench::now() - t) * 1e9 / double(count));
+
+            patch_journal journal;
+            for(auto& p : patches)
+            {
+                uint8_t bytes[16];
+                size_t n = patch_bytes(p, module.base, bytes);
+                journal.write_raw(uintptr_t(p.offset), bytes, n);
+            }
+
+            t = bench::now();
+            journal.rollback();
+            journal_ns.push_back((bench::now() - t) * 1e9 / double(count));
+        }
+
+        for(auto* v : { &scoped_ns, &journal_ns })
+        {
+            std::sort(v->begin(), v->end());
+            const char* name = v == &scoped_ns? scoped_name : journal_name;
+            if(bench::selected(name))
+                bench::report(name, v->size(), v->front(), (*v)[v->size() / 2],
+                              ", \"items_per_iteration\": " + std::to_string(count));
+        }
+    }
+
+    // Compiles @patches into a binary manifest
+    std::vector<uint8_t> make_manifest(const std::vector<bench::patch>& patches)
+    {
+        manifest_builder builder;
+        for(auto& p : patches)
+        {
+            switch(p.kind)
+            {
+                case bench::patch::nop:
+                {
+                    manifest_record r = { };
+                    r.kind = manifest_kind::nop, r.address = p.offset, r.count = p.count;
+                    builder.add(r);
+                    break;
+                }
+                case bench::patch::branch:
+                    builder.add_branch(manifest_kind::b, p.offset, p.value);
+                    break;
+                case bench::patch::data:
+                {
+                    uint32_t value = uint32_t(p.value);
+                    builder.add_bytes(p.offset, &value, sizeof(value));
+                    break;
+                }
+                case bench::patch::straddle:
+                    builder.add_bytes(p.offset, &p.value, sizeof(p.value));
+                    break;
+            }
+        }
+        return builder.build();
+    }
+
+    void bench_workload_manifest(const bench::fake_module& module, size_t count)
+    {
+        char name[96];
+        snprintf(name, sizeof(name), "startup/mixed_%zu_manifest", count);
+        if(!bench::selected(name)) return;
+
+        auto data = make_manifest(bench::generate_workload(module, count));
+        manifest_view manifest(data.data(), data.size());
+        bench::run(name, [&] { bench::keep(apply_manifest(manifest).applied); }, count);
+    }
+
+    // Applies @count patches through a patch_batch, in place or swapping the patched pages
+    void bench_workload_batch(const bench::fake_module& module, size_t count, bool swapped)
+    {
+        char name[96];
+        snprintf(name, sizeof(name), "startup/mixed_%zu_%s", count, swapped? "swapped" : "batch");
+        if(!bench::selected(name)) return;
+
+        auto patches = bench::generate_workload(module, count);
+        size_t runs = 0;
+        bench::run(name, [&] {
+            patch_batch batch;
+            batch.swap_pages(swapped);
+            for(auto& p : patches)
+            {
+                uint8_t bytes[16];
+                size_t n = patch_bytes(p, module.base, bytes);
+                batch.add(module.base + p.offset, bytes, n);
+            }
+            if(batch.commit() != 0)
+                fprintf(stderr, "%s: some writes failed\n", name);
+            runs = batch.runs();
+        }, patches.size());
+        fprintf(stderr, "%s: %zu page runs\n", name, runs);
+    }
+
+    // Arms @count patches with the lazy_patcher, then installs all of them (timed apart)
+    void bench_workload_lazy(const bench::fake_module& module, size_t count)
+    {
+        char arm_name[96], install_name[96];
+        snprintf(arm_name, sizeof(arm_name), "startup/mixed_%zu_lazy_arm", count);
+        snprintf(install_name, sizeof(install_name), "startup/mixed_%zu_lazy_install_all", count);
+        if(!bench::selected(arm_name) && !bench::selected(install_name)) return;
+
+        auto patches = bench::generate_workload(module, count);
+        auto& lazy = lazy_patcher::instance();
+        std::vector<double> arm_ns, install_ns;
+        size_t pages = 0;
+        for(int s = 0; s < std::max(3, bench::get_options().samples); ++s)
+        {
+            double t = bench::now();
+            for(auto& p : patches)
+            {
+                uint8_t bytes[16];
+                size_t n = patch_bytes(p, module.base, bytes);
+                lazy.add(module.base + p.offset, bytes, n);
+            }
+            pages = lazy.arm();
+            arm_ns.push_back((bench::now() - t) * 1e9 / double(count));
+
+            t = bench::now();
+            lazy.install_all();
+            install_ns.push_back((bench::now() - t) * 1e9 / double(count));
+        }
+
+        for(auto* v : { &arm_ns, &install_ns })
+        {
+            std::sort(v->begin(), v->end());
+            bench::report(v == &arm_ns? arm_name : install_name, v->size(), v->front(), (*v)[v->size() / 2],
+                          ", \"items_per_iteration\": " + std::to_string(count));
+        }
+        fprintf(stderr, "%s: %zu pages armed\n", arm_name, pages);
+    }
+
+    // Submits @count patches to the async_patcher in batches of @per_batch, times the submits and the whole
+    void bench_workload_async(const bench::fake_module& module, size_t count, size_t per_batch)
+    {
+        char submit_name[96], done_name[96];
+        snprintf(submit_name, sizeof(submit_name), "startup/mixed_%zu_async_submit", count);
+        snprintf(done_name, sizeof(done_name), "startup/mixed_%zu_async_applied", count);
+        if(!bench::selected(submit_name) && !bench::selected(done_name)) return;
+
+        auto patches = bench::generate_workload(module, count);
+        auto& patcher = async_patcher::instance();
+        std::vector<double> submit_ns, done_ns;
+        for(int s = 0; s < std::max(3, bench::get_options().samples); ++s)
+        {
+            double t = bench::now();
+            patch_batch batch;
+            for(size_t i = 0; i < patches.size(); ++i)
+            {
+                uint8_t bytes[16];
+                size_t n = patch_bytes(patches[i], module.base, bytes);
+                batch.add(module.base + patches[i].offset, bytes, n);
+                if(batch.size() == per_batch || i + 1 == patches.size())
+                    patcher.submit(std::move(batch)), batch = patch_batch();
+            }
+            submit_ns.push_back((bench::now() - t) * 1e9 / double(count));
+
+            patcher.flush();
+            done_ns.push_back((bench::now() - t) * 1e9 / double(count));
+        }
+
+        for(auto* v : { &submit_ns, &done_ns })
+        {
+            std::sort(v->begin(), v->end());
+            bench::report(v == &submit_ns? submit_name : done_name, v->size(), v->front(), (*v)[v->size() / 2],
+                          ", \"items_per_iteration\": " + std::to_string(count));
+        }
+    }
+
+    // Reloads a set of @count patches which changes by 1% each time, diffed or in full
+    void bench_reload(const bench::fake_module& module, size_t count)
+    {
+        auto patches = bench::generate_workload(module, count);
+        patch_set sets[2];
+        for(size_t i = 0; i < patches.size(); ++i)
+        {
+            uint8_t bytes[16];
+            size_t n = patch_bytes(patches[i], module.base, bytes);
+            for(int k = 0; k < 2; ++k)
+            {
+                // Every 100th entry differs between both sets
+                if(k == 1 && i % 100 == 0) bytes[0] ^= 0x01;
+                sets[k].add(module.base + patches[i].offset, bytes, n);
+            }
+        }
+
+        char name[96];
+        snprintf(name, sizeof(name), "startup/reload_%zu_diff", count);
+        if(bench::selected(name))
+        {
+            live_patch_set live;
+            live.reload(sets[0]);
+            int which = 0;
+            bench::run(name, [&] { bench::keep(live.reload(sets[which ^= 1]).changed); }, count);
+            live.revert_all();
+        }
+
+        snprintf(name, sizeof(name), "startup/reload_%zu_full", count);
+        if(bench::selected(name))
+        {
+            live_patch_set live;
+            live.reload(sets[0]);
+            int which = 0;
+            bench::run(name, [&] {
+                live.revert_all();
+                bench::keep(live.reload(sets[which ^= 1]).added);
+            }, count);
+            live.revert_all();
+        }
+    }
+
+    // The child has the module at the same address, it waits to be patched
+    void bench_workload_remote(const bench::fake_module& module, size_t count, bool batched)
+    {
+        char name[96];
+        snprintf(name, sizeof(name), "startup/mixed_%zu_remote%s", count, batched? "_batched" : "");
+        if(!bench::selected(name)) return;
+
+        pid_t child = fork();
+        if(child == 0)
+        {
+            pause();
+            _exit(0);
+        }
+
+        remote_memory mem(child);
+        if(mem.get_backend().is_open())
+        {
+            auto patches = bench::generate_workload(module, count);
+            bench::run(name, [&] {
+                if(batched) mem.get_backend().begin_batch();
+                apply_backend(mem, module.base, patches);
+                if(batched) mem.get_backend().commit();
+            }, patches.size());
+        }
+        else
+            fprintf(stderr, "%s: can't open the memory of the child process\n", name);
+
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bench::parse_args(argc, argv);
+
+    bench::fake_module module;
+    if(!module.map(6 << 20, 2 << 20))
+    {
+        fprintf(stderr, "failed to map the fake module\n");
+        return 1;
+    }
+    SetGameBaseAddress(module.base);
+
+    bench::begin("startup");
+    for(size_t count : { size_t(10000), size_t(100000) })
+        bench_workload("mixed", module, count, bench::workload_mix());
+    for(size_t count : { size_t(10000), size_t(100000) })
+        bench_workload_buffer(module, count);
+    for(size_t count : { size_t(10000), size_t(100000) })
+        bench_workload_manifest(module, count);
+    bench_workload_batch(module, 10000, false);
+    bench_workload_batch(module, 10000, true);
+    bench_workload_lazy(module, 10000);
+    bench_workload_async(module, 10000, 1000);
+    bench_reload(module, 10000);
+    bench_undo(module, 10000);
+    bench_workload_remote(module, 10000, false);
+    bench_workload_remote(module, 10000, true);
+
+    bench_workload("nop", module, 10000, bench::workload_mix { 100, 0, 0, 0 });
+    bench_workload("branch", module, 10000, bench::workload_mix { 0, 100, 0, 0 });
+    bench_workload("data", module, 10000, bench::workload_mix { 0, 0, 100, 0 });
+    bench_workload("straddle", module, 10000, bench::workload_mix { 0, 0, 0, 100 });
+    bench::end();
+
+    module.unmap();
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ *  Injectors - Synthetic patch workloads
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+ *  A fake module (read+exec text followed by read-only data) mapped anonymously, and a generator of patch sets
+ *  shaped like the ones mods apply at load time: patches come in clusters around the functions being modified,
+ *  mixing NOP runs, branch redirections, data writes and writes straddling a page boundary.
+ *  Everything is deterministic for a given seed, so the numbers are reproducible.
+ */
+#pragma once
+#include <injector/injector.hpp>
+#include <cstdint>
+#include <vector>
+#include <sys/mman.h>
+
+namespace bench
+{
+    // The fake module
+    struct fake_module
+    {
+        uintptr_t   base = 0;
+        size_t      text_size = 0;
+        size_t      data_size = 0;
+        size_t      page = 0;
+
+        bool map(size_t text, size_t data)
+        {
+            page = injector::page_size();
+            text_size = (text + page - 1) / page * page;
+            data_size = (data + page - 1) / page * page;
+
+            void* p = mmap(nullptr, size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(p == MAP_FAILED) return false;
+            base = uintptr_t(p);
+
+            auto code = (uint32_t*) p;
+            for(size_t i = 0; i < text_size / 4; ++i)
+                code[i] = (i % 16 == 15)? injector::arm64::ret() : injector::arm64::nop();
+
+            mprotect(p, text_size, PROT_READ | PROT_EXEC);
+            mprotect((void*)(base + text_size), data_size, PROT_READ);
+            return true;
+        }
+
+        void unmap()
+        {
+            if(base) munmap((void*) base, size()), base = 0;
+        }
+
+        size_t size() const { return text_size + data_size; }
+    };
+
+    // A patch, offsets are relative to the module base
+    struct patch
+    {
+        enum kind_t : uint8_t
+        {
+            nop,            // @count NOPs at @offset
+            branch,         // B at @offset to @value
+            data,           // 32 bits write of @value at @offset (data section)
+            straddle,       // 64 bits write of @value at @offset, crossing a page boundary (text section)
+        };
+
+        kind_t      kind;
+        uint8_t     count;
+        uint32_t    offset;
+        uint64_t    value;
+    };
+
+    // Proportions of each kind of patch, out of 100
+    struct workload_mix
+    {
+        unsigned nop      = 40;
+        unsigned branch   = 30;
+        unsigned data     = 20;
+        unsigned straddle = 10;
+    };
+
+    // xorshift64*, good enough and identical everywhere
+    struct xorshift
+    {
+        uint64_t s;
+        explicit xorshift(uint64_t seed) : s(seed? seed : 1) {}
+
+        uint64_t next()
+        {
+            s ^= s >> 12, s ^= s << 25, s ^= s >> 27;
+            return s * 0x2545F4914F6CDD1Dull;
+        }
+
+        uint64_t below(uint64_t n) { return next() % n; }
+    };
+
+    // Generates @count patches for @module
+    inline std::vector<patch> generate_workload(const fake_module& module, size_t count,
+                                                workload_mix mix = workload_mix(), uint64_t seed = 0x1234)
+    {
+        std::vector<patch> patches;
+        patches.reserve(count);
+        xorshift rng(seed);
+        unsigned total = mix.nop + mix.branch + mix.data + mix.straddle;
+
+        while(patches.size() < count)
+        {
+            // A cluster of patches around a function
+            uint32_t text_center = uint32_t(rng.below(module.text_size / 4) * 4);
+            uint32_t data_center = uint32_t(rng.below(module.data_size / 4) * 4);
+            size_t cluster = 1 + rng.below(16);
+
+            for(size_t i = 0; i < cluster && patches.size() < count; ++i)
+            {
+                patch p = { };
+                unsigned k = unsigned(rng.below(total));
+                int64_t spread = int64_t(rng.below(0x2000)) - 0x1000;
+
+                if(k < mix.nop)
+                {
+                    p.kind  = patch::nop;
+                    p.count = uint8_t(1 + rng.below(4));
+                    int64_t off = (int64_t(text_center) + spread) & ~int64_t(3);
+                    if(off < 0) off = 0;
+                    if(size_t(off) + p.count * 4 > module.text_size) off = module.text_size - p.count * 4;
+                    p.offset = uint32_t(off);
+                }
+                else if(k < mix.nop + mix.branch)
+                {
+                    p.kind = patch::branch;
+                    int64_t off = (int64_t(text_center) + spread) & ~int64_t(3);
+                    if(off < 0) off = 0;
+                    if(size_t(off) >= module.text_size) off = module.text_size - 4;
+                    p.offset = uint32_t(off);
+                    p.value  = rng.below(module.text_size / 4) * 4;     // Anywhere in the module, B reaches it
+                    if(p.value == p.offset) p.value = (p.value + 4) % module.text_size;
+                }
+                else if(k < mix.nop + mix.branch + mix.data)
+                {
+                    p.kind = patch::data;
+                    int64_t off = (int64_t(data_center) + spread) & ~int64_t(3);
+                    if(off < 0) off = 0;
+                    if(size_t(off) + 4 > module.data_size) off = module.data_size - 4;
+                    p.offset = uint32_t(module.text_size + off);
+                    p.value  = rng.next() & 0xFFFFFFFF;
+                }
+                else
+                {
+                    p.kind = patch::straddle;
+                    uint64_t pages = module.text_size / module.page;
+                    uint64_t boundary = (1 + (text_center / module.page + rng.below(3)) % (pages - 1)) * module.page;
+                    p.offset = uint32_t(boundary - 4);
+                    p.value  = rng.next();
+                }
+                patches.push_back(p);
+            }
+        }
+        return patches;
+    }
+}
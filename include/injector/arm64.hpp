@@ -0,0 +1,299 @@
+/*
+ *  Injectors - AArch64 Instruction Encoding and Relocation
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Pure instruction encoders/decoders, they never touch memory by themselves so they can be used to build code
+ *  into any buffer (including on a host which is not arm64).
+ */
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+namespace injector
+{
+namespace arm64
+{
+    // Intra-procedure-call scratch registers, the only ones we're allowed to clobber between two instructions
+    static const unsigned ip0 = 16;
+    static const unsigned ip1 = 17;
+    static const unsigned lr  = 30;
+    static const unsigned sp  = 31;     // (as a base register, xzr otherwise)
+
+    // Sign extends the lowest @bits of @value
+    inline int64_t sign_extend(uint64_t value, unsigned bits)
+    {
+        uint64_t m = uint64_t(1) << (bits - 1);
+        value &= (uint64_t(1) << bits) - 1;
+        return int64_t((value ^ m) - m);
+    }
+
+    // Checks if @off fits into a signed immediate with @bits bits scaled by 4 (as in branches and literals)
+    inline bool fits_pcrel(int64_t off, unsigned bits)
+    {
+        int64_t lim = int64_t(1) << (bits + 1);
+        return (off & 3) == 0 && off >= -lim && off < lim;
+    }
+
+
+    /*
+     *  Encoders
+     */
+
+    inline uint32_t nop()                       { return 0xD503201F; }
+    inline uint32_t br(unsigned rn)             { return 0xD61F0000 | (rn << 5); }
+    inline uint32_t blr(unsigned rn)            { return 0xD63F0000 | (rn << 5); }
+    inline uint32_t ret(unsigned rn = lr)       { return 0xD65F0000 | (rn << 5); }
+
+    // B / BL from @pc to @dest, the caller must check the range with is_b_range
+    inline bool     is_b_range(uintptr_t pc, uintptr_t dest) { return fits_pcrel(int64_t(dest - pc), 26); }
+    inline uint32_t b(uintptr_t pc, uintptr_t dest)          { return 0x14000000 | ((uint32_t(int64_t(dest - pc) >> 2)) & 0x3FFFFFF); }
+    inline uint32_t bl(uintptr_t pc, uintptr_t dest)         { return 0x94000000 | ((uint32_t(int64_t(dest - pc) >> 2)) & 0x3FFFFFF); }
+
+    // B with a byte offset relative to the instruction itself
+    inline uint32_t b_rel(int32_t off)          { return 0x14000000 | ((uint32_t(off) >> 2) & 0x3FFFFFF); }
+
+    // LDR Xt, #off (literal)
+    inline uint32_t ldr_x_literal(unsigned rt, int32_t off) { return 0x58000000 | (((uint32_t(off) >> 2) & 0x7FFFF) << 5) | rt; }
+
+    // ADR Xd / ADRP Xd, the caller must check the range (+/-1MB and +/-4GB respectively)
+    inline bool is_adr_range(uintptr_t pc, uintptr_t dest)  { int64_t o = int64_t(dest - pc); return o >= -(int64_t(1) << 20) && o < (int64_t(1) << 20); }
+    inline bool is_adrp_range(uintptr_t pc, uintptr_t dest) { int64_t o = int64_t((dest & ~0xFFFull) - (pc & ~0xFFFull)) >> 12; return o >= -(int64_t(1) << 20) && o < (int64_t(1) << 20); }
+
+    inline uint32_t adr_imm(uint32_t op, unsigned rd, int64_t imm)
+    {
+        uint32_t u = uint32_t(imm) & 0x1FFFFF;
+        return op | ((u & 3) << 29) | ((u >> 2) << 5) | rd;
+    }
+    inline uint32_t adr(unsigned rd, uintptr_t pc, uintptr_t dest)  { return adr_imm(0x10000000, rd, int64_t(dest - pc)); }
+    inline uint32_t adrp(unsigned rd, uintptr_t pc, uintptr_t dest) { return adr_imm(0x90000000, rd, int64_t((dest & ~0xFFFull) - (pc & ~0xFFFull)) >> 12); }
+
+    // ADD Xd, Xn, #imm12 / SUB Xd, Xn, #imm12 (Xn/Xd may be sp)
+    inline uint32_t add_imm(unsigned rd, unsigned rn, uint32_t imm) { return 0x91000000 | ((imm & 0xFFF) << 10) | (rn << 5) | rd; }
+    inline uint32_t sub_imm(unsigned rd, unsigned rn, uint32_t imm) { return 0xD1000000 | ((imm & 0xFFF) << 10) | (rn << 5) | rd; }
+
+    // MOVZ / MOVK Xd, #imm16, LSL #(hw*16)
+    inline uint32_t movz(unsigned rd, uint16_t imm, unsigned hw) { return 0xD2800000 | (hw << 21) | (uint32_t(imm) << 5) | rd; }
+    inline uint32_t movk(unsigned rd, uint16_t imm, unsigned hw) { return 0xF2800000 | (hw << 21) | (uint32_t(imm) << 5) | rd; }
+
+    // LDR / STR with unsigned scaled offset, @off is in bytes
+    inline uint32_t ldr_x(unsigned rt, unsigned rn, uint32_t off)  { return 0xF9400000 | ((off >> 3) << 10) | (rn << 5) | rt; }
+    inline uint32_t str_x(unsigned rt, unsigned rn, uint32_t off)  { return 0xF9000000 | ((off >> 3) << 10) | (rn << 5) | rt; }
+    inline uint32_t ldr_w(unsigned rt, unsigned rn, uint32_t off)  { return 0xB9400000 | ((off >> 2) << 10) | (rn << 5) | rt; }
+    inline uint32_t ldrsw(unsigned rt, unsigned rn, uint32_t off)  { return 0xB9800000 | ((off >> 2) << 10) | (rn << 5) | rt; }
+    inline uint32_t ldr_q(unsigned rt, unsigned rn, uint32_t off)  { return 0x3DC00000 | ((off >> 4) << 10) | (rn << 5) | rt; }
+    inline uint32_t str_q(unsigned rt, unsigned rn, uint32_t off)  { return 0x3D800000 | ((off >> 4) << 10) | (rn << 5) | rt; }
+
+    // LDP / STP with signed scaled offset, @off is in bytes
+    inline uint32_t ldp_x(unsigned rt, unsigned rt2, unsigned rn, int32_t off) { return 0xA9400000 | ((uint32_t(off >> 3) & 0x7F) << 15) | (rt2 << 10) | (rn << 5) | rt; }
+    inline uint32_t stp_x(unsigned rt, unsigned rt2, unsigned rn, int32_t off) { return 0xA9000000 | ((uint32_t(off >> 3) & 0x7F) << 15) | (rt2 << 10) | (rn << 5) | rt; }
+    inline uint32_t ldp_q(unsigned rt, unsigned rt2, unsigned rn, int32_t off) { return 0xAD400000 | ((uint32_t(off >> 4) & 0x7F) << 15) | (rt2 << 10) | (rn << 5) | rt; }
+    inline uint32_t stp_q(unsigned rt, unsigned rt2, unsigned rn, int32_t off) { return 0xAD000000 | ((uint32_t(off >> 4) & 0x7F) << 15) | (rt2 << 10) | (rn << 5) | rt; }
+
+    // MRS Xt, NZCV / MSR NZCV, Xt
+    inline uint32_t mrs_nzcv(unsigned rt)       { return 0xD53B4200 | rt; }
+    inline uint32_t msr_nzcv(unsigned rt)       { return 0xD51B4200 | rt; }
+
+
+    /*
+     *  Decoders
+     */
+
+    inline bool is_b(uint32_t ins)              { return (ins & 0xFC000000) == 0x14000000; }
+    inline bool is_bl(uint32_t ins)             { return (ins & 0xFC000000) == 0x94000000; }
+    inline bool is_bcond(uint32_t ins)          { return (ins & 0xFF000010) == 0x54000000; }
+    inline bool is_cbz(uint32_t ins)            { return (ins & 0x7E000000) == 0x34000000; }   // CBZ and CBNZ
+    inline bool is_tbz(uint32_t ins)            { return (ins & 0x7E000000) == 0x36000000; }   // TBZ and TBNZ
+    inline bool is_adr(uint32_t ins)            { return (ins & 0x9F000000) == 0x10000000; }
+    inline bool is_adrp(uint32_t ins)           { return (ins & 0x9F000000) == 0x90000000; }
+    inline bool is_ldr_literal(uint32_t ins)    { return (ins & 0x3B000000) == 0x18000000; }
+    inline bool is_ret(uint32_t ins)            { return (ins & 0xFFFFFC1F) == 0xD65F0000; }
+
+    // Checks whether the instruction @ins reads the program counter (and as such can't be moved around as is)
+    inline bool is_pc_relative(uint32_t ins)
+    {
+        return is_b(ins) || is_bl(ins) || is_bcond(ins) || is_cbz(ins) || is_tbz(ins)
+            || is_adr(ins) || is_adrp(ins) || is_ldr_literal(ins);
+    }
+
+    // Gets the destination of the pc relative instruction @ins placed at @pc, returns 0 if it is not pc relative
+    inline uintptr_t get_target(uint32_t ins, uintptr_t pc)
+    {
+        if(is_b(ins) || is_bl(ins))
+            return pc + (sign_extend(ins, 26) << 2);
+        if(is_bcond(ins) || is_cbz(ins) || is_ldr_literal(ins))
+            return pc + (sign_extend(ins >> 5, 19) << 2);
+        if(is_tbz(ins))
+            return pc + (sign_extend(ins >> 5, 14) << 2);
+        if(is_adr(ins) || is_adrp(ins))
+        {
+            int64_t imm = sign_extend(((ins >> 5) & 0x7FFFF) << 2 | ((ins >> 29) & 3), 21);
+            return is_adr(ins)? pc + imm : (pc & ~0xFFFull) + (imm << 12);
+        }
+        return 0;
+    }
+
+    // Replaces the branch offset of a conditional branch (B.cond/CBZ/CBNZ/TBZ/TBNZ) @ins with @off
+    inline uint32_t set_cond_offset(uint32_t ins, int32_t off)
+    {
+        if(is_tbz(ins))
+            return (ins & ~(0x3FFFu << 5)) | (((uint32_t(off) >> 2) & 0x3FFF) << 5);
+        return (ins & ~(0x7FFFFu << 5)) | (((uint32_t(off) >> 2) & 0x7FFFF) << 5);
+    }
+
+
+    /*
+     *  code_writer
+     *      Emits instructions sequentially into @out which will be executed at address @pc
+     *      (both addresses are usually the same, but may differ when building code in a separate buffer or mapping)
+     */
+    struct code_writer
+    {
+        uint32_t*   out;
+        uintptr_t   pc;
+        uint32_t*   begin;
+
+        code_writer(void* out, uintptr_t pc) : out((uint32_t*) out), pc(pc), begin((uint32_t*) out)
+        {}
+
+        void emit(uint32_t ins)
+        {
+            *out++ = ins;
+            pc += sizeof(uint32_t);
+        }
+
+        void emit64(uint64_t value)
+        {
+            memcpy(out, &value, sizeof(value));
+            out += 2; pc += sizeof(value);
+        }
+
+        void emit_bytes(const void* data, size_t size)  // size must be a multiple of 4
+        {
+            memcpy(out, data, size);
+            out += size / 4; pc += size;
+        }
+
+        // Branches to @dest from the current position, using ip0 if the destination is too far for a B
+        void emit_branch(uintptr_t dest)
+        {
+            if(is_b_range(pc, dest))
+                return emit(b(pc, dest));
+            emit(ldr_x_literal(ip0, 8));
+            emit(br(ip0));
+            emit64(dest);
+        }
+
+        // Loads the 64 bits @value into register @rd
+        void emit_load_imm(unsigned rd, uint64_t value)
+        {
+            emit(ldr_x_literal(rd, 8));
+            emit(b_rel(12));
+            emit64(value);
+        }
+
+        size_t size() const { return (out - begin) * sizeof(uint32_t); }
+    };
+
+    // Maximum amount of bytes relocate() may emit for a single instruction
+    static const size_t max_relocated_size = 6 * sizeof(uint32_t);
+
+    /*
+     *  relocate
+     *      Emits into @w code equivalent to the instruction @ins originally placed at @pc
+     *      PC-relative instructions get rewritten, using ip0 when the destination is out of reach from the new place.
+     */
+    inline void relocate(uint32_t ins, uintptr_t pc, code_writer& w)
+    {
+        uintptr_t dest = get_target(ins, pc);
+
+        if(is_b(ins) || is_bl(ins))
+        {
+            if(is_b_range(w.pc, dest))
+                return w.emit(is_bl(ins)? bl(w.pc, dest) : b(w.pc, dest));
+
+            w.emit(ldr_x_literal(ip0, 8));
+            if(is_bl(ins))                      // the call returns to the next instruction after the sequence
+            {
+                w.emit(b_rel(12));
+                w.emit64(dest);
+                return w.emit(blr(ip0));
+            }
+            w.emit(br(ip0));
+            return w.emit64(dest);
+        }
+        else if(is_bcond(ins) || is_cbz(ins) || is_tbz(ins))
+        {
+            int64_t off = int64_t(dest - w.pc);
+            if(fits_pcrel(off, is_tbz(ins)? 14 : 19))
+                return w.emit(set_cond_offset(ins, int32_t(off)));
+
+            // cond +8 ; b +20 ; ldr ip0, =dest ; br ip0
+            w.emit(set_cond_offset(ins, 8));
+            w.emit(b_rel(20));
+            w.emit(ldr_x_literal(ip0, 8));
+            w.emit(br(ip0));
+            return w.emit64(dest);
+        }
+        else if(is_adr(ins) || is_adrp(ins))
+        {
+            unsigned rd = ins & 0x1F;
+            if(is_adr(ins) && is_adr_range(w.pc, dest))
+                return w.emit(adr(rd, w.pc, dest));
+            if(is_adrp(ins) && is_adrp_range(w.pc, dest))
+                return w.emit(adrp(rd, w.pc, dest));
+            return w.emit_load_imm(rd, dest);
+        }
+        else if(is_ldr_literal(ins))
+        {
+            unsigned rt  = ins & 0x1F;
+            unsigned opc = ins >> 30;
+
+            if(ins & (1u << 26))
+            {
+                // SIMD&FP literal, copy the (read-only) constant next to the instruction instead of burning a register
+                size_t size = size_t(4) << opc;
+                w.emit((ins & 0xFF00001F) | ((8 >> 2) << 5));
+                w.emit(b_rel(int32_t(4 + size)));
+                return w.emit_bytes((const void*) dest, size);
+            }
+
+            switch(opc)
+            {
+                case 0: w.emit_load_imm(rt, dest); return w.emit(ldr_w(rt, rt, 0));
+                case 1: w.emit_load_imm(rt, dest); return w.emit(ldr_x(rt, rt, 0));
+                case 2: w.emit_load_imm(rt, dest); return w.emit(ldrsw(rt, rt, 0));
+                default: return;                // PRFM, a hint, can be dropped
+            }
+        }
+
+        return w.emit(ins);
+    }
+
+} // namespace arm64
+} // namespace injector
@@ -6,84 +6,131 @@
  *  This software is provided 'as-is', without any express or implied
  *  warranty. In no event will the authors be held liable for any damages
  *  arising from the use of this software.
- * 
+ *
  *  Permission is granted to anyone to use this software for any purpose,
  *  including commercial applications, and to alter it and redistribute it
  *  freely, subject to the following restrictions:
- * 
+ *
  *     1. The origin of this software must not be misrepresented; you must not
  *     claim that you wrote the original software. If you use this software
  *     in a product, an acknowledgment in the product documentation would be
  *     appreciated but is not required.
- * 
+ *
  *     2. Altered source versions must be plainly marked as such, and must not be
  *     misrepresented as being the original software.
- * 
+ *
  *     3. This notice may not be removed or altered from any source
  *     distribution.
  *
  */
-#pragma once
 
-// This header is very restrict about compiler and architecture
-#ifndef _MSC_VER    // MSVC is much more flexible when we're talking about inline assembly
-#error  Cannot use this header in another compiler other than MSVC
-#endif
-#ifndef _M_IX86
-#error  Supported only in x86
-#endif
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+#pragma once
 
 //
 #include "injector.hpp"
+#include "arm64.hpp"
+#include "trampoline.hpp"
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
 
 namespace injector
 {
+    /*
+     *  reg_mask
+     *      Compile-time masks selecting which registers MakeInline captures into the reg_pack
+     *
+     *      Registers which a C++ function is allowed to clobber (X0-X18, X30), NZCV and SP are preserved by default,
+     *      the mask only adds registers on top of that. Callee-saved registers (X19-X29) are preserved by the hook itself,
+     *      so they only need to be in the mask if the hook wants to read or change them.
+     *
+     *      With 'exact' in the mask only the registers in it are saved, plus X16, X17 and X30 which the stub itself
+     *      uses. The scratch registers left out must be dead at the hook point (overwritten before being read by
+     *      the code after it), the hook is free to clobber them.
+     *
+     *      FP/SIMD registers are only preserved when 'fpsimd' is in the mask. Hooks built without it must not touch
+     *      any FP/SIMD register (e.g. put them in a translation unit compiled with -mgeneral-regs-only).
+     *
+     *      Cost of the stub, on top of the hook: a store and a load per register saved (adjacent ones paired), NZCV
+     *      and SP (5 instructions), the call (4) and the relocated instruction. That's 11 stores and loads with a mask
+     *      of 0, 16 with gpr, 4 with x_range(0, 3) | exact, and 16 more of Q register pairs with fpsimd. The frame is
+     *      sizeof(reg_pack) whatever the mask, but the parts not saved are never touched. See stub/inline_call_*.
+     */
+    namespace reg_mask
+    {
+        constexpr uint64_t x(unsigned n)                        { return uint64_t(1) << n; }
+        constexpr uint64_t x_range(unsigned first, unsigned last) { return first > last? 0 : x(first) | x_range(first + 1, last); }
+
+        constexpr uint64_t scratch  = x_range(0, 18) | x(30);   // Saved unless 'exact'
+        constexpr uint64_t stub     = x(16) | x(17) | x(30);    // Always saved
+        constexpr uint64_t gpr      = x_range(0, 30);
+        constexpr uint64_t fpsimd   = uint64_t(1) << 32;
+        constexpr uint64_t exact    = uint64_t(1) << 33;
+        constexpr uint64_t all      = gpr | fpsimd;
+    }
+
     struct reg_pack
     {
         // The ordering is very important, don't change
-        // The first field is the last to be pushed and first to be poped
+        // The stub fills this structure on the stack and passes a pointer to it to the hook
 
-        // PUSHAD/POPAD -- must be the lastest fields (because of esp)
         union
         {
-            uint32_t arr[8];
-            struct { uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax; };
+            uint64_t arr[31];
+            struct { uint64_t x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15,
+                              x16, x17, x18, x19, x20, x21, x22, x23, x24, x25, x26, x27, x28, fp, lr; };
         };
 
-        // PUSHFD / POPFD
-        uint32_t ef;
-        
+        uint64_t sp;            // Stack pointer before the hook, writing to it has no effect
+        uint64_t nzcv;          // Condition flags
+        uint64_t pad;
+
+        // Only filled when the mask contains reg_mask::fpsimd
+        __uint128_t q[32];
+
         enum reg_name {
-            reg_edi, reg_esi, reg_ebp, reg_esp, reg_ebx, reg_edx, reg_ecx, reg_eax 
+            reg_x0, reg_x1, reg_x2, reg_x3, reg_x4, reg_x5, reg_x6, reg_x7, reg_x8, reg_x9, reg_x10, reg_x11,
+            reg_x12, reg_x13, reg_x14, reg_x15, reg_x16, reg_x17, reg_x18, reg_x19, reg_x20, reg_x21, reg_x22,
+            reg_x23, reg_x24, reg_x25, reg_x26, reg_x27, reg_x28, reg_fp, reg_lr
         };
-        
-        enum ef_flag {
-            carry_flag = 0, parity_flag = 2, adjust_flag = 4, zero_flag = 6, sign_flag = 7,
-            direction_flag = 10, overflow_flag = 11
+
+        enum nzcv_flag {
+            overflow_flag = 28, carry_flag = 29, zero_flag = 30, negative_flag = 31
         };
 
-        uint32_t& operator[](size_t i)
+        uint64_t& operator[](size_t i)
         { return this->arr[i]; }
-        const uint32_t& operator[](size_t i) const
+        const uint64_t& operator[](size_t i) const
         { return this->arr[i]; }
 
-        template<uint32_t bit>   // bit starts from 0, use ef_flag enum
+        template<uint32_t bit>   // use nzcv_flag enum
         bool flag()
         {
-            return (this->ef & (1 << bit)) != 0;
+            return (this->nzcv & (uint64_t(1) << bit)) != 0;
+        }
+
+        bool bhs()
+        {
+            return flag<carry_flag>();
         }
 
-        bool jnb()
+        bool blo()
         {
             return flag<carry_flag>() == false;
         }
     };
 
+    static_assert(offsetof(reg_pack, sp) == 31 * 8 && offsetof(reg_pack, nzcv) == 32 * 8, "reg_pack layout");
+    static_assert(offsetof(reg_pack, q) % 16 == 0 && sizeof(reg_pack) % 16 == 0, "reg_pack alignment");
+
     // Lowest level stuff (actual assembly) goes on the following namespace
     // PRIVATE! Skip this, not interesting for you.
     namespace injector_asm
     {
-        // Wrapper functor, so the assembly can use some templating
+        // Wrapper functor, so the stub can use some templating
         template<class T>
         struct wrapper
         {
@@ -93,30 +140,86 @@ namespace injector
             }
         };
 
-        // Constructs a reg_pack and calls the wrapper functor
-        template<class W>   // where W is of type wrapper
-        inline void __declspec(naked) make_reg_pack_and_call()
+        // Upper bound of the stub size in bytes, following the emission order of make_reg_pack_and_call:
+        // frame + gprs + nzcv/sp, q pairs, call sequence (literal included), q pairs, nzcv + gprs + frame, return branch
+        static const size_t stub_max_size = ((1 + 16 + 3) + 16 + 6 + 16 + (2 + 16 + 1) + 4) * sizeof(uint32_t)
+                                          + arm64::max_relocated_size;
+
+        // Emits stores (or loads when @load) of the general purpose registers in @mask into the reg_pack at sp
+        inline void emit_gpr_pairs(arm64::code_writer& w, uint64_t mask, bool load)
         {
-            _asm
+            for(unsigned i = 0; i <= 30; ++i)
+            {
+                if(!(mask & reg_mask::x(i)))
+                    continue;
+
+                uint32_t off = i * 8;
+                if(i < 30 && (mask & reg_mask::x(i + 1)))
+                {
+                    w.emit(load? arm64::ldp_x(i, i + 1, arm64::sp, off) : arm64::stp_x(i, i + 1, arm64::sp, off));
+                    ++i;
+                }
+                else
+                {
+                    w.emit(load? arm64::ldr_x(i, arm64::sp, off) : arm64::str_x(i, arm64::sp, off));
+                }
+            }
+        }
+
+        /*
+         *  make_reg_pack_and_call
+         *      Builds a stub near @at which constructs a reg_pack with the registers in @mask, calls @fn with it,
+         *      destructs the reg_pack back into the registers, runs the instruction originally at @at (if @relocate)
+         *      and then goes back to @ret.
+         */
+        inline memory_pointer_raw make_reg_pack_and_call(uintptr_t at, uintptr_t ret, bool relocate, uint64_t mask, void (*fn)(reg_pack*))
+        {
+            using namespace arm64;
+
+            auto stub = AllocateTrampoline(stub_max_size, raw_ptr(at));
+            if(stub.is_null())
+                return nullptr;
+
+            const uint32_t frame = sizeof(reg_pack);
+            const uint64_t gprs  = (mask & reg_mask::gpr) | ((mask & reg_mask::exact)? reg_mask::stub : reg_mask::scratch);
+            code_writer w(WritableTrampoline(stub).get<void>(), stub.as_int());
+
+            // Construct the reg_pack structure on the stack
+            w.emit(sub_imm(sp, sp, frame));
+            emit_gpr_pairs(w, gprs, false);
+            w.emit(mrs_nzcv(ip0));
+            w.emit(add_imm(ip1, sp, frame));                    // reg_pack::sp is the sp before the stub
+            w.emit(stp_x(ip1, ip0, sp, offsetof(reg_pack, sp)));
+            if(mask & reg_mask::fpsimd)
+            {
+                for(unsigned i = 0; i < 32; i += 2)
+                    w.emit(stp_q(i, i + 1, sp, offsetof(reg_pack, q) + i * 16));
+            }
+
+            // Call wrapper sending reg_pack as parameter
+            w.emit(add_imm(0, sp, 0));
+            w.emit(ldr_x_literal(ip0, 8));
+            w.emit(b_rel(12));
+            w.emit64((uintptr_t) fn);
+            w.emit(blr(ip0));
+
+            // Destructs the reg_pack from the stack
+            if(mask & reg_mask::fpsimd)
             {
-                // Construct the reg_pack structure on the stack
-                pushfd              // Pushes EFLAGS to reg_pack
-                pushad              // Pushes general purposes registers to reg_pack
-                add dword ptr[esp+12], 8     // Add 4 to reg_pack::esp 'cuz of our return pointer, let it be as before this func is called
-
-                // Call wrapper sending reg_pack as parameter
-                push esp
-                call W::call
-                add esp, 4
-
-                // Destructs the reg_pack from the stack
-                sub dword ptr[esp+12], 8   // Fix reg_pack::esp before popping it (doesn't make a difference though) (+4 because eflags)
-                popad
-                popfd               // Warning: Do not use any instruction that changes EFLAGS after this (-> sub affects EF!! <-)
-
-                // Back to normal flow
-                ret
+                for(unsigned i = 0; i < 32; i += 2)
+                    w.emit(ldp_q(i, i + 1, sp, offsetof(reg_pack, q) + i * 16));
             }
+            w.emit(ldr_x(ip0, sp, offsetof(reg_pack, nzcv)));
+            w.emit(msr_nzcv(ip0));                               // X16/X17 are restored right after
+            emit_gpr_pairs(w, gprs, true);
+            w.emit(add_imm(sp, sp, frame));
+
+            // Back to normal flow
+            if(relocate) arm64::relocate(ReadMemory<uint32_t>(raw_ptr(at)), at, w);
+            w.emit_branch(ret);
+
+            FlushInstructionCache(stub, w.size());
+            return stub;
         }
     };
 
@@ -124,24 +227,49 @@ namespace injector
     /*
      *  MakeInline
      *      Makes inline assembly (but not assembly, an actual functor of type FuncT) at address
+     *      The instruction at @at is replaced by a B into a stub and executed (relocated) after the functor returns.
+     *      Mask chooses the registers captured in the reg_pack, see reg_mask.
+     *      Returns the stub or null on failure (misaligned address, no memory in range).
      */
-    template<class FuncT>
-    void MakeInline(memory_pointer_tr at)
+    template<class FuncT, uint64_t Mask = reg_mask::all>
+    memory_pointer_raw MakeInline(memory_pointer_tr at)
     {
         typedef injector_asm::wrapper<FuncT> functor;
-        if(false) functor::call(nullptr);   // To instantiate the template, if not done _asm will fail
-        MakeCALL(at, injector_asm::make_reg_pack_and_call<functor>);
+        uintptr_t p = at.as_int();
+        if(p % 4) return nullptr;
+        INJECTOR_CLAIM_PATCH(at, sizeof(uint32_t), nullptr);
+
+        auto stub = injector_asm::make_reg_pack_and_call(p, p + 4, true, Mask, &functor::call);
+        if(stub.is_null() || !process_memory().write<uint32_t>(p, arm64::b(p, stub.as_int()), true, true))
+        {
+            INJECTOR_DROP_CLAIM(at, sizeof(uint32_t));
+            return nullptr;
+        }
+        return stub;
     }
 
     /*
      *  MakeInline
      *      Same as above, but it NOPs everything between at and end (exclusive), then performs MakeInline
+     *      Nothing in the range gets executed, the flow continues at @end after the functor.
      */
-    template<class FuncT>
-    void MakeInline(memory_pointer_tr at, memory_pointer_tr end)
+    template<class FuncT, uint64_t Mask = reg_mask::all>
+    memory_pointer_raw MakeInline(memory_pointer_tr at, memory_pointer_tr end)
     {
-        MakeRangedNOP(at, end);
-        MakeInline<FuncT>(at);
+        typedef injector_asm::wrapper<FuncT> functor;
+        uintptr_t p = at.as_int(), e = end.as_int();
+        if(p % 4 || e % 4 || e <= p) return nullptr;
+        INJECTOR_CLAIM_PATCH(at, e - p, nullptr);
+
+        // The whole range is claimed at once, so the NOPs are written without a claim of their own
+        auto stub = injector_asm::make_reg_pack_and_call(p, e, false, Mask, &functor::call);
+        process_memory mem;
+        if(stub.is_null() || !mem.make_nop(p + 4, (e - p) / 4 - 1) || !mem.write<uint32_t>(p, arm64::b(p, stub.as_int()), true, true))
+        {
+            INJECTOR_DROP_CLAIM(at, e - p);
+            return nullptr;
+        }
+        return stub;
     }
 
     /*
@@ -149,8 +277,8 @@ namespace injector
      *      Same as above, but (at,end) are template parameters.
      *      On this case the functor can be passed as argument since there will be one func instance for each at,end not just for each FuncT
      */
-    template<uintptr_t at, uintptr_t end, class FuncT>
-    void MakeInline(FuncT func)
+    template<uintptr_t at, uintptr_t end, class FuncT, uint64_t Mask = reg_mask::all>
+    memory_pointer_raw MakeInline(FuncT func)
     {
         static std::unique_ptr<FuncT> static_func;
         static_func.reset(new FuncT(std::move(func)));
@@ -163,16 +291,244 @@ namespace injector
         };
 
         // Does the actual MakeInline
-        return MakeInline<Caps>(lazy_pointer<at>::get(), lazy_pointer<end>::get());
+        return MakeInline<Caps, Mask>(lazy_pointer<at>::get(), lazy_pointer<end>::get());
     }
 
     /*
      *  MakeInline
-     *      Same as above, but (end) is calculated by the length of a call instruction
+     *      Same as above, but only the instruction at (at) gets hooked, and it is still executed after the functor
+     */
+    template<uintptr_t at, class FuncT, uint64_t Mask = reg_mask::all>
+    memory_pointer_raw MakeInline(FuncT func)
+    {
+        static std::unique_ptr<FuncT> static_func;
+        static_func.reset(new FuncT(std::move(func)));
+
+        struct Caps
+        {
+            void operator()(reg_pack& regs)
+            { (*static_func)(regs); }
+        };
+
+        return MakeInline<Caps, Mask>(lazy_pointer<at>::get());
+    }
+
+
+
+    /*
+     *  ret_pack
+     *      Registers seen by function exit (and entry) hooks
+     *      On entry they hold the arguments, on exit they hold the return value (X0/X1, Q0-Q3 for floating point aggregates)
+     */
+    struct ret_pack
+    {
+        // The ordering is very important, don't change
+
+        union
+        {
+            uint64_t arr[9];
+            struct { uint64_t x0, x1, x2, x3, x4, x5, x6, x7, x8; };
+        };
+
+        uint64_t lr;            // Where the function returns to, may be changed by the exit hook
+        uint64_t cookie;        // Free for the entry hook to store anything, handed back to the exit hook of the same call
+        uint64_t pad;
+
+        __uint128_t q[8];
+
+        uint64_t& operator[](size_t i)
+        { return this->arr[i]; }
+        const uint64_t& operator[](size_t i) const
+        { return this->arr[i]; }
+    };
+
+    static_assert(offsetof(ret_pack, lr) == 9 * 8 && offsetof(ret_pack, q) % 16 == 0 && sizeof(ret_pack) % 16 == 0, "ret_pack layout");
+
+    // Entry hook used when MakeExitHook is given none
+    struct exit_hook_noentry
+    {
+        void operator()(ret_pack&) {}
+    };
+
+    namespace injector_asm
+    {
+        /*
+         *  shadow_stack
+         *      Per-thread stack of the return addresses replaced by the exit hooks
+         *      The sp at the function entry is kept to resynchronize when frames get skipped (e.g. longjmp)
+         */
+        struct shadow_stack
+        {
+            struct frame
+            {
+                uint64_t lr;
+                uint64_t sp;
+                uint64_t cookie;
+            };
+
+            static const size_t max_depth = 128;
+
+            size_t depth;
+            frame  frames[max_depth];
+
+            static shadow_stack& get()
+            {
+                static thread_local shadow_stack s;
+                return s;
+            }
+        };
+
+        // Called by the entry stub, returns the address the function should return to
+        template<class EntryT>
+        struct exit_entry_wrapper
+        {
+            static uintptr_t call(ret_pack* regs, uintptr_t sp, uintptr_t exit_stub)
+            {
+                auto& s = shadow_stack::get();
+                if(s.depth == shadow_stack::max_depth)
+                    return regs->lr;        // Too deep, this call goes unhooked
+
+                regs->cookie = 0;
+                EntryT fun; fun(*regs);
+                s.frames[s.depth++] = shadow_stack::frame { regs->lr, sp, regs->cookie };
+                return exit_stub;
+            }
+        };
+
+        // Called by the exit stub, returns the address the function was going to return to
+        template<class ExitT>
+        struct exit_wrapper
+        {
+            static uintptr_t call(ret_pack* regs, uintptr_t sp)
+            {
+                auto& s = shadow_stack::get();
+                while(s.depth && s.frames[s.depth - 1].sp < sp)   // frames skipped by a longjmp
+                    --s.depth;
+                if(s.depth == 0 || s.frames[s.depth - 1].sp != sp)
+                    abort();                                    // Can't know where to go back to, nothing sane to do
+
+                auto& f = s.frames[--s.depth];
+                regs->lr = f.lr;
+                regs->cookie = f.cookie;
+                ExitT fun; fun(*regs);
+                return regs->lr;
+            }
+        };
+
+        // Emits the save (or restore when @load) of the ret_pack registers (but lr) at sp
+        inline void emit_ret_pack(arm64::code_writer& w, bool load)
+        {
+            emit_gpr_pairs(w, reg_mask::x_range(0, 8), load);
+            for(unsigned i = 0; i < 8; i += 2)
+            {
+                uint32_t off = offsetof(ret_pack, q) + i * 16;
+                w.emit(load? arm64::ldp_q(i, i + 1, arm64::sp, off) : arm64::stp_q(i, i + 1, arm64::sp, off));
+            }
+        }
+
+        // Emits a call to @fn
+        inline void emit_call(arm64::code_writer& w, uintptr_t fn)
+        {
+            w.emit_load_imm(arm64::ip0, fn);
+            w.emit(arm64::blr(arm64::ip0));
+        }
+
+        static const size_t exit_stubs_max_size = 2 * (16 + 5 + 4 + 5 + 16) * 4 + arm64::max_relocated_size + 16;
+
+        /*
+         *  make_exit_stubs
+         *      Builds the entry stub (to be branched to from @fn) and the exit stub (which the function returns into)
+         *      Returns the entry stub.
+         */
+        inline memory_pointer_raw make_exit_stubs(uintptr_t fn, uintptr_t on_entry, uintptr_t on_exit)
+        {
+            using namespace arm64;
+
+            auto stub = AllocateTrampoline(exit_stubs_max_size, raw_ptr(fn));
+            if(stub.is_null())
+                return nullptr;
+
+            const uint32_t frame = sizeof(ret_pack);
+            code_writer w(WritableTrampoline(stub).get<void>(), stub.as_int());
+
+            // Exit stub, the function returns here with the original lr in the shadow stack
+            uintptr_t exit_stub = w.pc;
+            w.emit(sub_imm(sp, sp, frame));
+            emit_ret_pack(w, false);
+            w.emit(add_imm(0, sp, 0));
+            w.emit(add_imm(1, sp, frame));
+            emit_call(w, on_exit);
+            w.emit(add_imm(lr, 0, 0));              // mov x30, x0
+            emit_ret_pack(w, true);
+            w.emit(add_imm(sp, sp, frame));
+            w.emit(ret());
+
+            // Entry stub, saves the arguments, pushes lr into the shadow stack and swaps lr with the exit stub
+            uintptr_t entry_stub = w.pc;
+            w.emit(sub_imm(sp, sp, frame));
+            emit_ret_pack(w, false);
+            w.emit(str_x(lr, sp, offsetof(ret_pack, lr)));
+            w.emit(add_imm(0, sp, 0));
+            w.emit(add_imm(1, sp, frame));
+            w.emit_load_imm(2, exit_stub);
+            emit_call(w, on_entry);
+            w.emit(add_imm(lr, 0, 0));
+            emit_ret_pack(w, true);
+            w.emit(add_imm(sp, sp, frame));
+
+            // Run the displaced instruction (now with the swapped lr) and continue the function
+            arm64::relocate(ReadMemory<uint32_t>(raw_ptr(fn)), fn, w);
+            w.emit_branch(fn + 4);
+
+            FlushInstructionCache(stub, w.size());
+            return raw_ptr(entry_stub);
+        }
+    };
+
+    /*
+     *  MakeExitHook
+     *      Hooks the return of the function at @fn, the functor of type ExitT gets called with the return value (ret_pack)
+     *      every time the function returns, and can change it. The functor of type EntryT gets called on entry with the
+     *      arguments and may fill ret_pack::cookie (e.g. with a timestamp) which gets handed back to the exit functor.
+     *
+     *      Works by swapping the return address (lr) on entry and keeping the original one in a per-thread shadow stack,
+     *      so there's nothing to do at the callers side and no need to find every RET in the function.
+     *      The function must not be unwound through by an exception, and its first instruction must not be a branch target.
+     *      Returns the entry stub or null on failure.
+     */
+    template<class ExitT, class EntryT = exit_hook_noentry>
+    memory_pointer_raw MakeExitHook(memory_pointer_tr fn)
+    {
+        uintptr_t p = fn.as_int();
+        if(p % 4) return nullptr;
+        INJECTOR_CLAIM_PATCH(fn, sizeof(uint32_t), nullptr);
+
+        auto stub = injector_asm::make_exit_stubs(p, (uintptr_t) &injector_asm::exit_entry_wrapper<EntryT>::call,
+                                                     (uintptr_t) &injector_asm::exit_wrapper<ExitT>::call);
+        if(stub.is_null() || !process_memory().write<uint32_t>(p, arm64::b(p, stub.as_int()), true, true))
+        {
+            INJECTOR_DROP_CLAIM(fn, sizeof(uint32_t));
+            return nullptr;
+        }
+        return stub;
+    }
+
+    /*
+     *  MakeExitHook
+     *      Same as above, but (fn) is a template parameter so the functor can be passed as argument
      */
-    template<uintptr_t at, class FuncT>
-    void MakeInline(FuncT func)
+    template<uintptr_t fn, class FuncT>
+    memory_pointer_raw MakeExitHook(FuncT func)
     {
-        return MakeInline<at, at+5, FuncT>(func);
+        static std::unique_ptr<FuncT> static_func;
+        static_func.reset(new FuncT(std::move(func)));
+
+        struct Caps
+        {
+            void operator()(ret_pack& regs)
+            { (*static_func)(regs); }
+        };
+
+        return MakeExitHook<Caps>(lazy_pointer<fn>::get());
     }
 };
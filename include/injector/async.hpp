@@ -0,0 +1,240 @@
+/*
+ *  Injectors - Asynchronous Patching
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+ *  Patching off the critical path: batches are submitted to a worker thread, which applies every batch ready at
+ *  that point in one patch_batch commit (one protection change and cache flush per run of pages), then completes
+ *  their futures and calls their callbacks.
+ *
+ *      async_patcher& patcher = async_patcher::instance();
+ *      auto hooks = patcher.submit(std::move(batch));                  // Non-critical patches
+ *      auto fix = patcher.submit(std::move(other), { hooks.id });      // Lands after (or with) hooks
+ *      ...
+ *      patcher.wait(fix.id);                                           // Before running the patched function
+ *
+ *  A batch is applied once the batches it depends on are, possibly in the same commit, where its writes still
+ *  come after theirs. Dependencies may only name earlier tickets, so there can't be cycles.
+ */
+#pragma once
+#include "injector.hpp"
+#include "batch.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace injector
+{
+    /*
+     *  async_patcher
+     *      Queue of patch batches applied by a worker thread, in dependency order
+     */
+    class async_patcher
+    {
+        public:
+            using ticket = uint64_t;
+
+            // Called on the worker thread with the ticket and the number of writes which failed
+            using callback_type = std::function<void(ticket, size_t)>;
+
+            struct handle
+            {
+                ticket                      id;
+                std::shared_future<size_t>  done;       // The number of writes which failed
+            };
+
+        private:
+            struct job
+            {
+                ticket                  id;
+                patch_batch             batch;
+                std::vector<ticket>     after;
+                callback_type           callback;
+                std::promise<size_t>    promise;
+            };
+
+            std::deque<job>             queue;
+            ticket                      finished_below = 1; // Every ticket before it is applied
+            std::unordered_set<ticket>  finished;           // The applied tickets after it (applied out of order)
+            ticket                      next_id = 1;
+            size_t                      commits = 0;
+            size_t                      in_flight = 0;  // Batches being applied
+            bool                        stopping = false;
+            mutable std::mutex          mutex;
+            std::condition_variable     wake;           // Work for the worker
+            std::condition_variable     progress;       // Some batches were applied
+            std::thread                 worker;
+
+            // Ticket 0 is never handed out (it stands for no batch), so it counts as applied
+            bool is_finished(ticket t) const
+            {
+                return t < finished_below || finished.count(t) != 0;
+            }
+
+            // Marks @t applied, the set only keeps what's past the applied prefix
+            void set_finished(ticket t)
+            {
+                finished.insert(t);
+                while(finished.erase(finished_below)) ++finished_below;
+            }
+
+            bool is_ready(const job& j, const std::unordered_set<ticket>& taken) const
+            {
+                return std::all_of(j.after.begin(), j.after.end(), [&](ticket t) { return is_finished(t) || taken.count(t); });
+            }
+
+            void run()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                for(;;)
+                {
+                    wake.wait(lock, [&] { return stopping || !queue.empty(); });
+                    if(queue.empty()) break;
+
+                    // Everything ready, in submission order, a batch may depend on one taken just before
+                    std::vector<job> pass;
+                    std::unordered_set<ticket> taken;
+                    for(auto it = queue.begin(); it != queue.end(); )
+                    {
+                        if(is_ready(*it, taken))
+                        {
+                            taken.insert(it->id);
+                            pass.push_back(std::move(*it));
+                            it = queue.erase(it);
+                        }
+                        else ++it;
+                    }
+                    in_flight = pass.size();
+                    lock.unlock();
+
+                    patch_batch combined;
+                    std::vector<size_t> first, failed_writes;
+                    for(auto& j : pass)
+                        first.push_back(combined.append(j.batch));
+                    combined.commit(&failed_writes);
+
+                    std::vector<size_t> failed(pass.size(), 0);
+                    for(size_t w : failed_writes)
+                        ++failed[size_t(std::upper_bound(first.begin(), first.end(), w) - first.begin()) - 1];
+
+                    for(size_t i = 0; i < pass.size(); ++i)
+                        if(pass[i].callback) pass[i].callback(pass[i].id, failed[i]);
+
+                    lock.lock();
+                    for(ticket t : taken) set_finished(t);
+                    in_flight = 0;
+                    ++commits;
+                    progress.notify_all();
+
+                    // After is_done() says so
+                    for(size_t i = 0; i < pass.size(); ++i)
+                        pass[i].promise.set_value(failed[i]);
+                }
+            }
+
+        public:
+            async_patcher() : worker([this] { run(); })
+            {
+            }
+
+            // Applies what's still queued and stops the worker
+            ~async_patcher()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                }
+                wake.notify_one();
+                worker.join();
+            }
+
+            async_patcher(const async_patcher&) = delete;
+            async_patcher& operator=(const async_patcher&) = delete;
+
+            static async_patcher& instance()
+            {
+                static async_patcher patcher;
+                return patcher;
+            }
+
+            // Queues @batch, to be applied after the batches @after (tickets from previous submits)
+            // @callback is called on the worker thread once it's applied.
+            handle submit(patch_batch batch, std::vector<ticket> after = { }, callback_type callback = nullptr)
+            {
+                job j;
+                j.batch = std::move(batch);
+                j.callback = std::move(callback);
+                auto future = j.promise.get_future().share();
+
+                std::lock_guard<std::mutex> lock(mutex);
+                j.id = next_id++;
+                for(ticket t : after)
+                    if(t < j.id && !is_finished(t)) j.after.push_back(t);     // Unknown tickets can't be waited for
+                handle h = { j.id, future };
+                queue.push_back(std::move(j));
+                wake.notify_one();
+                return h;
+            }
+
+            // Has the batch @id been applied?
+            bool is_done(ticket id) const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return is_finished(id);
+            }
+
+            // Waits until the batch @id is applied
+            void wait(ticket id)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                progress.wait(lock, [&] { return is_finished(id) || id >= next_id; });
+            }
+
+            // Waits until the queue is empty and nothing is being applied
+            void flush()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                progress.wait(lock, [&] { return queue.empty() && in_flight == 0; });
+            }
+
+            // Batches waiting to be applied
+            size_t size() const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return queue.size();
+            }
+
+            // Commits done by the worker, each applying one or more batches
+            size_t commit_count() const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return commits;
+            }
+    };
+}
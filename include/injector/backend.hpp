@@ -0,0 +1,415 @@
+/*
+ *  Injectors - Memory Backends
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  The memory backends other than the running process, so the same patching code can target a plain byte buffer,
+ *  a file or another process (and run on any host, e.g. against buffers).
+ *
+ *  basic_memory_access<Backend> and process_backend live in injector.hpp, the free functions (WriteMemoryRaw,
+ *  MakeB, MakeNOP...) being process_memory. See process_backend for what a backend must provide.
+ */
+#pragma once
+#include "injector.hpp"
+#include "arm64.hpp"
+#include "maps.hpp"
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+namespace injector
+{
+    /*
+     *  buffer_backend
+     *      A byte buffer standing for the memory at [@base, @base + @size)
+     */
+    class buffer_backend
+    {
+        private:
+            uint8_t*    data;
+            size_t      size;
+            uintptr_t   base;
+
+        public:
+            buffer_backend(void* data, size_t size, uintptr_t base = 0)
+                : data((uint8_t*) data), size(size), base(base)
+            {}
+
+            explicit buffer_backend(std::vector<uint8_t>& buf, uintptr_t base = 0)
+                : data(buf.data()), size(buf.size()), base(base)
+            {}
+
+            bool contains(uintptr_t addr, size_t n) const
+            {
+                return addr >= base && addr - base <= size && n <= size - (addr - base);
+            }
+
+            uint8_t* get(uintptr_t addr) const { return data + (addr - base); }
+
+            bool read(uintptr_t addr, void* out, size_t n)
+            {
+                if(!contains(addr, n)) return false;
+                memcpy(out, get(addr), n);
+                return true;
+            }
+
+            bool write(uintptr_t addr, const void* in, size_t n, bool, bool)
+            {
+                if(!contains(addr, n)) return false;
+                memcpy(get(addr), in, n);
+                return true;
+            }
+    };
+
+    /*
+     *  file_backend
+     *      A file mapped (shared, writes go to the file) at the address @base, the file offset is addr - base
+     */
+    class file_backend
+    {
+        private:
+            void*       map = nullptr;
+            size_t      size = 0;
+            uintptr_t   base = 0;
+            bool        writable = false;
+
+        public:
+            file_backend() = default;
+            file_backend(const char* path, bool writable, uintptr_t base = 0)
+            {
+                this->open(path, writable, base);
+            }
+
+            ~file_backend()
+            {
+                this->close();
+            }
+
+            file_backend(const file_backend&) = delete;
+            file_backend& operator=(const file_backend&) = delete;
+
+            // Maps the file at @path, returns false on failure
+            bool open(const char* path, bool writable, uintptr_t base = 0)
+            {
+                this->close();
+                int fd = ::open(path, (writable? O_RDWR : O_RDONLY) | O_CLOEXEC);
+                if(fd == -1) return false;
+
+                struct stat st;
+                if(fstat(fd, &st) == 0 && st.st_size > 0)
+                {
+                    void* p = mmap(nullptr, size_t(st.st_size), PROT_READ | (writable? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+                    if(p != MAP_FAILED)
+                        this->map = p, this->size = size_t(st.st_size), this->base = base, this->writable = writable;
+                }
+                ::close(fd);
+                return this->map != nullptr;
+            }
+
+            void close()
+            {
+                if(map) munmap(map, size), map = nullptr, size = 0, writable = false;
+            }
+
+            // Writes the changes back to the file
+            bool sync()
+            {
+                return map && msync(map, size, MS_SYNC) == 0;
+            }
+
+            bool is_open() const { return map != nullptr; }
+            bool is_writable() const { return writable; }
+            size_t file_size() const { return size; }
+
+            bool read(uintptr_t addr, void* out, size_t n)
+            {
+                if(!map || addr < base || addr - base > size || n > size - (addr - base)) return false;
+                memcpy(out, (uint8_t*) map + (addr - base), n);
+                return true;
+            }
+
+            // Fails if the file was opened read-only (the mapping has no PROT_WRITE)
+            bool write(uintptr_t addr, const void* in, size_t n, bool, bool)
+            {
+                if(!map || !writable || addr < base || addr - base > size || n > size - (addr - base)) return false;
+                memcpy((uint8_t*) map + (addr - base), in, n);
+                return true;
+            }
+    };
+
+    /*
+     *  remote_backend
+     *      The memory of another process, through /proc/pid/mem (which ignores page protections, so no remote
+     *      mprotect is needed). Requires ptrace access to the process.
+     *
+     *      Between begin_batch() and commit() writes are queued instead of done one syscall each. commit() reads
+     *      the touched pages once (process_vm_readv), applies the queued writes to that copy in order, then puts
+     *      the changed bytes back: the ones in writable mappings with as few process_vm_writev calls as possible
+     *      (up to IOV_MAX ranges each), the ones in read-only/text mappings with one /proc/pid/mem write per run of
+     *      touched pages. Thousands of patches take a handful of syscalls.
+     *      Text runs are written back whole (untouched bytes included), so the process should be stopped (e.g.
+     *      freshly spawned and not yet running) while committing, which is the expected use anyway.
+     */
+    class remote_backend
+    {
+        protected:
+            // A queued write, its bytes are at staging[offset]
+            struct pending_write
+            {
+                uintptr_t   addr;
+                size_t      offset;
+                size_t      size;
+            };
+
+            pid_t                       pid = 0;
+            int                         fd = -1;
+            bool                        batching = false;
+            std::vector<pending_write>  pending;
+            std::vector<uint8_t>        staging;
+            size_t                      syscalls = 0;
+
+        public:
+            remote_backend() = default;
+            explicit remote_backend(pid_t pid)
+            {
+                this->open(pid);
+            }
+
+            ~remote_backend()
+            {
+                this->close();
+            }
+
+            remote_backend(const remote_backend&) = delete;
+            remote_backend& operator=(const remote_backend&) = delete;
+
+            bool open(pid_t pid)
+            {
+                this->close();
+                char path[64];
+                snprintf(path, sizeof(path), "/proc/%d/mem", (int) pid);
+                this->fd = ::open(path, O_RDWR | O_CLOEXEC);
+                this->pid = pid;
+                return this->fd != -1;
+            }
+
+            // Closes the process memory, queued writes are discarded
+            void close()
+            {
+                this->discard();
+                if(fd != -1) ::close(fd), fd = -1;
+            }
+
+            bool is_open() const { return fd != -1; }
+            pid_t get_pid() const { return pid; }
+
+            // Number of syscalls done to read/write the remote memory so far
+            size_t syscall_count() const { return syscalls; }
+
+            // Number of writes waiting for commit()
+            size_t pending_count() const { return pending.size(); }
+
+            // Starts queueing writes until commit()
+            void begin_batch()
+            {
+                this->batching = true;
+            }
+
+            // Drops the queued writes and stops queueing
+            void discard()
+            {
+                this->batching = false;
+                this->pending.clear();
+                this->staging.clear();
+            }
+
+            // Does the queued writes and stops queueing, returns false if any of them failed
+            bool commit()
+            {
+                this->batching = false;
+                bool ok = pending.empty() || (fd != -1 && flush());
+                this->pending.clear();
+                this->staging.clear();
+                return ok;
+            }
+
+            // Reads remote memory, queued writes included
+            bool read(uintptr_t addr, void* out, size_t n)
+            {
+                ++syscalls;
+                if(fd == -1 || pread(fd, out, n, off_t(addr)) != ssize_t(n))
+                    return false;
+
+                for(auto& w : pending)
+                {
+                    uintptr_t lo = std::max(addr, w.addr), hi = std::min(addr + n, w.addr + w.size);
+                    if(lo < hi) memcpy((uint8_t*) out + (lo - addr), staging.data() + w.offset + (lo - w.addr), hi - lo);
+                }
+                return true;
+            }
+
+            // The kernel keeps the remote instruction cache coherent for /proc/pid/mem and process_vm_writev writes
+            bool write(uintptr_t addr, const void* in, size_t n, bool, bool)
+            {
+                if(fd == -1) return false;
+                if(batching)
+                {
+                    if(n == 0) return true;
+                    pending.push_back(pending_write { addr, staging.size(), n });
+                    staging.insert(staging.end(), (const uint8_t*) in, (const uint8_t*) in + n);
+                    return true;
+                }
+                ++syscalls;
+                return pwrite(fd, in, n, off_t(addr)) == ssize_t(n);
+            }
+
+        protected:
+            // Writes the queued writes into the process
+            bool flush()
+            {
+                const size_t page = size_t(page_size());
+
+                // The touched pages, sorted
+                std::vector<uintptr_t> pages;
+                for(auto& w : pending)
+                    for(uintptr_t p = w.addr & ~(page - 1); p < w.addr + w.size; p += page)
+                        pages.push_back(p);
+                std::sort(pages.begin(), pages.end());
+                pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+                // A copy of them, pages[i] is at image[i * page], consecutive pages are contiguous
+                std::vector<uint8_t> image(pages.size() * page);
+                auto local = [&](uintptr_t addr) -> uint8_t* {
+                    size_t i = size_t(std::lower_bound(pages.begin(), pages.end(), addr & ~(page - 1)) - pages.begin());
+                    return image.data() + i * page + (addr & (page - 1));
+                };
+
+                // Runs of consecutive pages, as [first, last) indices into pages
+                std::vector<std::pair<size_t, size_t>> runs;
+                for(size_t i = 0; i < pages.size(); ++i)
+                {
+                    if(runs.empty() || pages[i] != pages[i - 1] + page) runs.emplace_back(i, i + 1);
+                    else runs.back().second = i + 1;
+                }
+
+                std::vector<struct iovec> liov, riov;
+                for(auto& r : runs)
+                {
+                    liov.push_back({ image.data() + r.first * page, (r.second - r.first) * page });
+                    riov.push_back({ (void*) pages[r.first], (r.second - r.first) * page });
+                }
+                if(!transfer(liov, riov, false))
+                    return false;
+
+                // Apply the writes in order and collect the changed ranges, merged
+                std::vector<std::pair<uintptr_t, uintptr_t>> ranges;
+                for(auto& w : pending)
+                {
+                    memcpy(local(w.addr), staging.data() + w.offset, w.size);
+                    ranges.emplace_back(w.addr, w.addr + w.size);
+                }
+                std::sort(ranges.begin(), ranges.end());
+                size_t merged = 0;
+                for(size_t i = 1; i < ranges.size(); ++i)
+                {
+                    if(ranges[i].first <= ranges[merged].second) ranges[merged].second = std::max(ranges[merged].second, ranges[i].second);
+                    else ranges[++merged] = ranges[i];
+                }
+                ranges.resize(merged + 1);
+
+                // Writable ranges go with process_vm_writev, the others are grouped per run of touched pages
+                // (everything in between is in the copy and unchanged) for /proc/pid/mem
+                memory_map map(pid);
+                std::vector<std::pair<uintptr_t, uintptr_t>> text;
+                liov.clear(), riov.clear();
+                for(auto& r : ranges)
+                {
+                    auto region = map.find(r.first);
+                    if(region && (region->prot & PROT_WRITE) && r.second <= region->end)
+                    {
+                        liov.push_back({ local(r.first), r.second - r.first });
+                        riov.push_back({ (void*) r.first, r.second - r.first });
+                    }
+                    else if(!text.empty() && (r.first & ~(page - 1)) <= ((text.back().second - 1) & ~(page - 1)) + page)
+                        text.back().second = r.second;
+                    else
+                        text.emplace_back(r);
+                }
+
+                bool ok = transfer(liov, riov, true);
+                for(auto& t : text)
+                {
+                    ++syscalls;
+                    if(pwrite(fd, local(t.first), t.second - t.first, off_t(t.first)) != ssize_t(t.second - t.first))
+                        ok = false;
+                }
+                return ok;
+            }
+
+            // Moves the ranges @liov <-> @riov with process_vm_readv/process_vm_writev, IOV_MAX at a time
+            // Whatever they can't do (e.g. protections) is retried through /proc/pid/mem
+            bool transfer(const std::vector<struct iovec>& liov, const std::vector<struct iovec>& riov, bool write)
+            {
+                const size_t batch = IOV_MAX;
+                bool ok = true;
+                for(size_t first = 0; first < liov.size(); first += batch)
+                {
+                    size_t count = std::min(batch, liov.size() - first);
+                    ++syscalls;
+                    ssize_t done = write? process_vm_writev(pid, &liov[first], count, &riov[first], count, 0)
+                                        : process_vm_readv(pid, &liov[first], count, &riov[first], count, 0);
+                    size_t left = done < 0? 0 : size_t(done);
+
+                    // A partial transfer stops at the first failing range, do the rest one by one
+                    for(size_t i = first; i < first + count; ++i)
+                    {
+                        size_t len = liov[i].iov_len, skip = std::min(left, len);
+                        left -= skip;
+                        if(skip == len) continue;
+
+                        auto lbuf = (uint8_t*) liov[i].iov_base + skip;
+                        auto raddr = off_t(uintptr_t(riov[i].iov_base) + skip);
+                        ++syscalls;
+                        ssize_t r = write? pwrite(fd, lbuf, len - skip, raddr) : pread(fd, lbuf, len - skip, raddr);
+                        if(r != ssize_t(len - skip)) ok = false;
+                    }
+                }
+                return ok;
+            }
+    };
+
+    using buffer_memory  = basic_memory_access<buffer_backend>;
+    using file_memory    = basic_memory_access<file_backend>;
+    using remote_memory  = basic_memory_access<remote_backend>;
+}
@@ -0,0 +1,232 @@
+/*
+ *  Injectors - Batched Patching
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Writes many patches to the running process with one protection change and one instruction cache flush per run
+ *  of contiguous pages, instead of an unprotect/write/reprotect/flush cycle per patch. The original protection of
+ *  every page is taken from /proc/self/maps (read once per commit) and restored afterwards, unlike UnprotectMemory
+ *  which has to be told whether the memory is executable.
+ *
+ *  With swap_pages(true) the read-only pages (code) aren't written in place: every run of touched pages is copied
+ *  into a new private mapping, patched there, given the original protection and moved over the original pages by
+ *  one mremap(MREMAP_FIXED). Another thread sees either none or all of the writes to these pages, never e.g. half
+ *  of a MakeBR sequence. The swapped pages become anonymous memory (they aren't shared with the file anymore and
+ *  lose their path in /proc/self/maps), which is what a private file mapping written in place becomes anyway.
+ *  Writable and shared mappings are still written in place, a concurrent write to them would be lost in the copy.
+ */
+#pragma once
+#include "injector.hpp"
+#include "maps.hpp"
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <sys/mman.h>
+
+namespace injector
+{
+    /*
+     *  patch_batch
+     *      Queued writes to the running process, done by commit()
+     *      Addresses are absolute (already translated). Overlapping writes are done in the order they were added.
+     */
+    class patch_batch
+    {
+        private:
+            struct pending_write
+            {
+                uintptr_t   addr;
+                size_t      offset;         // Into staging
+                size_t      size;
+                size_t      seq;
+            };
+
+            // Untouched pages a run of pages may span
+            static const size_t max_hole_pages = 16;
+
+            std::vector<pending_write>  pending;
+            std::vector<uint8_t>        staging;
+            size_t                      page_runs = 0;
+            bool                        swap = false;
+
+            // Installs a patched copy of [begin, end) over it, returns false if the run has to be written in place
+            bool swap_run(uintptr_t begin, uintptr_t end, unsigned int prot, const std::vector<const pending_write*>& run)
+            {
+                size_t size = end - begin;
+                if(!(prot & PROT_READ)) return false;
+
+                void* copy = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(copy == MAP_FAILED) return false;
+
+                memcpy(copy, (const void*) begin, size);
+                for(auto w : run)
+                    memcpy((uint8_t*) copy + (w->addr - begin), staging.data() + w->offset, w->size);
+
+                if(mprotect(copy, size, prot) != 0
+                || mremap(copy, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, (void*) begin) == MAP_FAILED)
+                {
+                    munmap(copy, size);
+                    return false;
+                }
+                return true;
+            }
+
+        public:
+            // Queues writing @size bytes from @in at @addr, returns the index of the write
+            size_t add(uintptr_t addr, const void* in, size_t size)
+            {
+                pending.push_back(pending_write { addr, staging.size(), size, pending.size() });
+                staging.insert(staging.end(), (const uint8_t*) in, (const uint8_t*) in + size);
+                return pending.size() - 1;
+            }
+
+            // Queues writing the object @value at @addr, returns the index of the write
+            template<class T>
+            size_t add(uintptr_t addr, const T& value)
+            {
+                return this->add(addr, &value, sizeof(T));
+            }
+
+            // Queues the writes of @other after the ones queued here, returns the index of its first write
+            size_t append(const patch_batch& other)
+            {
+                size_t first = pending.size();
+                for(auto& w : other.pending)
+                    pending.push_back(pending_write { w.addr, staging.size() + w.offset, w.size, first + w.seq });
+                staging.insert(staging.end(), other.staging.begin(), other.staging.end());
+                return first;
+            }
+
+            size_t size() const { return pending.size(); }
+            bool empty() const { return pending.empty(); }
+
+            // Number of page runs (protection changes or page swaps) done by the last commit()
+            size_t runs() const { return page_runs; }
+
+            // Replaces the read-only pages by patched copies instead of writing them in place (see above)
+            void swap_pages(bool enable) { swap = enable; }
+            bool swaps_pages() const { return swap; }
+
+            // Drops the queued writes
+            void clear()
+            {
+                pending.clear();
+                staging.clear();
+            }
+
+            // Does the queued writes, returns the number of them which failed (unmapped or unprotectable memory)
+            // The indices of the failed writes go to @failed_writes. The queue is emptied either way.
+            // @maps may give a current snapshot of /proc/self/maps, to avoid reading it again (it's read anyway if
+            // the before_write_hook changes a protection).
+            size_t commit(std::vector<size_t>* failed_writes = nullptr, const memory_map* maps = nullptr)
+            {
+                const uintptr_t page = page_size();
+                size_t failed = 0;
+                page_runs = 0;
+
+                // Armed lazy pages are installed first, which makes a given snapshot stale
+                bool changed = false;
+                for(auto& w : pending) changed |= run_before_write_hook(w.addr, w.size);
+
+                memory_map self;
+                if(maps == nullptr || changed) self.read(), maps = &self;
+                const memory_map& map = *maps;
+
+                std::sort(pending.begin(), pending.end(), [](const pending_write& a, const pending_write& b) {
+                    return a.addr < b.addr || (a.addr == b.addr && a.seq < b.seq);
+                });
+
+                std::vector<const pending_write*> run;
+                for(size_t i = 0; i < pending.size(); )
+                {
+                    // The run of writes within contiguous pages of the same mapping
+                    auto region = map.find(pending[i].addr);
+                    uintptr_t last = pending[i].addr + pending[i].size;
+                    if(region == nullptr || last > region->end)
+                    {
+                        if(failed_writes) failed_writes->push_back(pending[i].seq);
+                        ++failed, ++i;
+                        continue;
+                    }
+
+                    // Runs are allowed small holes, a few more pages in one mprotect are cheaper than another VMA split
+                    // Swapped runs aren't, the untouched pages would be copied for nothing
+                    bool exec = (region->prot & PROT_EXEC) != 0;
+                    bool writable = (region->prot & PROT_WRITE) != 0;
+                    bool swapped = swap && !writable && !region->shared;
+                    uintptr_t reach = (swapped? 1 : max_hole_pages) * page;
+
+                    uintptr_t begin = pending[i].addr & ~(page - 1);
+                    uintptr_t end   = (last + page - 1) & ~(page - 1);
+                    size_t    first = i;
+                    run.clear();
+                    for(; i < pending.size() && pending[i].addr < end + reach && pending[i].addr + pending[i].size <= region->end; ++i)
+                    {
+                        run.push_back(&pending[i]);
+                        last = std::max(last, pending[i].addr + pending[i].size);
+                        end  = (last + page - 1) & ~(page - 1);
+                    }
+
+                    ++page_runs;
+                    std::sort(run.begin(), run.end(), [](const pending_write* a, const pending_write* b) { return a->seq < b->seq; });
+                    if(!swapped || !swap_run(begin, end, region->prot, run))
+                    {
+                        if(!writable && mprotect((void*) begin, end - begin, region->prot | PROT_READ | PROT_WRITE) != 0)
+                        {
+                            if(failed_writes) for(auto w : run) failed_writes->push_back(w->seq);
+                            failed += run.size();
+                            continue;
+                        }
+
+                        for(auto w : run)
+                            memcpy((void*) w->addr, staging.data() + w->offset, w->size);
+
+                        if(!writable) mprotect((void*) begin, end - begin, region->prot);
+                    }
+
+                    // Flush the written clusters (in address order), not the holes
+                    if(exec)
+                    {
+                        uintptr_t lo = pending[first].addr, hi = lo;
+                        for(size_t k = first; k <= i; ++k)
+                        {
+                            if(k == i || pending[k].addr > hi + page)
+                            {
+                                __builtin___clear_cache((char*) lo, (char*) hi);
+                                if(k == i) break;
+                                lo = pending[k].addr;
+                            }
+                            hi = std::max(hi, pending[k].addr + pending[k].size);
+                        }
+                    }
+                }
+
+                this->clear();
+                return failed;
+            }
+    };
+}
@@ -64,7 +64,7 @@ namespace injector
         // Call function at @p returning @Ret with args @Args
         static Ret call(memory_pointer_tr p, Args... a)
         {
-            auto fn = (Ret(__stdcall *)(Args...)) p.get<void>();
+            auto fn = (Ret(INJECTOR_STDCALL *)(Args...)) p.get<void>();
             return fn(std::forward<Args>(a)...);
         }
 
@@ -84,7 +84,7 @@ namespace injector
         // Call function at @p returning @Ret with args @Args
         static Ret call(memory_pointer_tr p, Args... a)
         {
-            auto fn = (Ret(__fastcall *)(Args...)) p.get<void>();;
+            auto fn = (Ret(INJECTOR_FASTCALL *)(Args...)) p.get<void>();;
             return fn(std::forward<Args>(a)...);
         }
 
@@ -104,7 +104,7 @@ namespace injector
         // Call function at @p returning @Ret with args @Args
         static Ret call(memory_pointer_tr p, Args... a)
         {
-            auto fn = (Ret(__thiscall *)(Args...)) p.get<void>();
+            auto fn = (Ret(INJECTOR_THISCALL *)(Args...)) p.get<void>();
             return fn(std::forward<Args>(a)...);
         }
 
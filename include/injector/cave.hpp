@@ -0,0 +1,314 @@
+/*
+ *  Injectors - Code Caves
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Code caves: the alignment padding between the functions of a module (runs of zeros or NOPs) is unused
+ *  memory already mapped executable next to the code, a good place for small veneers and stubs. No new mapping,
+ *  no syscall to get it, and it's close to the call sites (B range, same pages in the I-cache and TLB).
+ *
+ *      cave_index& caves = cave_index::instance();
+ *      caves.scan_module("libgame.so");
+ *      auto p = caves.allocate(12, at);            // Within B range of at
+ *      MakeBR(p, dest);                            // It's code memory, write it like the rest of the module
+ *
+ *  Only zero words (UDF #0) and NOPs are filler, a UDF with another immediate is a deliberate trap. A run counts as
+ *  padding when it ends at a function alignment boundary (cave_index::boundary) and follows an unconditional
+ *  branch or return: a NOP run elsewhere may be executed (e.g. loop alignment), and zeros elsewhere may be data in
+ *  the text (literal pools, jump tables). Data right after a branch could still fool the scanner, keep min_size
+ *  large enough for the module at hand.
+ */
+#pragma once
+#include "injector.hpp"
+#include "arm64.hpp"
+#include "maps.hpp"
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace injector
+{
+    /*
+     *  cave_index
+     *      The free padding of the scanned code, by size and by address, with a best-fit allocator
+     */
+    class cave_index
+    {
+        public:
+            static const size_t boundary = 16;          // Functions are aligned to at least this
+            static const uintptr_t max_distance = 0x8000000;   // B range
+
+        private:
+            std::map<uintptr_t, size_t>                 by_addr;        // begin -> size
+            std::set<std::pair<size_t, uintptr_t>>      by_size;        // (size, begin)
+            size_t                                      free_total = 0;
+            mutable std::mutex                          mutex;
+
+            // Padding instructions, zero (UDF #0) and NOP
+            static bool is_filler(uint32_t w)
+            {
+                return w == 0 || w == 0xD503201F;
+            }
+
+            // B, BR and RET: the next instruction only runs if something branches to it
+            static bool is_terminator(uint32_t w)
+            {
+                return (w & 0xFC000000) == 0x14000000 || (w & 0xFFFFFC1F) == 0xD61F0000 || (w & 0xFFFFFC1F) == 0xD65F0000;
+            }
+
+            void insert(uintptr_t begin, size_t size)
+            {
+                if(size < sizeof(uint32_t)) return;
+                by_addr[begin] = size;
+                by_size.emplace(size, begin);
+                free_total += size;
+            }
+
+            void erase(std::map<uintptr_t, size_t>::iterator it)
+            {
+                by_size.erase(std::make_pair(it->second, it->first));
+                free_total -= it->second;
+                by_addr.erase(it);
+            }
+
+            // Does [begin, begin + size) still hold only padding? (a patch may have used it since the scan)
+            static bool still_free(uintptr_t begin, size_t size)
+            {
+                for(uintptr_t p = begin; p < begin + size; p += 4)
+                    if(!is_filler(*(const uint32_t*) p)) return false;
+                return true;
+            }
+
+        public:
+            static cave_index& instance()
+            {
+                static cave_index index;
+                return index;
+            }
+
+            /*
+             *  Calls @fn(begin, size) for every cave of at least @min_size bytes in the code [@begin, @begin + @size)
+             *  Filler words are searched four at a time, most blocks hold none and are skipped with a single test.
+             */
+            template<class F>
+            static void find_caves(uintptr_t begin, size_t size, size_t min_size, F fn)
+            {
+                typedef uint32_t vec4 __attribute__((vector_size(16)));
+
+                auto code = (const uint32_t*) ((begin + 3) & ~uintptr_t(3));
+                size_t count = (begin + size - uintptr_t(code)) / 4;
+                size_t run = 0;                 // Index of the first filler of the current run
+                bool   in_run = false;
+
+                auto close = [&](size_t end) {
+                    if(!in_run) return;
+                    in_run = false;
+                    uintptr_t b = uintptr_t(code + run), e = uintptr_t(code + end);
+                    if(e % boundary != 0 && end != count) return;       // Not padding up to a function
+                    if(e - b < min_size) return;
+                    // Padding follows a terminator, anything else may be executed or read
+                    if(run == 0 || !is_terminator(code[run - 1])) return;
+                    fn(b, e - b);
+                };
+
+                size_t i = 0;
+                const vec4 nop = { 0xD503201F, 0xD503201F, 0xD503201F, 0xD503201F };
+                auto fillers = [&](size_t at) {
+                    vec4 w;
+                    memcpy(&w, code + at, sizeof(w));
+                    return (w == 0) | (w == nop);
+                };
+
+                for(; i + 4 <= count; i += 4)
+                {
+                    // Outside of a run, skip 16 instructions at a time while there's no filler
+                    if(!in_run)
+                    {
+                        while(i + 16 <= count)
+                        {
+                            auto any = fillers(i) | fillers(i + 4) | fillers(i + 8) | fillers(i + 12);
+                            if((any[0] | any[1] | any[2] | any[3]) != 0) break;
+                            i += 16;
+                        }
+                        if(i + 4 > count) break;
+                    }
+
+                    auto filler = fillers(i);
+                    if((filler[0] | filler[1] | filler[2] | filler[3]) == 0)
+                    {
+                        close(i);
+                        continue;
+                    }
+
+                    for(size_t k = 0; k < 4; ++k)
+                    {
+                        if(filler[k]) { if(!in_run) in_run = true, run = i + k; }
+                        else close(i + k);
+                    }
+                }
+                for(; i < count; ++i)
+                {
+                    if(is_filler(code[i])) { if(!in_run) in_run = true, run = i; }
+                    else close(i);
+                }
+                close(count);
+            }
+
+            // Indexes the caves of at least @min_size bytes in the code [@begin, @begin + @size), returns how many
+            size_t scan(uintptr_t begin, size_t size, size_t min_size = 16)
+            {
+                size_t found = 0;
+                std::lock_guard<std::mutex> lock(mutex);
+                find_caves(begin, size, min_size, [&](uintptr_t b, size_t n) {
+                    if(by_addr.count(b)) return;
+                    this->insert(b, n);
+                    ++found;
+                });
+                return found;
+            }
+
+            // Indexes the caves of the executable mappings whose path ends with @path_suffix, returns how many
+            size_t scan_module(const char* path_suffix, size_t min_size = 16)
+            {
+                memory_map maps(0);
+                size_t found = 0, n = strlen(path_suffix);
+                for(auto& r : maps.get())
+                {
+                    if(!(r.prot & PROT_EXEC) || !(r.prot & PROT_READ) || r.path.size() < n) continue;
+                    if(r.path.compare(r.path.size() - n, n, path_suffix) != 0) continue;
+                    found += scan(r.begin, r.end - r.begin, min_size);
+                }
+                return found;
+            }
+
+            /*
+             *  Gets @size bytes of cave aligned to @align, reachable by a B at @near (anywhere if null)
+             *  The smallest cave which fits is used. Returns null when there's none.
+             */
+            memory_pointer_raw allocate(size_t size, memory_pointer_raw near = nullptr, size_t align = 4)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                uintptr_t n = near.as_int();
+                uintptr_t lo = (n == 0 || n < max_distance)? 0 : n - max_distance;
+                uintptr_t hi = n == 0? UINTPTR_MAX : n + max_distance;
+                size = (size + 3) & ~size_t(3);
+                if(size == 0) return nullptr;
+
+                // By size first, then the first cave of that size within range
+                auto it = by_size.lower_bound(std::make_pair(size, lo));
+                while(it != by_size.end())
+                {
+                    size_t cave_size = it->first;
+                    uintptr_t cave = it->second;
+                    if(cave > hi)
+                    {
+                        it = by_size.lower_bound(std::make_pair(cave_size + 1, lo));
+                        continue;
+                    }
+                    if(cave < lo)
+                    {
+                        it = by_size.lower_bound(std::make_pair(cave_size, lo));
+                        continue;
+                    }
+
+                    uintptr_t start = (cave + align - 1) & ~uintptr_t(align - 1);
+                    uintptr_t end = start + size;
+                    bool reachable = n == 0 || (arm64::is_b_range(n, start) && arm64::is_b_range(n, end - 4));
+                    if(end > cave + cave_size || !reachable)
+                    {
+                        ++it;
+                        continue;
+                    }
+
+                    auto a = by_addr.find(cave);
+                    if(!still_free(start, size))
+                    {
+                        it = std::next(it);
+                        this->erase(a);
+                        continue;
+                    }
+
+                    this->erase(a);
+                    this->insert(cave, start - cave);
+                    this->insert(end, cave + cave_size - end);
+                    return memory_pointer_raw(start);
+                }
+                return nullptr;
+            }
+
+            // Gives back @size bytes at @p got from allocate(), its content has to be padding again (e.g. zeros)
+            void release(memory_pointer_raw p, size_t size)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                uintptr_t begin = p.as_int(), end = begin + ((size + 3) & ~size_t(3));
+
+                // Merge with the caves around it
+                auto next = by_addr.lower_bound(begin);
+                if(next != by_addr.end() && next->first == end)
+                    end += next->second, this->erase(next);
+
+                auto prev = by_addr.lower_bound(begin);
+                if(prev != by_addr.begin() && (--prev)->first + prev->second == begin)
+                    begin = prev->first, this->erase(prev);
+
+                this->insert(begin, end - begin);
+            }
+
+            // Number of caves
+            size_t size() const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return by_addr.size();
+            }
+
+            // Bytes available in the caves
+            size_t free_bytes() const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return free_total;
+            }
+
+            void clear()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                by_addr.clear();
+                by_size.clear();
+                free_total = 0;
+            }
+    };
+
+    /*
+     *  AllocateCave
+     *      Gets @size bytes of module padding reachable by a B placed at @near (anywhere if null), see cave_index
+     */
+    inline memory_pointer_raw AllocateCave(size_t size, memory_pointer_raw near = nullptr, size_t align = 4)
+    {
+        return cave_index::instance().allocate(size, near, align);
+    }
+}
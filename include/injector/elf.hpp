@@ -0,0 +1,235 @@
+/*
+ *  Injectors - Offline ELF Patching
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Patches a shared object on disk instead of in memory, so patches which never change cost nothing at load time
+ *  and the patched pages stay clean, shared file pages instead of private copy-on-write ones.
+ *
+ *  elf_backend maps an ELF64 file and addresses it by virtual address (as in the program headers, i.e. relative
+ *  to the load base), so elf_memory has the same primitives as the other backends:
+ *
+ *      elf_memory so("libgame.so", true);
+ *      so.make_b(0x123450, 0x200000);      // PC relative, same encoding as at runtime
+ *      so.make_nop(0x123460, 2);
+ *      so.get_backend().sync();
+ *
+ *  Only the parts of PT_LOAD segments backed by the file can be patched (not .bss).
+ */
+#pragma once
+#include "backend.hpp"
+#include <cstring>
+#include <vector>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace injector
+{
+    /*
+     *  elf_backend
+     *      An ELF64 file mapped (shared, writes go to the file) and addressed by virtual address
+     */
+    class elf_backend
+    {
+        private:
+            uint8_t*                map = nullptr;
+            size_t                  size = 0;
+            std::vector<Elf64_Phdr> loads;
+            bool                    writable = false;
+
+        public:
+            elf_backend() = default;
+            elf_backend(const char* path, bool writable)
+            {
+                this->open(path, writable);
+            }
+
+            ~elf_backend()
+            {
+                this->close();
+            }
+
+            elf_backend(const elf_backend&) = delete;
+            elf_backend& operator=(const elf_backend&) = delete;
+
+            // Maps the ELF file at @path, returns false on failure or if it isn't a valid ELF64 file
+            bool open(const char* path, bool writable)
+            {
+                this->close();
+                int fd = ::open(path, (writable? O_RDWR : O_RDONLY) | O_CLOEXEC);
+                if(fd == -1) return false;
+
+                struct stat st;
+                if(fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Elf64_Ehdr))
+                {
+                    void* p = mmap(nullptr, size_t(st.st_size), PROT_READ | (writable? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+                    if(p != MAP_FAILED)
+                        this->map = (uint8_t*) p, this->size = size_t(st.st_size), this->writable = writable;
+                }
+                ::close(fd);
+
+                if(map && !parse())
+                    this->close();
+                return this->map != nullptr;
+            }
+
+            void close()
+            {
+                if(map) munmap(map, size), map = nullptr, size = 0, writable = false;
+                loads.clear();
+            }
+
+            // Writes the changes back to the file
+            bool sync()
+            {
+                return map && msync(map, size, MS_SYNC) == 0;
+            }
+
+            bool is_open() const { return map != nullptr; }
+            bool is_writable() const { return writable; }
+            const Elf64_Ehdr* header() const { return (const Elf64_Ehdr*) map; }
+            const std::vector<Elf64_Phdr>& segments() const { return loads; }
+
+            // Converts the virtual address range [@vaddr, @vaddr + @n) to a file offset, returns -1 if it isn't
+            // entirely backed by the file
+            off_t to_offset(uintptr_t vaddr, size_t n = 1) const
+            {
+                for(auto& ph : loads)
+                {
+                    if(vaddr >= ph.p_vaddr && vaddr - ph.p_vaddr < ph.p_filesz && n <= ph.p_filesz - (vaddr - ph.p_vaddr))
+                        return off_t(ph.p_offset + (vaddr - ph.p_vaddr));
+                }
+                return -1;
+            }
+
+            // Converts the file offset @offset to a virtual address, returns 0 if it isn't loaded
+            uintptr_t to_vaddr(off_t offset) const
+            {
+                for(auto& ph : loads)
+                {
+                    if(uint64_t(offset) >= ph.p_offset && uint64_t(offset) - ph.p_offset < ph.p_filesz)
+                        return uintptr_t(ph.p_vaddr + (uint64_t(offset) - ph.p_offset));
+                }
+                return 0;
+            }
+
+            // Finds the defined symbol @name in .dynsym (or .symtab if there's one), returns its virtual address or 0
+            uintptr_t symbol(const char* name) const
+            {
+                auto eh = header();
+                if(!map || eh->e_shoff == 0 || eh->e_shentsize != sizeof(Elf64_Shdr)
+                || eh->e_shoff > size || size_t(eh->e_shnum) > (size - eh->e_shoff) / sizeof(Elf64_Shdr))
+                    return 0;
+
+                auto sh = (const Elf64_Shdr*)(map + eh->e_shoff);
+                for(unsigned type : { SHT_DYNSYM, SHT_SYMTAB })
+                {
+                    for(size_t i = 0; i < eh->e_shnum; ++i)
+                    {
+                        if(sh[i].sh_type != type || sh[i].sh_link >= eh->e_shnum) continue;
+                        auto& strtab = sh[sh[i].sh_link];
+                        if(!in_file(sh[i].sh_offset, sh[i].sh_size) || !in_file(strtab.sh_offset, strtab.sh_size)) continue;
+
+                        auto syms = (const Elf64_Sym*)(map + sh[i].sh_offset);
+                        auto strs = (const char*)(map + strtab.sh_offset);
+                        for(size_t s = 0; s < sh[i].sh_size / sizeof(Elf64_Sym); ++s)
+                        {
+                            if(syms[s].st_shndx == SHN_UNDEF || syms[s].st_name >= strtab.sh_size) continue;
+                            if(strncmp(strs + syms[s].st_name, name, strtab.sh_size - syms[s].st_name) == 0)
+                                return uintptr_t(syms[s].st_value);
+                        }
+                    }
+                }
+                return 0;
+            }
+
+            bool read(uintptr_t addr, void* out, size_t n)
+            {
+                off_t off = to_offset(addr, n);
+                if(off < 0) return false;
+                memcpy(out, map + off, n);
+                return true;
+            }
+
+            // Fails if the file was opened read-only (the mapping has no PROT_WRITE)
+            bool write(uintptr_t addr, const void* in, size_t n, bool, bool)
+            {
+                off_t off = writable? to_offset(addr, n) : -1;
+                if(off < 0) return false;
+                memcpy(map + off, in, n);
+                return true;
+            }
+
+            // Copies the file @from to @to (e.g. to patch a copy instead of the original)
+            static bool copy(const char* from, const char* to)
+            {
+                int in = ::open(from, O_RDONLY | O_CLOEXEC);
+                if(in == -1) return false;
+
+                struct stat st;
+                int out = fstat(in, &st) == 0? ::open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777) : -1;
+                bool ok = out != -1;
+
+                char buf[1 << 16];
+                for(ssize_t n; ok && (n = ::read(in, buf, sizeof(buf))) != 0; )
+                    ok = n > 0 && ::write(out, buf, size_t(n)) == n;
+
+                if(out != -1) ok = (::close(out) == 0) && ok;
+                ::close(in);
+                return ok;
+            }
+
+        private:
+            bool in_file(uint64_t offset, uint64_t n) const
+            {
+                return offset <= size && n <= size - offset;
+            }
+
+            // Validates the header and collects the PT_LOAD program headers
+            bool parse()
+            {
+                auto eh = header();
+                if(memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64
+                || eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_phentsize != sizeof(Elf64_Phdr)
+                || !in_file(eh->e_phoff, uint64_t(eh->e_phnum) * sizeof(Elf64_Phdr)))
+                    return false;
+
+                auto ph = (const Elf64_Phdr*)(map + eh->e_phoff);
+                for(size_t i = 0; i < eh->e_phnum; ++i)
+                {
+                    if(ph[i].p_type == PT_LOAD && in_file(ph[i].p_offset, ph[i].p_filesz))
+                        loads.push_back(ph[i]);
+                }
+                return !loads.empty();
+            }
+    };
+
+    using elf_memory = basic_memory_access<elf_backend>;
+}
@@ -0,0 +1,126 @@
+/*
+ *  Injectors - Latency Histograms
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+namespace injector
+{
+    /*
+     *  latency_histogram
+     *      Log-linear (HDR style) histogram: every power of two range is split into 2^(sub_bits-1) linear buckets,
+     *      which gives a relative error below 1/2^(sub_bits-1) (~6% here) over the whole range of values.
+     *
+     *      Meant to be owned by a single thread, record() is a count leading zeros, a shift and a few plain stores
+     *      (no locked read-modify-write). Other threads may read it concurrently with merge(), getting a slightly
+     *      stale view.
+     */
+    class latency_histogram
+    {
+        public:
+            static const unsigned sub_bits   = 5;
+            static const unsigned value_bits = 40;          // Values from 2^40 up are counted as 2^40 - 1
+            static const uint64_t half       = uint64_t(1) << (sub_bits - 1);
+            static const uint64_t max_value  = (uint64_t(1) << value_bits) - 1;
+
+            // Bucket index of the value @v
+            static size_t index_of(uint64_t v)
+            {
+                if(v > max_value) v = max_value;
+                if(v < (half << 1)) return size_t(v);
+                unsigned e = 63 - __builtin_clzll(v) - sub_bits + 1;
+                return size_t(e * half + (v >> e));
+            }
+
+            // Highest value which falls in the bucket @i
+            static uint64_t value_of(size_t i)
+            {
+                if(i < (half << 1)) return i;
+                unsigned e = unsigned(i / half) - 1;
+                uint64_t sub = i - e * half;
+                return ((sub + 1) << e) - 1;
+            }
+
+            static const size_t bucket_count = (value_bits - sub_bits + 2) * half;
+
+        private:
+            uint64_t    buckets[bucket_count] = { };
+            uint64_t    total = 0;
+            uint64_t    max = 0;
+
+        public:
+            // Records the value @v
+            void record(uint64_t v)
+            {
+                size_t i = index_of(v);
+                __atomic_store_n(&buckets[i], buckets[i] + 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&total, total + 1, __ATOMIC_RELAXED);
+                if(v > max) __atomic_store_n(&max, v, __ATOMIC_RELAXED);
+            }
+
+            // Adds the counts of @rhs into this
+            void merge(const latency_histogram& rhs)
+            {
+                for(size_t i = 0; i < bucket_count; ++i)
+                    buckets[i] += __atomic_load_n(&rhs.buckets[i], __ATOMIC_RELAXED);
+                total += __atomic_load_n(&rhs.total, __ATOMIC_RELAXED);
+                uint64_t m = __atomic_load_n(&rhs.max, __ATOMIC_RELAXED);
+                if(m > max) max = m;
+            }
+
+            void reset()
+            {
+                for(auto& b : buckets) __atomic_store_n(&b, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&total, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&max, 0, __ATOMIC_RELAXED);
+            }
+
+            uint64_t count() const      { return total; }
+            uint64_t maximum() const    { return max; }
+
+            // Value at the percentile @p (0-100), as the highest value of its bucket (never above the maximum)
+            uint64_t percentile(double p) const
+            {
+                if(total == 0) return 0;
+                uint64_t rank = uint64_t(double(total) * p / 100.0 + 0.5);
+                if(rank == 0) rank = 1;
+
+                uint64_t seen = 0;
+                for(size_t i = 0; i < bucket_count; ++i)
+                {
+                    seen += buckets[i];
+                    if(seen >= rank)
+                    {
+                        uint64_t v = value_of(i);
+                        return v < max? v : max;
+                    }
+                }
+                return max;
+            }
+    };
+}
@@ -29,6 +29,24 @@
 #include <functional>
 #include <memory>       // for std::shared_ptr
 #include <list>
+#include <mutex>
+#include <vector>
+
+#ifdef INJECTOR_HOOK_PROFILING
+#include "profiling.hpp"
+#include <algorithm>
+#define INJECTOR_PROFILE_SCOPE(id) profile_scope injector_profile_scope_(id)
+#define INJECTOR_PROFILE_HOOK_ID(index) (profile_id() + 2 + std::min<size_t>(index, profile_max_hooks - 1))
+#else
+#define INJECTOR_PROFILE_SCOPE(id)
+#endif
+
+#ifdef INJECTOR_HOOK_TRACING
+#include "trace.hpp"
+#define INJECTOR_TRACE_SCOPE(site, ...) trace_scope injector_trace_scope_(site, __VA_ARGS__)
+#else
+#define INJECTOR_TRACE_SCOPE(site, ...)
+#endif
 
 namespace injector
 {
@@ -48,13 +66,14 @@ namespace injector
      *  scoped_basic
      *      Base for scoped types which will need a buffer to save/restore stuff
      */
-    template<size_t bufsize>    // TODO specialize bufsize=0 to be dynamic
+    template<size_t bufsize>    // bufsize=0 is dynamic, see below
     class scoped_basic : public scoped_base
     {
         private:
             uint8_t            buf[bufsize];// Saved content
             memory_pointer_raw addr;        // Data saved from this address
             size_t             size;        // Size saved
+            uint64_t           claim = 0;   // Registry claim of the patch, 0 if none
             bool               saved;       // Something saved?
             bool               vp;          // Virtual protect?
 
@@ -63,13 +82,17 @@ namespace injector
             static const bool  is_dynamic = false;
 
             // Restore the previosly saved data
-            // Problems may arise if someone else hooked the same place using the same method
+            // Problems may arise if someone else hooked the same place using the same method (see registry.hpp)
             virtual void restore()
             {
                 #ifndef INJECTOR_SCOPED_NOSAVE_NORESTORE
                     if(this->saved)
                     {
-                        WriteMemoryRaw(this->addr, this->buf, this->size, this->vp);
+                        // The registry may refuse it when that would undo somebody else's patch
+                        if(INJECTOR_RELEASE_PATCH(this->claim, this->addr, this->size))
+                        {
+                            WriteMemoryRaw(this->addr, this->buf, this->size, this->vp, true);
+                        }
                         this->saved = false;
                     }
                 #endif
@@ -85,10 +108,18 @@ namespace injector
                     this->addr = addr.get<void>();      // Save address
                     this->size = size;                  // Save size
                     this->vp = vp;                      // Save virtual protect
-                    ReadMemoryRaw(addr, buf, size, vp); // Save buffer
+                    this->claim = 0;                    // No claim until claimed()
+                    (void) INJECTOR_TAKE_CLAIM();       // Forget the older claims of this thread
+                    ReadMemoryRaw(addr, buf, size, vp, true); // Save buffer
                 #endif
             }
 
+            // Takes the registry claim of the patch just done over the saved data
+            void claimed()
+            {
+                this->claim = INJECTOR_TAKE_CLAIM();
+            }
+
         public:
             // Constructor, initialises
             scoped_basic() : saved(false)
@@ -113,8 +144,9 @@ namespace injector
                 {
                     assert(bufsize >= rhs.size);
 
-                    this->addr = rhs.addr;
+                    this->addr = rhs.addr.get<void>();
                     this->size = rhs.size;
+                    this->claim = rhs.claim;
                     this->vp = rhs.vp;
                     memcpy(buf, rhs.buf, rhs.size);
 
@@ -124,11 +156,188 @@ namespace injector
             }
     };
 
+    /*
+     *  scoped_spill_arena
+     *      Storage of the saves too big for the inline buffer of scoped_basic<0>
+     *      Blocks come from 64KB chunks in power of two size classes (32 to 4096 bytes) with a free list each,
+     *      bigger ones straight from the heap.
+     */
+    class scoped_spill_arena
+    {
+        private:
+            static const size_t min_class = 5, max_class = 12, chunk_size = 64 * 1024;
+
+            std::mutex                              mutex;
+            std::vector<std::unique_ptr<uint8_t[]>> chunks;
+            size_t                                  used = chunk_size;
+            void*                                   free_list[max_class - min_class + 1] = { };
+
+            static size_t size_class(size_t n)
+            {
+                size_t c = min_class;
+                while((size_t(1) << c) < n) ++c;
+                return c;
+            }
+
+        public:
+            static scoped_spill_arena& instance()
+            {
+                static scoped_spill_arena arena;
+                return arena;
+            }
+
+            void* allocate(size_t n)
+            {
+                size_t c = size_class(n);
+                if(c > max_class) return new uint8_t[n];
+
+                std::lock_guard<std::mutex> lock(mutex);
+                auto& head = free_list[c - min_class];
+                if(head)
+                {
+                    void* p = head;
+                    head = *(void**) p;
+                    return p;
+                }
+
+                size_t block = size_t(1) << c;
+                if(used + block > chunk_size)
+                    chunks.emplace_back(new uint8_t[chunk_size]), used = 0;
+                void* p = chunks.back().get() + used;
+                used += block;
+                return p;
+            }
+
+            void deallocate(void* p, size_t n)
+            {
+                size_t c = size_class(n);
+                if(c > max_class) return delete[] (uint8_t*) p;
+
+                std::lock_guard<std::mutex> lock(mutex);
+                auto& head = free_list[c - min_class];
+                *(void**) p = head;
+                head = p;
+            }
+    };
+
+    /*
+     *  scoped_basic<0>
+     *      Dynamic version of scoped_basic, saves of any size
+     *      Up to inline_size bytes (the 4, 12 and 16 bytes of B/BL, ADRP+ADD+BR and friends) are kept inline,
+     *      bigger ones spill into the scoped_spill_arena.
+     */
+    template<>
+    class scoped_basic<0> : public scoped_base
+    {
+        public:
+            static const size_t inline_size = 16;
+
+        private:
+            union
+            {
+                uint8_t        buf[inline_size];
+                uint8_t*       spill;
+            };
+            memory_pointer_raw addr;        // Data saved from this address
+            uint32_t           size = 0;    // Size saved
+            uint64_t           claim = 0;   // Registry claim of the patch, 0 if none
+            bool               saved;       // Something saved?
+            bool               vp;          // Virtual protect?
+
+            uint8_t* data() { return size <= inline_size? buf : spill; }
+
+            void release_storage()
+            {
+                if(size > inline_size) scoped_spill_arena::instance().deallocate(spill, size);
+                size = 0;
+            }
+
+        public:
+
+            static const bool  is_dynamic = true;
+
+            // Restore the previosly saved data
+            // Problems may arise if someone else hooked the same place using the same method (see registry.hpp)
+            virtual void restore()
+            {
+                #ifndef INJECTOR_SCOPED_NOSAVE_NORESTORE
+                    if(this->saved)
+                    {
+                        // The registry may refuse it when that would undo somebody else's patch
+                        if(INJECTOR_RELEASE_PATCH(this->claim, this->addr, this->size))
+                        {
+                            WriteMemoryRaw(this->addr, this->data(), this->size, this->vp, true);
+                        }
+                        this->release_storage();
+                        this->saved = false;
+                    }
+                #endif
+            }
+
+            // Save buffer at @addr with @size and virtual protect @vp
+            virtual void save(memory_pointer_tr addr, size_t size, bool vp)
+            {
+                #ifndef INJECTOR_SCOPED_NOSAVE_NORESTORE
+                    this->restore();                    // Restore anything we have saved
+                    this->saved = true;                 // Mark that we have data save
+                    this->addr = addr.get<void>();      // Save address
+                    this->size = uint32_t(size);        // Save size
+                    this->vp = vp;                      // Save virtual protect
+                    this->claim = 0;                    // No claim until claimed()
+                    (void) INJECTOR_TAKE_CLAIM();       // Forget the older claims of this thread
+                    if(size > inline_size) this->spill = (uint8_t*) scoped_spill_arena::instance().allocate(size);
+                    ReadMemoryRaw(addr, data(), size, vp, true); // Save buffer
+                #endif
+            }
+
+            // Takes the registry claim of the patch just done over the saved data
+            void claimed()
+            {
+                this->claim = INJECTOR_TAKE_CLAIM();
+            }
+
+        public:
+            // Constructor, initialises
+            scoped_basic() : saved(false)
+            {}
+
+            ~scoped_basic()
+            {
+                this->restore();
+            }
+
+            scoped_basic(const scoped_basic&) = delete;
+            scoped_basic(scoped_basic&& rhs) : saved(false)
+            {
+                *this = std::move(rhs);
+            }
+
+            scoped_basic& operator=(const scoped_basic& rhs) = delete;
+            scoped_basic& operator=(scoped_basic&& rhs)
+            {
+                if(this == &rhs) return *this;
+                this->restore();
+                if((this->saved = rhs.saved))
+                {
+                    this->addr = rhs.addr.get<void>();
+                    this->size = rhs.size;
+                    this->claim = rhs.claim;
+                    this->vp = rhs.vp;
+                    if(size > inline_size) this->spill = rhs.spill;     // Steal the spilled buffer
+                    else                   memcpy(buf, rhs.buf, size);
+
+                    rhs.size = 0;
+                    rhs.saved = false;
+                }
+                return *this;
+            }
+    };
+
     /*
      *  RAII wrapper for memory writes
      *  Can save only basic and POD types
      */
-    template<size_t bufsize_ = 10>
+    template<size_t bufsize_ = 0>
     class scoped_write : public scoped_basic<bufsize_>
     {
         public:
@@ -136,7 +345,7 @@ namespace injector
             void write(memory_pointer_tr addr, void* value, size_t size, bool vp)
             {
                 this->save(addr, size, vp);
-                return WriteMemoryRaw(addr, value, size, vp);
+                return WriteMemoryRaw(addr, value, size, vp, true);
             }
 
             // Save buffer at @addr with size sizeof(@value) and virtual protect @vp and then overwrite it with @value
@@ -159,7 +368,7 @@ namespace injector
     /*
      *  RAII wrapper for filling
      */
-    template<size_t bufsize_ = 5>
+    template<size_t bufsize_ = 0>
     class scoped_fill : public scoped_basic<bufsize_>
     {
         public:
@@ -167,7 +376,7 @@ namespace injector
             void fill(memory_pointer_tr addr, uint8_t value, size_t size, bool vp)
             {
                 this->save(addr, size, vp);
-                return MemoryFill(addr, value, size, vp);
+                return MemoryFill(addr, value, size, vp, true);
             }
 
             // Constructors, move constructors, assigment operators........
@@ -179,21 +388,22 @@ namespace injector
             { scoped_basic<bufsize_>::operator=(std::move(rhs)); return *this; }
 
             scoped_fill(memory_pointer_tr addr, uint8_t value, size_t size, bool vp)
-            { fill(addr, value, vp); }
+            { fill(addr, value, size, vp); }
     };
     
     /*
      *  RAII wrapper for nopping
      */
-    template<size_t bufsize_>
+    template<size_t bufsize_ = 0>
     class scoped_nop : public scoped_basic<bufsize_>
     {
         public:
-            // Makes NOP at @addr with value @value and size @size and virtual protect @vp
+            // Makes @size NOP instructions at @addr with virtual protect @vp
             void make_nop(memory_pointer_tr addr, size_t size = 1, bool vp = true)
             {
-                this->save(addr, size, vp);
-                return MakeNOP(addr, size, vp);
+                this->save(addr, size * sizeof(uint32_t), vp);
+                MakeNOP(addr, size, vp);
+                this->claimed();
             }
 
             // Constructors, move constructors, assigment operators........
@@ -209,50 +419,77 @@ namespace injector
     };
     
     /*
-     *  RAII wrapper for MakeJMP 
+     *  RAII wrapper for MakeB / MakeBR
      */
-    class scoped_jmp : public scoped_basic<5>
+    class scoped_jmp : public scoped_basic<0>
     {
         public:
-            // Makes NOP at @addr with value @value and size @size and virtual protect @vp
+            // Makes a B at @at jumping to @dest with virtual protect @vp
+            // Returns the previous branch destination at @at, nullptr (and nothing is written) if @dest is out of B range,
+            // use make_br for those (3 instructions, which the patched code must have room for)
             memory_pointer_raw make_jmp(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
             {
-                this->save(at, 5, vp);
-                return MakeJMP(at, dest, vp);
+                uintptr_t from = at.as_int(), to = dest.as_int();
+                if(from % 4 || to % 4 || !arm64::is_b_range(from, to)) return nullptr;
+
+                this->save(at, sizeof(uint32_t), vp);
+                auto prev = MakeB(at, dest, vp);
+                this->claimed();
+                return prev;
+            }
+
+            // Makes ADRP/ADD/BR X16 at @at jumping to @dest (+/- 4GB) with virtual protect @vp
+            // Returns the previous branch destination at @at
+            memory_pointer_raw make_br(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
+            {
+                uintptr_t from = at.as_int(), to = dest.as_int();
+                if(from % 4 || to % 4 || !arm64::is_adrp_range(from, to)) return nullptr;
+
+                auto prev = GetBranchDestination(at, vp);
+                this->save(at, 3 * sizeof(uint32_t), vp);
+                MakeBR(at, dest, vp);
+                this->claimed();
+                return prev;
             }
 
             // Constructors, move constructors, assigment operators........
             scoped_jmp() = default;
             scoped_jmp(const scoped_jmp&) = delete;
-            scoped_jmp(scoped_jmp&& rhs) : scoped_basic<5>(std::move(rhs)) {}
+            scoped_jmp(scoped_jmp&& rhs) : scoped_basic<0>(std::move(rhs)) {}
             scoped_jmp& operator=(const scoped_jmp& rhs) = delete;
             scoped_jmp& operator=(scoped_jmp&& rhs)
-            { scoped_basic<5>::operator=(std::move(rhs)); return *this; }
+            { scoped_basic<0>::operator=(std::move(rhs)); return *this; }
 
             scoped_jmp(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
             { make_jmp(at, dest, vp); }
     };
     
     /*
-     *  RAII wrapper for MakeCALL 
+     *  RAII wrapper for MakeBL
      */
-    class scoped_call : public scoped_basic<5>
+    class scoped_call : public scoped_basic<0>
     {
         public:
-            // Makes NOP at @addr with value @value and size @size and virtual protect @vp
+            // Makes a BL at @at calling @dest with virtual protect @vp
+            // Returns the previous branch destination at @at, nullptr (and nothing is written) if @dest is out of BL range
             memory_pointer_raw make_call(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
             {
-                this->save(at, 5, vp);
-                return MakeCALL(at, dest, vp);
+                uintptr_t from = at.as_int(), to = dest.as_int();
+                if(from % 4 || to % 4 || !arm64::is_b_range(from, to)) return nullptr;
+
+                this->save(at, sizeof(uint32_t), vp);
+                auto prev = MakeBL(at, dest, vp);
+                this->claimed();
+                return prev;
             }
 
             // Constructors, move constructors, assigment operators........
             scoped_call() = default;
             scoped_call(const scoped_call&) = delete;
-            scoped_call(scoped_call&& rhs) : scoped_basic<5>(std::move(rhs)) {}
+            scoped_call(scoped_call&& rhs) : scoped_basic<0>(std::move(rhs)) {}
             scoped_call& operator=(const scoped_call& rhs) = delete;
             scoped_call& operator=(scoped_call&& rhs)
-            { scoped_basic<5>::operator=(std::move(rhs)); return *this; }
+            { scoped_basic<0>::operator=(std::move(rhs)); return *this; }
 
             scoped_call(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
             { make_call(at, dest, vp); }
@@ -261,6 +498,63 @@ namespace injector
 
 #if __cplusplus >= 201103L || _MSC_VER >= 1800  // C++11 or MSVC 2013 required for variadic templates
 
+    /*
+     *  reentrancy_policy
+     *      What a hook dispatch should do when a thread reenters it while one of its hooks is still running
+     *      (e.g. the hook calls game code which ends up calling the hooked function again)
+     */
+    enum class reentrancy_policy : uint8_t
+    {
+        call_hooks,         // Run the hooks again, as if it was a fresh call (default)
+        call_original,      // Bypass the hooks and go straight to the original function
+    };
+
+    /*
+     *  reentrancy_guard
+     *      Per-thread depth counter of a hook site, Site is any type unique to the site
+     *      Lives in a tiny thread_local so checking it is a TLS load and a compare, and it never allocates.
+     */
+    template<class Site>
+    class reentrancy_guard
+    {
+        private:
+            uint16_t& d;
+
+        public:
+            // Current depth of the site in this thread (0 when not inside it)
+            static uint16_t& depth()
+            {
+                static thread_local uint16_t d;
+                return d;
+            }
+
+            static bool is_reentering()
+            {
+                return depth() != 0;
+            }
+
+            reentrancy_guard() : d(depth())   { ++d; }
+            ~reentrancy_guard()                 { --d; }
+
+            reentrancy_guard(const reentrancy_guard&) = delete;
+            reentrancy_guard& operator=(const reentrancy_guard&) = delete;
+
+            // Leaves the site for its lifetime, so the original function called by a hook isn't seen as a reentry
+            class pause
+            {
+                private:
+                    uint16_t& d;
+                    bool      inside;
+
+                public:
+                    pause() : d(depth()), inside(d != 0)   { if(inside) --d; }
+                    ~pause()                                { if(inside) ++d; }
+
+                    pause(const pause&) = delete;
+                    pause& operator=(const pause&) = delete;
+            };
+    };
+
     /*
      *  function_hooker_manager
      *      Manages many function_hookers that points to the same address
@@ -285,6 +579,9 @@ namespace injector
             func_type_raw   original;               // Pointer to the original function we've replaced
             assoc_type      assoc;                  // Association between owners of a hook and the hook (map)
             bool            has_hooked = false;     // Is the hook already in place?
+            reentrancy_policy reentrancy = reentrancy_policy::call_hooks;  // What to do when reentered by the same thread
+
+            using guard_type = reentrancy_guard<function_hooker_manager>;
 
             // Find assoc iterator for the content owned by 'owned'
             typename assoc_type::iterator find_assoc(const ToManage& owner)
@@ -304,17 +601,50 @@ namespace injector
                     assoc.emplace_back(&hooker, std::move(functor));
             }
 
+#ifdef INJECTOR_HOOK_PROFILING
+            // Profiler ids of this site: the whole dispatch, the original function, then each hook in installation order
+            static const size_t profile_max_hooks = 8;
+            static uint32_t profile_id()
+            {
+                static const uint32_t id = []
+                {
+                    static const char* const suffixes[] = { ":original", "#0", "#1", "#2", "#3", "#4", "#5", "#6", "#7+" };
+                    char name[32];
+                    snprintf(name, sizeof(name), "hook@0x%llx", (unsigned long long) ToManage::addr);
+                    return hook_profiler::singleton().register_ids(name, 2 + profile_max_hooks, suffixes);
+                }();
+                return id;
+            }
+#endif
+
+            // Calls the hook @functor which is the @index-th hook installed
+            static Ret call_hook(const functor_type& functor, func_type next, [[maybe_unused]] size_t index, Args&... args)
+            {
+                INJECTOR_PROFILE_SCOPE(INJECTOR_PROFILE_HOOK_ID(index));
+                return functor(std::move(next), args...);
+            }
+
         public:
             // Forwards the call to all the installed hooks
             static Ret call_hooks(Args&... args)
             {
                 auto& manager = *instance();
+                INJECTOR_PROFILE_SCOPE(profile_id());
+                INJECTOR_TRACE_SCOPE(ToManage::addr, args...);
 
                 if(manager.assoc.size() == 0) // This may be uncommon but may happen (?), no hook installed
                     return manager.original(args...);
 
-                // Functor for the original call
+                // Reentered from inside one of our hooks?
+                if(guard_type::is_reentering() && manager.reentrancy == reentrancy_policy::call_original)
+                    return manager.original(args...);
+
+                guard_type guard;
+
+                // Functor for the original call, only the hooks are guarded
                 func_type original = [&manager](Args... args) -> Ret {
+                    INJECTOR_PROFILE_SCOPE(profile_id() + 1);
+                    typename guard_type::pause unguarded;
                     return manager.original(args...);
                 };
 
@@ -322,19 +652,20 @@ namespace injector
                 {
                     // We have only one hook, just use it directly no need to go further in complexity
                     auto& functor = manager.assoc.begin()->second;
-                    return functor(std::move(original), args...);
+                    return call_hook(functor, std::move(original), 0, args...);
                 }
                 else
                 {
                     // Build a serie of functors which captures the previous functor sending it to the next functor,
                     // that's what would happen if the hooks took place independent of the template staticness (AAAAAAA)
                     func_type next = std::move(original);
-                    for(auto it = manager.assoc.begin(); it != manager.assoc.end(); ++it)
+                    size_t index = 0;
+                    for(auto it = manager.assoc.begin(); it != manager.assoc.end(); ++it, ++index)
                     {
                         auto& functor = it->second;
-                        next = [functor, next](Args... args) -> Ret
+                        next = [functor, next, index](Args... args) -> Ret
                         {
-                            return functor(next, args...);
+                            return call_hook(functor, next, index, args...);
                         };
                     }
                     return next(args...);
@@ -370,6 +701,12 @@ namespace injector
                 }
             }
 
+            // Sets what happens when a thread reenters this hook site while inside one of its hooks
+            void set_reentrancy(reentrancy_policy policy)
+            {
+                this->reentrancy = policy;
+            }
+
             // Replaces the hook associated with 'from' to be associated with 'to'
             // After this call the 'from' object has no association in this manager
             void replace(const ToManage& from, const ToManage& to)
@@ -470,6 +807,13 @@ namespace injector
                 return this->has_call;
             }
 
+            // Sets what happens when the hooked function is called again (by the same thread) from inside a hook
+            // Notice this is shared by every hook in the same address
+            void set_reentrancy(reentrancy_policy policy)
+            {
+                manager->set_reentrancy(policy);
+            }
+
         private:
             bool has_call = false;                      // Has a hook installed?
             std::shared_ptr<manager_type> manager;      // **EVERY** function_hooker should have a ownership over it's manager_type
@@ -538,13 +882,13 @@ namespace injector
 
     template<uintptr_t addr1, class Ret, class ...Args>
     struct function_hooker_stdcall<addr1, Ret(Args...)>
-        : public function_hooker_base<addr1, Ret(__stdcall*)(Args...), Ret, Args...>
+        : public function_hooker_base<addr1, Ret(INJECTOR_STDCALL*)(Args...), Ret, Args...>
     {
         private:
-            using base = function_hooker_base<addr1, Ret(__stdcall*)(Args...), Ret, Args...>;
+            using base = function_hooker_base<addr1, Ret(INJECTOR_STDCALL*)(Args...), Ret, Args...>;
 
             // The hook caller
-            static Ret __stdcall call(Args... a)
+            static Ret INJECTOR_STDCALL call(Args... a)
             {
                 return base::call_hooks(a...);
             }
@@ -575,13 +919,13 @@ namespace injector
 
     template<uintptr_t addr1, class Ret, class ...Args>
     struct function_hooker_fastcall<addr1, Ret(Args...)>
-        : public function_hooker_base<addr1, Ret(__fastcall*)(Args...), Ret, Args...>
+        : public function_hooker_base<addr1, Ret(INJECTOR_FASTCALL*)(Args...), Ret, Args...>
     {
         private:
-            using base = function_hooker_base<addr1, Ret(__fastcall*)(Args...), Ret, Args...>;
+            using base = function_hooker_base<addr1, Ret(INJECTOR_FASTCALL*)(Args...), Ret, Args...>;
 
             // The hook caller
-            static Ret __fastcall call(Args... a)
+            static Ret INJECTOR_FASTCALL call(Args... a)
             {
                 return base::call_hooks(a...);
             }
@@ -612,13 +956,13 @@ namespace injector
 
     template<uintptr_t addr1, class Ret, class ...Args>
     struct function_hooker_thiscall<addr1, Ret(Args...)>
-        : public function_hooker_base<addr1, Ret(__thiscall*)(Args...), Ret, Args...>
+        : public function_hooker_base<addr1, Ret(INJECTOR_THISCALL*)(Args...), Ret, Args...>
     {
         private:
-            using base = function_hooker_base<addr1, Ret(__thiscall*)(Args...), Ret, Args...>;
+            using base = function_hooker_base<addr1, Ret(INJECTOR_THISCALL*)(Args...), Ret, Args...>;
 
             // The hook caller
-            static Ret __thiscall call(Args... a)
+            static Ret INJECTOR_THISCALL call(Args... a)
             {
                 return base::call_hooks(a...);
             }
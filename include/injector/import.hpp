@@ -0,0 +1,378 @@
+/*
+ *  Injectors - Import (GOT/PLT) Hooking
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Redirects the imports of a module by swapping its GOT slots, no code gets patched.
+ *  A redirected import costs nothing per call (it's the same indirect branch the PLT always does),
+ *  and no instruction cache maintenance or scratch register is involved.
+ *
+ *  Slots are found through the module's relocations (.rela.plt and .rela.dyn) using dl_iterate_phdr.
+ *  Android packed relocations (DT_ANDROID_RELA) aren't decoded, imports called through the PLT are always found though.
+ */
+#pragma once
+#include "injector.hpp"
+#include "hooking.hpp"
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <link.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace injector
+{
+    /*
+     *  import_table
+     *      The imports (GOT slots with a symbol) of a loaded module
+     */
+    class import_table
+    {
+        public:
+            struct slot
+            {
+                void**      addr;       // Address of the GOT entry
+                const char* name;       // Symbol name (points into the module's string table)
+                bool        plt;        // Is it a .rela.plt (JUMP_SLOT) entry?
+            };
+
+        private:
+            std::string         path;
+            uintptr_t           base = 0;
+            uintptr_t           relro_begin = 0, relro_end = 0;
+            std::vector<ElfW(Phdr)> loads;
+            std::vector<slot>   slots;
+
+        #if defined(__aarch64__)
+            static const uint32_t r_jump_slot = R_AARCH64_JUMP_SLOT, r_glob_dat = R_AARCH64_GLOB_DAT, r_abs64 = R_AARCH64_ABS64;
+        #elif defined(__x86_64__)
+            static const uint32_t r_jump_slot = R_X86_64_JUMP_SLOT, r_glob_dat = R_X86_64_GLOB_DAT, r_abs64 = R_X86_64_64;
+        #else
+        #error Unsupported architecture for import hooking
+        #endif
+
+            struct search
+            {
+                const char* name;
+                uintptr_t   addr;
+                import_table* table;
+                bool        found;
+            };
+
+            // Does the module at @info match the search @s?
+            static bool matches(const dl_phdr_info* info, const search& s)
+            {
+                if(s.addr)
+                {
+                    for(int i = 0; i < info->dlpi_phnum; ++i)
+                    {
+                        auto& ph = info->dlpi_phdr[i];
+                        uintptr_t begin = info->dlpi_addr + ph.p_vaddr;
+                        if(ph.p_type == PT_LOAD && s.addr >= begin && s.addr < begin + ph.p_memsz)
+                            return true;
+                    }
+                    return false;
+                }
+
+                const char* name = info->dlpi_name? info->dlpi_name : "";
+                if(s.name == nullptr || *s.name == 0)   // The main executable comes first and has no name
+                    return true;
+
+                // Match either the full path or the file name
+                size_t len = strlen(name), slen = strlen(s.name);
+                return len >= slen && strcmp(name + len - slen, s.name) == 0 && (len == slen || name[len - slen - 1] == '/');
+            }
+
+            static int callback(dl_phdr_info* info, size_t, void* data)
+            {
+                auto& s = *(search*) data;
+                if(!matches(info, s))
+                    return 0;
+                s.found = true;
+                s.table->parse(info);
+                return 1;
+            }
+
+            // Pointers in the dynamic section are relocated by some loaders (glibc) but not by others (bionic)
+            uintptr_t dyn_ptr(uintptr_t p) const
+            {
+                return p < base? base + p : p;
+            }
+
+            void parse(const dl_phdr_info* info)
+            {
+                const ElfW(Dyn)* dyn = nullptr;
+                path = info->dlpi_name? info->dlpi_name : "";
+                base = info->dlpi_addr;
+
+                for(int i = 0; i < info->dlpi_phnum; ++i)
+                {
+                    auto& ph = info->dlpi_phdr[i];
+                    if(ph.p_type == PT_DYNAMIC)
+                        dyn = (const ElfW(Dyn)*)(base + ph.p_vaddr);
+                    else if(ph.p_type == PT_LOAD)
+                        loads.push_back(ph);
+                    else if(ph.p_type == PT_GNU_RELRO)
+                        relro_begin = base + ph.p_vaddr, relro_end = relro_begin + ph.p_memsz;
+                }
+
+                if(dyn == nullptr)
+                    return;
+
+                uintptr_t jmprel = 0, rela = 0, symtab = 0, strtab = 0;
+                size_t    jmprel_size = 0, rela_size = 0;
+                for(; dyn->d_tag != DT_NULL; ++dyn)
+                {
+                    switch(dyn->d_tag)
+                    {
+                        case DT_JMPREL:   jmprel = dyn_ptr(dyn->d_un.d_ptr); break;
+                        case DT_PLTRELSZ: jmprel_size = dyn->d_un.d_val; break;
+                        case DT_RELA:     rela = dyn_ptr(dyn->d_un.d_ptr); break;
+                        case DT_RELASZ:   rela_size = dyn->d_un.d_val; break;
+                        case DT_SYMTAB:   symtab = dyn_ptr(dyn->d_un.d_ptr); break;
+                        case DT_STRTAB:   strtab = dyn_ptr(dyn->d_un.d_ptr); break;
+                    }
+                }
+
+                if(symtab == 0 || strtab == 0)
+                    return;
+
+                auto collect = [&](uintptr_t table, size_t size, bool plt)
+                {
+                    auto r = (const ElfW(Rela)*) table;
+                    for(size_t i = 0; i < size / sizeof(ElfW(Rela)); ++i)
+                    {
+                        uint32_t type = ELF64_R_TYPE(r[i].r_info);
+                        uint32_t sym  = ELF64_R_SYM(r[i].r_info);
+                        if(sym == 0 || (type != r_jump_slot && type != r_glob_dat && type != r_abs64))
+                            continue;
+                        if(type == r_abs64 && r[i].r_addend != 0)       // Points inside the symbol, not at it
+                            continue;
+
+                        auto& s = ((const ElfW(Sym)*) symtab)[sym];
+                        slots.push_back(slot { (void**)(base + r[i].r_offset), (const char*)(strtab + s.st_name), plt });
+                    }
+                };
+
+                if(jmprel) collect(jmprel, jmprel_size, true);
+                if(rela)   collect(rela, rela_size, false);
+            }
+
+            bool load(search s)
+            {
+                *this = import_table();
+                s.table = this;
+                s.found = false;
+                dl_iterate_phdr(callback, &s);
+                return s.found;
+            }
+
+        public:
+            import_table() = default;
+
+            // Loads the imports of the module named @module (file name or full path, null or empty for the main executable)
+            explicit import_table(const char* module)           { load(module); }
+
+            bool load(const char* module)       { return load(search { module, 0, nullptr, false }); }
+
+            // Loads the imports of the module containing the address @addr
+            bool load(memory_pointer_raw addr)  { return load(search { nullptr, addr.as_int(), nullptr, false }); }
+
+            const std::string&       module() const { return path; }
+            const std::vector<slot>& get() const    { return slots; }
+            bool                     empty() const  { return slots.empty(); }
+
+            // Gets the GOT slots importing the symbol @name
+            std::vector<void**> find(const char* name) const
+            {
+                std::vector<void**> result;
+                for(auto& s : slots)
+                    if(strcmp(s.name, name) == 0) result.push_back(s.addr);
+                return result;
+            }
+
+            // Is @addr inside the read-only after relocation area?
+            bool is_relro(const void* addr) const
+            {
+                return uintptr_t(addr) >= relro_begin && uintptr_t(addr) < relro_end;
+            }
+
+            // Is @addr inside this module?
+            bool contains(const void* addr) const
+            {
+                for(auto& ph : loads)
+                {
+                    uintptr_t begin = base + ph.p_vaddr;
+                    if(uintptr_t(addr) >= begin && uintptr_t(addr) < begin + ph.p_memsz)
+                        return true;
+                }
+                return false;
+            }
+    };
+
+    /*
+     *  scoped_imports
+     *      RAII batch of import redirections
+     *      Every redirection added before apply() gets written with a single protection change per run of RELRO pages.
+     */
+    class scoped_imports : public scoped_base
+    {
+        private:
+            struct entry
+            {
+                void**  slot;
+                void*   replacement;
+                void*   original;
+            };
+
+            import_table        table;
+            std::vector<entry>  entries;
+            bool                applied = false;
+
+            // Stores @value in every slot of every entry, the value being chosen by @pick
+            template<class F>
+            void write_all(F pick)
+            {
+                std::sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) { return a.slot < b.slot; });
+
+                const uintptr_t page = page_size();
+                for(size_t i = 0; i < entries.size(); )
+                {
+                    if(!table.is_relro(entries[i].slot))
+                    {
+                        __atomic_store_n(entries[i].slot, pick(entries[i]), __ATOMIC_RELEASE);
+                        ++i; continue;
+                    }
+
+                    // Gather the run of entries in contiguous RELRO pages and unprotect it all at once
+                    uintptr_t begin = uintptr_t(entries[i].slot) & ~(page - 1);
+                    uintptr_t end   = (uintptr_t(entries[i].slot) + sizeof(void*) + page - 1) & ~(page - 1);
+                    size_t    j     = i + 1;
+                    for(; j < entries.size() && table.is_relro(entries[j].slot) && uintptr_t(entries[j].slot) < end + page; ++j)
+                        end = (uintptr_t(entries[j].slot) + sizeof(void*) + page - 1) & ~(page - 1);
+
+                    bool unprotected = mprotect((void*) begin, end - begin, PROT_READ | PROT_WRITE) == 0;
+                    for(; i < j; ++i)
+                        __atomic_store_n(entries[i].slot, pick(entries[i]), __ATOMIC_RELEASE);
+                    if(unprotected) mprotect((void*) begin, end - begin, PROT_READ);
+                }
+            }
+
+        public:
+            // Redirects imports of the module @module (see import_table::load)
+            explicit scoped_imports(const char* module)         : table(module) {}
+            explicit scoped_imports(memory_pointer_raw addr)    { table.load(addr); }
+
+            ~scoped_imports()
+            {
+                this->restore();
+            }
+
+            scoped_imports(const scoped_imports&) = delete;
+            scoped_imports& operator=(const scoped_imports&) = delete;
+
+            const import_table& imports() const { return table; }
+
+            // Adds a redirection of the import @name to @replacement, to be written by apply()
+            // The original function is written into @original on apply() (it may be null). Returns the amount of slots found.
+            size_t add(const char* name, memory_pointer_raw replacement)
+            {
+                auto found = table.find(name);
+                for(auto slot : found)
+                    entries.push_back(entry { slot, replacement.get(), nullptr });
+                return found.size();
+            }
+
+            // Writes every redirection added so far
+            void apply()
+            {
+                write_all([this](entry& e) -> void*
+                {
+                    if(e.original == nullptr)
+                    {
+                        e.original = __atomic_load_n(e.slot, __ATOMIC_ACQUIRE);
+                        if(table.contains(e.original))      // Not bound yet (lazy binding), it points back to the PLT
+                        {
+                            auto it = std::find_if(table.get().begin(), table.get().end(),
+                                                   [&e](const import_table::slot& s) { return s.addr == e.slot; });
+                            if(it != table.get().end())
+                                if(void* p = dlsym(RTLD_DEFAULT, it->name)) e.original = p;
+                        }
+                    }
+                    return e.replacement;
+                });
+                this->applied = true;
+            }
+
+            // Gets the original destination of the import @name (valid after apply)
+            memory_pointer_raw original(const char* name) const
+            {
+                for(auto& e : entries)
+                {
+                    for(auto& s : table.get())
+                        if(s.addr == e.slot && strcmp(s.name, name) == 0) return e.original;
+                }
+                return nullptr;
+            }
+
+            // Puts back the original pointers in the slots
+            virtual void restore()
+            {
+                if(this->applied)
+                {
+                    write_all([](entry& e) { return e.original; });
+                    this->applied = false;
+                }
+            }
+    };
+
+    /*
+     *  MakeImportHook
+     *      Redirects the import @symbol of the module @module (null for the main executable) to @dest
+     *      Returns the previous destination of the import, or null if the module doesn't import it.
+     *      The redirection lasts for the whole lifetime of the program, use scoped_imports for anything else.
+     */
+    inline memory_pointer_raw MakeImportHook(const char* module, const char* symbol, memory_pointer_raw dest)
+    {
+        static std::vector<std::unique_ptr<scoped_imports>> hooks;
+        static std::mutex mutex;
+        std::lock_guard<std::mutex> lock(mutex);
+
+        std::unique_ptr<scoped_imports> batch(new scoped_imports(module));
+        if(batch->add(symbol, dest) == 0)
+            return nullptr;
+
+        batch->apply();
+        hooks.emplace_back(std::move(batch));
+        return hooks.back()->original(symbol);
+    }
+}
@@ -32,13 +32,57 @@
 #define INJECTOR_HAS_INJECTOR_HPP
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include <unistd.h>
 #include <sys/mman.h>
 #include "gvm/gvm.hpp"
+#include "arm64.hpp"
 //#include "../../hook_main.h"
 
+// The x86 calling conventions don't exist on arm64, where every function follows the AAPCS64
+#ifdef _MSC_VER
+#define INJECTOR_STDCALL    __stdcall
+#define INJECTOR_FASTCALL   __fastcall
+#define INJECTOR_THISCALL   __thiscall
+#else
+#define INJECTOR_STDCALL
+#define INJECTOR_FASTCALL
+#define INJECTOR_THISCALL
+#endif
+
+// Code patches claim their range in the patch registry, which may refuse them (see registry.hpp)
+// INJECTOR_TAKE_CLAIM() gets (and forgets) the id of the last claim of this thread, to release it later
+// INJECTOR_DROP_CLAIM(at, size) releases the claim just made, when the write it was for failed
+#ifdef INJECTOR_PATCH_REGISTRY
+#include "registry.hpp"
+#define INJECTOR_CLAIM_PATCH(at, size, ...) \
+    if(!injector::patch_registry::instance().claim((uintptr_t)(at).get<void>(), (size))) return __VA_ARGS__
+#define INJECTOR_TAKE_CLAIM() std::exchange(injector::last_patch_claim(), uint64_t(0))
+#define INJECTOR_RELEASE_PATCH(id, at, size) injector::patch_registry::instance().release((id), (uintptr_t)(at).get<void>(), (size))
+#define INJECTOR_DROP_CLAIM(at, size) (void) INJECTOR_RELEASE_PATCH(INJECTOR_TAKE_CLAIM(), at, size)
+#else
+#define INJECTOR_CLAIM_PATCH(at, size, ...)
+#define INJECTOR_TAKE_CLAIM() uint64_t(0)
+#define INJECTOR_RELEASE_PATCH(id, at, size) true
+#define INJECTOR_DROP_CLAIM(at, size) ((void) 0)
+#endif
+
 namespace injector
 {
 
+/*
+ *  page_size
+ *      Size of the memory pages, arm64 kernels may use 4K, 16K or 64K pages (bionic's PAGE_SIZE is always 4K)
+ */
+inline uintptr_t page_size()
+{
+    static const uintptr_t size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    return size;
+}
+
 /*
  *  auto_pointer 
  *      Casts itself to another pointer type in the lhs
@@ -235,18 +279,40 @@ union memory_pointer_tr
 };
 
 
+/*
+ *  before_write_hook
+ *      Called with a range about to have its protection changed or be written by the patching functions
+ *      (UnprotectMemory, patch_batch, safepoint_patcher), returns true if it changed the protection of some page
+ *      in it. Set by lazy_patcher::arm(), which installs the armed pages of the range first.
+ */
+typedef bool (*before_write_hook_t)(uintptr_t addr, size_t size);
+
+inline std::atomic<before_write_hook_t>& before_write_hook()
+{
+    static std::atomic<before_write_hook_t> hook { nullptr };
+    return hook;
+}
+
+inline bool run_before_write_hook(uintptr_t addr, size_t size)
+{
+    before_write_hook_t hook = before_write_hook().load(std::memory_order_acquire);
+    return hook && size && hook(addr, size);
+}
+
 /*
  *  ProtectMemory
- *      Makes the address @addr have a protection of @protection
+ *      Makes the address @addr (and the pages up to @addr + @size) have a protection of @protection
  */
-inline int ProtectMemory(memory_pointer_tr addr, unsigned int protection)
+inline int ProtectMemory(memory_pointer_tr addr, unsigned int protection, size_t size = 1)
 {
     //return VirtualProtect(addr.get(), size, protection, &protection) != 0;
     //return true;
     uintptr_t calcaddr = (uintptr_t)addr.get<void>();
+    uintptr_t page = page_size();
 
-    void* page_start = (void*)(calcaddr - calcaddr % PAGE_SIZE);
-    return mprotect(page_start, PAGE_SIZE, protection) == 0;
+    uintptr_t page_start = calcaddr - calcaddr % page;
+    uintptr_t page_end = (calcaddr + (size? size : 1) + page - 1) / page * page;
+    return mprotect((void*)page_start, page_end - page_start, protection) == 0;
 
 }
 
@@ -255,17 +321,15 @@ inline int ProtectMemory(memory_pointer_tr addr, unsigned int protection)
  *      Unprotect the memory at @addr with size @size so it have all accesses (execute, read and write)
  *      Returns the old protection to out_oldprotect
  */
-inline int UnprotectMemory(memory_pointer_tr addr, bool bExecutable, unsigned int& out_oldprotect)
+inline int UnprotectMemory(memory_pointer_tr addr, bool bExecutable, unsigned int& out_oldprotect, size_t size = 1)
 {
     //return VirtualProtect(addr.get(), size, PAGE_EXECUTE_READWRITE, &out_oldprotect) != 0;
     //return true;
-    uintptr_t calcaddr = (uintptr_t)addr.get<void>();
-
-    void* page_start = (void*)(calcaddr - calcaddr % PAGE_SIZE);
     out_oldprotect = PROT_READ; // TODO -- find an easy way to get the current memory page status, this is a HACK
     if (bExecutable) out_oldprotect |= PROT_EXEC;
+    run_before_write_hook(addr.as_int(), size);
     //LOGD("unprotect addr: 0x%lX\n", (unsigned long)calcaddr);
-    return mprotect(page_start, PAGE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC) == 0;
+    return ProtectMemory(addr, PROT_READ | PROT_WRITE | PROT_EXEC, size);
 }
 
 /*
@@ -283,15 +347,27 @@ struct scoped_unprotect
     scoped_unprotect(memory_pointer_tr addr, size_t size, bool bExecutable)
     {
         if(size == 0) bUnprotected = false;
-        else          bUnprotected = UnprotectMemory(this->addr = addr.get<void>(), bExecutable, dwOldProtect);
+        else          bUnprotected = UnprotectMemory(this->addr = addr.get<void>(), bExecutable, dwOldProtect, size);
+        this->size = size;
     }
     
     ~scoped_unprotect()
     {
-        if(bUnprotected) ProtectMemory(this->addr.get(), this->dwOldProtect);
+        if(bUnprotected) ProtectMemory(this->addr.get(), this->dwOldProtect, this->size);
     }
 };
 
+/*
+ *  FlushInstructionCache
+ *      Makes the instructions written into [@addr, @addr + @size) visible to the instruction fetcher
+ *      Required after writing code on ARM (data and instruction caches aren't coherent)
+ */
+inline void FlushInstructionCache(memory_pointer_tr addr, size_t size)
+{
+    char* p = addr.get<char>();
+    __builtin___clear_cache(p, p + size);
+}
+
 
 
 
@@ -299,15 +375,200 @@ struct scoped_unprotect
 
 
 
+/*
+ *  process_backend
+ *      The memory of the running process, through the usual unprotect/write/reprotect
+ *      The backend behind the free functions of this file, the others are in backend.hpp
+ *
+ *      A backend is any type with:
+ *          bool read(uintptr_t addr, void* out, size_t size);
+ *          bool write(uintptr_t addr, const void* in, size_t size, bool vp, bool exec);
+ *      Addresses are absolute (already translated). @vp and @exec have the same meaning as in WriteMemory and are
+ *      ignored by backends which don't deal with page protections.
+ */
+struct process_backend
+{
+    bool read(uintptr_t addr, void* out, size_t size, bool vp = false, bool exec = false)
+    {
+        scoped_unprotect xprotect(memory_pointer_raw(addr), vp? size : 0, exec);
+        memcpy(out, (const void*) addr, size);
+        return true;
+    }
+
+    bool write(uintptr_t addr, const void* in, size_t size, bool vp, bool exec)
+    {
+        scoped_unprotect xprotect(memory_pointer_raw(addr), vp? size : 0, exec);
+        if(vp && size && !xprotect.bUnprotected) return false;
+        memcpy((void*) addr, in, size);
+        if(exec) FlushInstructionCache(memory_pointer_raw(addr), size);
+        return true;
+    }
+};
+
+/*
+ *  basic_memory_access
+ *      The read/write/patch primitives over the backend Backend, like basic_memory_pointer takes its translator
+ *      The free functions below (WriteMemoryRaw, MakeB, MakeNOP...) are process_memory.
+ */
+template<class Backend>
+class basic_memory_access
+{
+    private:
+        Backend backend;
+
+    public:
+        template<class ...A>
+        explicit basic_memory_access(A&&... a) : backend(std::forward<A>(a)...)
+        {}
+
+        Backend& get_backend() { return backend; }
+
+        // Can a B/BL at @at reach @dest?
+        static bool can_b(uintptr_t at, uintptr_t dest)
+        {
+            return at % 4 == 0 && dest % 4 == 0 && arm64::is_b_range(at, dest);
+        }
+
+        // Can an ADRP based sequence at @at reach @dest? (@align is the alignment @dest needs)
+        static bool can_br(uintptr_t at, uintptr_t dest, uintptr_t align = 4)
+        {
+            return at % 4 == 0 && dest % align == 0 && arm64::is_adrp_range(at, dest);
+        }
+
+        // Gets the destination of the instruction @ins at @at if it's a B/BL, zero otherwise
+        static uintptr_t branch_target(uint32_t ins, uintptr_t at)
+        {
+            return (arm64::is_b(ins) || arm64::is_bl(ins))? arm64::get_target(ins, at) : 0;
+        }
+
+        // Reads @size bytes at @addr into @out
+        bool read_raw(uintptr_t addr, void* out, size_t size)
+        {
+            return backend.read(addr, out, size);
+        }
+
+        // Writes @size bytes from @in at @addr
+        bool write_raw(uintptr_t addr, const void* in, size_t size, bool vp = true, bool exec = false)
+        {
+            return backend.write(addr, in, size, vp, exec);
+        }
+
+        // Reads the object of type T at @addr (zero initialized on failure)
+        template<class T>
+        T read(uintptr_t addr)
+        {
+            T value = T();
+            read_raw(addr, &value, sizeof(T));
+            return value;
+        }
+
+        // Writes the object @value at @addr
+        template<class T>
+        bool write(uintptr_t addr, const T& value, bool vp = true, bool exec = false)
+        {
+            return write_raw(addr, &value, sizeof(T), vp, exec);
+        }
+
+        // Fills @size bytes at @addr with @value
+        bool fill(uintptr_t addr, uint8_t value, size_t size, bool vp = true, bool exec = false)
+        {
+            uint8_t buf[256];
+            memset(buf, value, sizeof(buf));
+            for(size_t done = 0; done < size; done += sizeof(buf))
+                if(!write_raw(addr + done, buf, std::min(sizeof(buf), size - done), vp, exec)) return false;
+            return true;
+        }
+
+        // Writes @count NOP instructions at @at
+        bool make_nop(uintptr_t at, size_t count = 1, bool vp = true, bool exec = true)
+        {
+            if(at % 4) return false;
+            uint32_t buf[64];
+            for(auto& ins : buf) ins = arm64::nop();
+            for(size_t done = 0; done < count; done += 64)
+                if(!write_raw(at + done * 4, buf, std::min<size_t>(64, count - done) * sizeof(uint32_t), vp, exec)) return false;
+            return true;
+        }
+
+        // Writes a RET instruction at @at
+        bool make_ret(uintptr_t at, bool vp = true, bool exec = true)
+        {
+            return (at % 4) == 0 && write<uint32_t>(at, arm64::ret(), vp, exec);
+        }
+
+        // Gets the destination of the B/BL at @at, zero if there's no branch there
+        uintptr_t branch_destination(uintptr_t at)
+        {
+            uint32_t ins = 0;
+            if(!read_raw(at, &ins, sizeof(ins))) return 0;
+            return branch_target(ins, at);
+        }
+
+        // Writes a B at @at jumping to @dest (+/-128MB), the previous branch destination goes to @prev
+        bool make_b(uintptr_t at, uintptr_t dest, uintptr_t* prev = nullptr, bool vp = true)
+        {
+            if(!can_b(at, dest)) return false;
+            if(prev) *prev = branch_destination(at);
+            return write<uint32_t>(at, arm64::b(at, dest), vp, true);
+        }
+
+        // Writes a BL at @at calling @dest (+/-128MB), the previous branch destination goes to @prev
+        bool make_bl(uintptr_t at, uintptr_t dest, uintptr_t* prev = nullptr, bool vp = true)
+        {
+            if(!can_b(at, dest)) return false;
+            if(prev) *prev = branch_destination(at);
+            return write<uint32_t>(at, arm64::bl(at, dest), vp, true);
+        }
+
+        // Writes ADRP X16 / ADD X16 / BR X16 at @at jumping to @dest (+/-4GB)
+        bool make_br(uintptr_t at, uintptr_t dest, bool vp = true)
+        {
+            return make_adrp_branch(at, dest, false, arm64::br(arm64::ip0), vp);
+        }
+
+        // Writes ADRP X16 / ADD X16 / BLR X16 at @at calling @dest (+/-4GB)
+        bool make_blr(uintptr_t at, uintptr_t dest, bool vp = true)
+        {
+            return make_adrp_branch(at, dest, false, arm64::blr(arm64::ip0), vp);
+        }
+
+        // Writes ADRP X16 / LDR X17 / BR X17 at @at jumping to the address stored at @dest (+/-4GB)
+        bool make_br_pointer(uintptr_t at, uintptr_t dest, bool vp = true)
+        {
+            return make_adrp_branch(at, dest, true, arm64::br(arm64::ip1), vp);
+        }
+
+        // Writes ADRP X16 / LDR X17 / BLR X17 at @at calling the address stored at @dest (+/-4GB)
+        bool make_blr_pointer(uintptr_t at, uintptr_t dest, bool vp = true)
+        {
+            return make_adrp_branch(at, dest, true, arm64::blr(arm64::ip1), vp);
+        }
+
+    private:
+        // Writes ADRP X16, then ADD X16 (or LDR X17 when @load) with the low bits of @dest, then @branch
+        bool make_adrp_branch(uintptr_t at, uintptr_t dest, bool load, uint32_t branch, bool vp)
+        {
+            if(!can_br(at, dest, load? 8 : 4)) return false;
+            const uint32_t code[3] = {
+                arm64::adrp(arm64::ip0, at, dest),
+                load? arm64::ldr_x(arm64::ip1, arm64::ip0, uint32_t(dest & 0xFFF)) : arm64::add_imm(arm64::ip0, arm64::ip0, uint32_t(dest & 0xFFF)),
+                branch,
+            };
+            return write_raw(at, code, sizeof(code), vp, true);
+        }
+};
+
+using process_memory = basic_memory_access<process_backend>;
+
+
 /*
  *  WriteMemoryRaw 
  *      Writes into memory @addr the content of @value with a sizeof @size
- *      Does memory unprotection if @vp is true
+ *      Does memory unprotection if @vp is true, flushes the instruction cache if @exec is true
  */
 inline void WriteMemoryRaw(memory_pointer_tr addr, void* value, size_t size, bool vp, bool exec)
 {
-    scoped_unprotect xprotect(addr, vp? size : 0, exec);
-    memcpy(addr.get(), value, size);
+    process_backend().write(addr.as_int(), value, size, vp, exec);
 }
 
 /*
@@ -317,8 +578,7 @@ inline void WriteMemoryRaw(memory_pointer_tr addr, void* value, size_t size, boo
  */
 inline void ReadMemoryRaw(memory_pointer_tr addr, void* ret, size_t size, bool vp, bool exec)
 {
-    scoped_unprotect xprotect(addr, vp? size : 0, exec);
-    memcpy(ret, addr.get(), size);
+    process_backend().read(addr.as_int(), ret, size, vp, exec);
 }
 
 /*
@@ -482,41 +742,13 @@ inline void MakeRelativeOffset(memory_pointer_tr at, memory_pointer_tr dest, siz
 /*
  *  GetBranchDestination
  *      Gets the destination of a branch instruction at address @at
- *      *** Works only with JMP and CALL for now ***
+ *      *** Works only with B and BL for now ***
  */
 inline memory_pointer_raw GetBranchDestination(memory_pointer_tr at, bool vp = true)
 {
-    uint32_t ins = ReadMemory<uint32_t>(at, vp, true);
-
-    if (ins & 0x14000000) // branch arm64 -- TODO
-    {
-        bool sign = (ins & 0x2000000) != 0;
-        int32_t off = ins & 0x1FFFFFF;
-        if (sign)
-            off = -off;
-        off *= 4;
-        
-        uintptr_t out = off + (uintptr_t)(at.get<void>());
-        return out;
-    }
-
-    //switch(ReadMemory<uint8_t>(at, vp))
-    //{
-    //    // We need to handle other instructions (and prefixes) later...
-    //    case 0xE8:	// call rel
-    //    case 0xE9:	// jmp rel
-    //        return ReadRelativeOffset(at + 1, 4, vp);
-    //
-    //    case 0xFF: 
-    //        switch(ReadMemory<uint8_t>(at + 1, vp))
-    //        {
-    //            case 0x15:  // call dword ptr [addr]
-    //            case 0x25:  // jmp dword ptr [addr]
-    //                return *(ReadMemory<uintptr_t*>(at + 2, vp));
-    //        }
-    //        break;
-    //}
-    return nullptr;
+    uint32_t ins = 0;
+    process_backend().read(at.as_int(), &ins, sizeof(ins), vp, true);
+    return memory_pointer_raw(process_memory::branch_target(ins, at.as_int()));
 }
 
 // /*
@@ -559,181 +791,57 @@ inline memory_pointer_raw GetBranchDestination(memory_pointer_tr at, bool vp = t
 /*
  *  MakeB
  *      Creates a B instruction at address @at that jumps into address @dest
- *      TODO: If there was already a branch instruction there, returns the previosly destination of the branch
+ *      Returns the previous destination of the branch at @at (null if there was none), null on failure as well
  */
 inline memory_pointer_raw MakeB(memory_pointer_tr at, memory_pointer_tr dest, bool vp = true)
 {
-    if ((uintptr_t)at.get<void>() % 4)
-        return nullptr;
-    
-    if ((uintptr_t)dest.get<void>() % 4)
-        return nullptr;
-
-    auto p = GetBranchDestination(at, vp);
-
-    // construct branch arm64
-    intptr_t off = (uintptr_t)(dest.get<void>()) - (uintptr_t)(at.get<void>());
-    uint32_t ins = 0x14000000;
-
-    if (off < 0)
+    uintptr_t prev = 0;
+    if(!process_memory::can_b(at.as_int(), dest.as_int())) return nullptr;
+    INJECTOR_CLAIM_PATCH(at, sizeof(uint32_t), nullptr);
+    if(!process_memory().make_b(at.as_int(), dest.as_int(), &prev, vp))
     {
-        if (off > -4)
-            return nullptr;
-
-
-
-        ins = (off / 4) & 0x17FFFFFF;
-        ins |= 0x2000000;
-    }
-    else
-    {
-        if ((off > 0x7fffffc))
-            return nullptr;
-
-        ins |= ((off / 4) & 0x1FFFFFF);
+        INJECTOR_DROP_CLAIM(at, sizeof(uint32_t));
+        return nullptr;
     }
-
-    //LOGD("off: 0x%X\tins: 0x%X\tat: 0x%lX\tdest: 0x%lX\n", (uint32_t)off, ins, (unsigned long)(at.get<void>()), (unsigned long)(dest.get<void>()));
-
-    WriteMemory<uint32_t>(at, ins, true, true);
-
-    return p;
+    return memory_pointer_raw(prev);
 }
 
 /*
  *  MakeBRaw
  *      Creates a B instruction at address @at that jumps into address (raw) @dest
- *      TODO: If there was already a branch instruction there, returns the previosly destination of the branch
+ *      Returns the previous destination of the branch at @at (null if there was none), null on failure as well
  */
 inline memory_pointer_raw MakeBRaw(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
 {
-    //LOGD("at: 0x%lX\tdest: 0x%lX\n", (unsigned long)(at.get<void>()), (unsigned long)(dest.get<void>()));
-
-    if ((uintptr_t)at.get<void>() % 4)
-        return nullptr;
-
-    if ((uintptr_t)dest.get<void>() % 4)
-        return nullptr;
-
-    auto p = GetBranchDestination(at, vp);
-
-    // construct branch arm64
-    intptr_t off = (uintptr_t)(dest.get<void>()) - (uintptr_t)(at.get<void>());
-    uint32_t ins = 0x14000000;
-
-    if (off < 0)
-    {
-        if (off > -4)
-            return nullptr;
-
-
-
-        ins = (off / 4) & 0x17FFFFFF;
-        ins |= 0x2000000;
-    }
-    else
-    {
-        if ((off > 0x7fffffc))
-            return nullptr;
-
-        ins |= ((off / 4) & 0x1FFFFFF);
-    }
-
-    //LOGD("off: 0x%X\tins: 0x%X\tat: 0x%lX\tdest: 0x%lX\n", (uint32_t)off, ins, (unsigned long)(at.get<void>()), (unsigned long)(dest.get<void>()));
-
-    WriteMemory<uint32_t>(at, ins, true, true);
-
-    return p;
+    return MakeB(at, dest, vp);
 }
 
 /*
  *  MakeBL
  *      Creates a BL instruction at address @at that jumps into address @dest
- *      TODO: If there was already a branch instruction there, returns the previosly destination of the branch
+ *      Returns the previous destination of the branch at @at (null if there was none), null on failure as well
  */
 inline memory_pointer_raw MakeBL(memory_pointer_tr at, memory_pointer_tr dest, bool vp = true)
 {
-    if ((uintptr_t)at.get<void>() % 4)
-        return nullptr;
-
-    if ((uintptr_t)dest.get<void>() % 4)
-        return nullptr;
-
-    auto p = GetBranchDestination(at, vp);
-
-    // construct branch with link arm64
-    intptr_t off = (uintptr_t)(dest.get<void>()) - (uintptr_t)(at.get<void>());
-    uint32_t ins = 0x94000000;
-
-    if (off < 0)
-    {
-        if (off > -4)
-            return nullptr;
-
-
-
-        ins = (off / 4) & 0x17FFFFFF;
-        ins |= 0x2000000;
-    }
-    else
+    uintptr_t prev = 0;
+    if(!process_memory::can_b(at.as_int(), dest.as_int())) return nullptr;
+    INJECTOR_CLAIM_PATCH(at, sizeof(uint32_t), nullptr);
+    if(!process_memory().make_bl(at.as_int(), dest.as_int(), &prev, vp))
     {
-        if ((off > 0x7fffffc))
-            return nullptr;
-
-        ins |= ((off / 4) & 0x1FFFFFF);
+        INJECTOR_DROP_CLAIM(at, sizeof(uint32_t));
+        return nullptr;
     }
-
-    //LOGD("off: 0x%X\tins: 0x%X\tat: 0x%lX\tdest: 0x%lX\n", (uint32_t)off, ins, (unsigned long)(at.get<void>()), (unsigned long)(dest.get<void>()));
-
-    WriteMemory<uint32_t>(at, ins, true, true);
-
-    return p;
+    return memory_pointer_raw(prev);
 }
 
 /*
  *  MakeBLRaw
  *      Creates a BL instruction at address @at that jumps into address (raw) @dest
- *      TODO: If there was already a branch instruction there, returns the previosly destination of the branch
+ *      Returns the previous destination of the branch at @at (null if there was none), null on failure as well
  */
 inline memory_pointer_raw MakeBLRaw(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
 {
-    //LOGD("at: 0x%lX\tdest: 0x%lX\n", (unsigned long)(at.get<void>()), (unsigned long)(dest.get<void>()));
-
-    if ((uintptr_t)at.get<void>() % 4)
-        return nullptr;
-
-    if ((uintptr_t)dest.get<void>() % 4)
-        return nullptr;
-
-    auto p = GetBranchDestination(at, vp);
-
-    // construct branch with link arm64
-    intptr_t off = (uintptr_t)(dest.get<void>()) - (uintptr_t)(at.get<void>());
-    uint32_t ins = 0x94000000;
-
-    if (off < 0)
-    {
-        if (off > -4)
-            return nullptr;
-
-
-
-        ins = (off / 4) & 0x97FFFFFF;
-        ins |= 0x2000000;
-    }
-    else
-    {
-        if ((off > 0x7fffffc))
-            return nullptr;
-
-        ins |= ((off / 4) & 0x1FFFFFF);
-    }
-
-    //LOGD("off: 0x%X\tins: 0x%X\tat: 0x%lX\tdest: 0x%lX\n", (uint32_t)off, ins, (unsigned long)(at.get<void>()), (unsigned long)(dest.get<void>()));
-
-    WriteMemory<uint32_t>(at, ins, true, true);
-
-    return p;
+    return MakeBL(at, dest, vp);
 }
 
 /*
@@ -742,122 +850,22 @@ inline memory_pointer_raw MakeBLRaw(memory_pointer_tr at, memory_pointer_raw des
  */
 inline void MakeBR(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
 {
-    if ((uintptr_t)at.get<void>() % 4)
-        return;
-
-    if ((uintptr_t)dest.get<void>() % 4)
-        return;
-
-    // assemble ADRP X16, addr & 0xF000
-    intptr_t off = ((uintptr_t)(dest.get<void>()) & 0xFFFFFFFFFFFFF000) - ((uintptr_t)(at.get<void>()) & 0xFFFFFFFFFFFFF000);
-    uint32_t ins = 0x90000010;
-    uintptr_t cursor = 0;
-
-    if (off < 0)
-    {
-        intptr_t coff = -off;
-        int32_t count1000 = ((coff >> 12) % 4) & 3;
-        int32_t count4000 = (((coff >> 12) / 5) & 0x3FFFF) + 1;
-
-        count1000 = (-count1000) & 3;
-        count4000 = (-count4000) & 0x3FFFF;
-
-        ins |= (count1000 << 29) | (count4000 << 5) | 0x800000;
-    }
-    else
-    {
-        int32_t count1000 = ((off >> 12) % 4) & 3;
-        int32_t count4000 = ((off >> 12) / 4) & 0x3FFFF;
-
-        ins |= (count1000 << 29) | (count4000 << 5);
-    }
-
-    //LOGD("writing: off: 0x%llX ins: 0x%X\n", (unsigned long long)(at.get<void>()) + cursor, ins);
-    unsigned int oldprotect = 0;
-    UnprotectMemory(at, true, oldprotect);
-    WriteMemory<uint32_t>(at, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    // assemble ADD X16, X16, #(addr & 0xFFF)
-    ins = 0x91000210;
-    off = (uintptr_t)(dest.get<void>()) & 0xFFF;
-    ins |= (off << 10);
-
-    //LOGD("writing: off: 0x%llX ins: 0x%X\n", (unsigned long long)(at.get<void>()) + cursor, ins);
-    WriteMemoryNoTr<uint32_t>((uintptr_t)(at.get<void>()) + cursor, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    // BR X16
-    ins = 0xD61F0200;
-    //LOGD("writing: off: 0x%llX ins: 0x%X\n", (unsigned long long)(at.get<void>()) + cursor, ins);
-    WriteMemoryNoTr<uint32_t>((uintptr_t)(at.get<void>()) + cursor, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    ProtectMemory(at, oldprotect);
-
-    return;
+    if(!process_memory::can_br(at.as_int(), dest.as_int())) return;
+    INJECTOR_CLAIM_PATCH(at, 3 * sizeof(uint32_t));
+    if(!process_memory().make_br(at.as_int(), dest.as_int(), vp))
+        INJECTOR_DROP_CLAIM(at, 3 * sizeof(uint32_t));
 }
 
 /*
  *  MakeBRPointer
- *      Creates BR instructions at address @at that jumps into address @@dest with registers X16 and X17
+ *      Creates BR instructions at address @at that jumps into the address stored at @dest with registers X16 and X17
  */
 inline void MakeBRPointer(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
 {
-    if ((uintptr_t)at.get<void>() % 4)
-        return;
-
-    if ((uintptr_t)dest.get<void>() % 4)
-        return;
-
-    // assemble ADRP X16, addr & 0xF000
-    intptr_t off = ((uintptr_t)(dest.get<void>()) & 0xFFFFFFFFFFFFF000) - ((uintptr_t)(at.get<void>()) & 0xFFFFFFFFFFFFF000);
-    uint32_t ins = 0x90000010;
-    uintptr_t cursor = 0;
-
-    if (off < 0)
-    {
-        intptr_t coff = -off;
-        int32_t count1000 = ((coff >> 12) % 4) & 3;
-        int32_t count4000 = (((coff >> 12) / 5) & 0x3FFFF) + 1;
-
-        count1000 = (-count1000) & 3;
-        count4000 = (-count4000) & 0x3FFFF;
-
-        ins |= (count1000 << 29) | (count4000 << 5) | 0x800000;
-    }
-    else
-    {
-        int32_t count1000 = ((off >> 12) % 4) & 3;
-        int32_t count4000 = ((off >> 12) / 4) & 0x3FFFF;
-
-        ins |= (count1000 << 29) | (count4000 << 5);
-    }
-
-    //LOGD("writing: off: 0x%llX ins: 0x%X\n", (unsigned long long)(at.get<void>()) + cursor, ins);
-    unsigned int oldprotect = 0;
-    UnprotectMemory(at, true, oldprotect);
-    WriteMemory<uint32_t>(at, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    // assemble LDR X17, [X16, #(addr & 0xFFF)]
-    ins = 0xF9400211;
-    off = (uintptr_t)(dest.get<void>()) & 0xFFF;
-    off = off >> 3;
-    ins |= (off << 10);
-
-    WriteMemoryNoTr<uint32_t>((uintptr_t)(at.get<void>()) + cursor, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    // BR X17
-    ins = 0xD61F0220;
-    //LOGD("writing: off: 0x%llX ins: 0x%X\n", (unsigned long long)(at.get<void>()) + cursor, ins);
-    WriteMemoryNoTr<uint32_t>((uintptr_t)(at.get<void>()) + cursor, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    ProtectMemory(at, oldprotect);
-
-    return;
+    if(!process_memory::can_br(at.as_int(), dest.as_int(), 8)) return;
+    INJECTOR_CLAIM_PATCH(at, 3 * sizeof(uint32_t));
+    if(!process_memory().make_br_pointer(at.as_int(), dest.as_int(), vp))
+        INJECTOR_DROP_CLAIM(at, 3 * sizeof(uint32_t));
 }
 
 /*
@@ -866,122 +874,22 @@ inline void MakeBRPointer(memory_pointer_tr at, memory_pointer_raw dest, bool vp
  */
 inline void MakeBLR(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
 {
-    if ((uintptr_t)at.get<void>() % 4)
-        return;
-
-    if ((uintptr_t)dest.get<void>() % 4)
-        return;
-
-    // assemble ADRP X16, addr & 0xF000
-    intptr_t off = ((uintptr_t)(dest.get<void>()) & 0xFFFFFFFFFFFFF000) - ((uintptr_t)(at.get<void>()) & 0xFFFFFFFFFFFFF000);
-    uint32_t ins = 0x90000010;
-    uintptr_t cursor = 0;
-
-    if (off < 0)
-    {
-        intptr_t coff = -off;
-        int32_t count1000 = ((coff >> 12) % 4) & 3;
-        int32_t count4000 = (((coff >> 12) / 5) & 0x3FFFF) + 1;
-
-        count1000 = (-count1000) & 3;
-        count4000 = (-count4000) & 0x3FFFF;
-
-        ins |= (count1000 << 29) | (count4000 << 5) | 0x800000;
-    }
-    else
-    {
-        int32_t count1000 = ((off >> 12) % 4) & 3;
-        int32_t count4000 = ((off >> 12) / 4) & 0x3FFFF;
-
-        ins |= (count1000 << 29) | (count4000 << 5);
-    }
-
-    //LOGD("writing: off: 0x%llX ins: 0x%X\n", (unsigned long long)(at.get<void>()) + cursor, ins);
-    unsigned int oldprotect = 0;
-    UnprotectMemory(at, true, oldprotect);
-    WriteMemory<uint32_t>(at, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    // assemble ADD X16, X16, #(addr & 0xFFF)
-    ins = 0x91000210;
-    off = (uintptr_t)(dest.get<void>()) & 0xFFF;
-    ins |= (off << 10);
-
-    //LOGD("writing: off: 0x%llX ins: 0x%X\n", (unsigned long long)(at.get<void>()) + cursor, ins);
-    WriteMemoryNoTr<uint32_t>((uintptr_t)(at.get<void>()) + cursor, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    // BLR X16
-    ins = 0xD63F0200;
-    //LOGD("writing: off: 0x%llX ins: 0x%X\n", (unsigned long long)(at.get<void>()) + cursor, ins);
-    WriteMemoryNoTr<uint32_t>((uintptr_t)(at.get<void>()) + cursor, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    ProtectMemory(at, oldprotect);
-
-    return;
+    if(!process_memory::can_br(at.as_int(), dest.as_int())) return;
+    INJECTOR_CLAIM_PATCH(at, 3 * sizeof(uint32_t));
+    if(!process_memory().make_blr(at.as_int(), dest.as_int(), vp))
+        INJECTOR_DROP_CLAIM(at, 3 * sizeof(uint32_t));
 }
 
 /*
  *  MakeBLRPointer
- *      Creates BLR instructions at address @at that jumps into address @@dest with registers X16 and X17
+ *      Creates BLR instructions at address @at that jumps into the address stored at @dest with registers X16 and X17
  */
 inline void MakeBLRPointer(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
 {
-    if ((uintptr_t)at.get<void>() % 4)
-        return;
-
-    if ((uintptr_t)dest.get<void>() % 4)
-        return;
-
-    // assemble ADRP X16, addr & 0xF000
-    intptr_t off = ((uintptr_t)(dest.get<void>()) & 0xFFFFFFFFFFFFF000) - ((uintptr_t)(at.get<void>()) & 0xFFFFFFFFFFFFF000);
-    uint32_t ins = 0x90000010;
-    uintptr_t cursor = 0;
-
-    if (off < 0)
-    {
-        intptr_t coff = -off;
-        int32_t count1000 = ((coff >> 12) % 4) & 3;
-        int32_t count4000 = (((coff >> 12) / 5) & 0x3FFFF) + 1;
-
-        count1000 = (-count1000) & 3;
-        count4000 = (-count4000) & 0x3FFFF;
-
-        ins |= (count1000 << 29) | (count4000 << 5) | 0x800000;
-    }
-    else
-    {
-        int32_t count1000 = ((off >> 12) % 4) & 3;
-        int32_t count4000 = ((off >> 12) / 4) & 0x3FFFF;
-
-        ins |= (count1000 << 29) | (count4000 << 5);
-    }
-
-    //LOGD("writing: off: 0x%llX ins: 0x%X\n", (unsigned long long)(at.get<void>()) + cursor, ins);
-    unsigned int oldprotect = 0;
-    UnprotectMemory(at, true, oldprotect);
-    WriteMemory<uint32_t>(at, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    // assemble LDR X17, [X16, #(addr & 0xFFF)]
-    ins = 0xF9400211;
-    off = (uintptr_t)(dest.get<void>()) & 0xFFF;
-    off = off >> 3;
-    ins |= (off << 10);
-
-    WriteMemoryNoTr<uint32_t>((uintptr_t)(at.get<void>()) + cursor, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    // BLR X17
-    ins = 0xD63F0220;
-    //LOGD("writing: off: 0x%llX ins: 0x%X\n", (unsigned long long)(at.get<void>()) + cursor, ins);
-    WriteMemoryNoTr<uint32_t>((uintptr_t)(at.get<void>()) + cursor, ins, false, false);
-    cursor += sizeof(uint32_t);
-
-    ProtectMemory(at, oldprotect);
-
-    return;
+    if(!process_memory::can_br(at.as_int(), dest.as_int(), 8)) return;
+    INJECTOR_CLAIM_PATCH(at, 3 * sizeof(uint32_t));
+    if(!process_memory().make_blr_pointer(at.as_int(), dest.as_int(), vp))
+        INJECTOR_DROP_CLAIM(at, 3 * sizeof(uint32_t));
 }
 
 /*
@@ -990,12 +898,10 @@ inline void MakeBLRPointer(memory_pointer_tr at, memory_pointer_raw dest, bool v
  */
 inline void MakeNOP(memory_pointer_tr at, size_t count = 1, bool vp = true, bool exec = true)
 {
-    uintptr_t calcaddr = (uintptr_t)at.get<void>();
-    for (int i = 0; i < count; i++)
-    {
-        WriteMemory<uint32_t>(calcaddr, 0xD503201F, vp, exec);
-        calcaddr += sizeof(uint32_t);
-    }
+    if(at.as_int() % 4) return;
+    INJECTOR_CLAIM_PATCH(at, count * sizeof(uint32_t));
+    if(!process_memory().make_nop(at.as_int(), count, vp, exec))
+        INJECTOR_DROP_CLAIM(at, count * sizeof(uint32_t));
 }
 
 
@@ -1005,7 +911,10 @@ inline void MakeNOP(memory_pointer_tr at, size_t count = 1, bool vp = true, bool
  */
 inline void MakeRET(memory_pointer_tr at, bool vp = true, bool exec = true)
 {
-    WriteMemory<uint32_t>(at, 0xD65F03C0, vp, exec);
+    if(at.as_int() % 4) return;
+    INJECTOR_CLAIM_PATCH(at, sizeof(uint32_t));
+    if(!process_memory().make_ret(at.as_int(), vp, exec))
+        INJECTOR_DROP_CLAIM(at, sizeof(uint32_t));
 }
 
 
@@ -0,0 +1,256 @@
+/*
+ *  Injectors - Undo Journal
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  An undo journal for many patches: instead of one scoped_basic per patch (each with its own buffer and its own
+ *  restore), the original bytes of every patch are appended to a single arena, each behind a compact header (the
+ *  address as a varint delta from the previous patch and the size as a varint, usually 2 to 4 bytes) and followed
+ *  by the registry claim of the patch as a varint (a single zero byte without INJECTOR_PATCH_REGISTRY).
+ *  Rolling back restores everything through a patch_batch, so a mod unloading its thousands of patches costs one
+ *  protection change and one cache flush per run of pages.
+ *
+ *      patch_journal journal;
+ *      journal.make_b(0x123450, 0x200000);
+ *      journal.make_nop(0x123460, 2);
+ *      ...
+ *      journal.rollback();             // Everything back as it was
+ *
+ *  Only the patches actually written are saved: those which fail, or which the registry refuses, leave the journal
+ *  as it was. With INJECTOR_PATCH_REGISTRY rollback releases the claims too, and leaves alone the patches the
+ *  registry refuses to undo.
+ */
+#pragma once
+#include "injector.hpp"
+#include "batch.hpp"
+#include <cstring>
+#include <vector>
+
+namespace injector
+{
+    /*
+     *  patch_journal
+     *      The original bytes of the patches done through it, oldest first
+     */
+    class patch_journal
+    {
+        public:
+            // A position in the journal, see rollback_to
+            struct mark_type
+            {
+                size_t      offset;
+                size_t      count;
+                uintptr_t   last;
+            };
+
+        private:
+            std::vector<uint8_t>    arena;
+            size_t                  count = 0;
+            uintptr_t               last = 0;   // Address of the newest patch, the next one is stored relative to it
+
+            void put_varint(uint64_t v)
+            {
+                for(; v >= 0x80; v >>= 7) arena.push_back(uint8_t(v | 0x80));
+                arena.push_back(uint8_t(v));
+            }
+
+            static uint64_t get_varint(const uint8_t*& p)
+            {
+                uint64_t v = 0;
+                for(unsigned shift = 0; ; shift += 7)
+                {
+                    uint8_t b = *p++;
+                    v |= uint64_t(b & 0x7F) << shift;
+                    if(!(b & 0x80)) return v;
+                }
+            }
+
+        public:
+            patch_journal() = default;
+            patch_journal(const patch_journal&) = delete;
+            patch_journal& operator=(const patch_journal&) = delete;
+            patch_journal(patch_journal&&) = default;
+            patch_journal& operator=(patch_journal&&) = default;
+
+            // Number of patches saved
+            size_t size() const { return count; }
+            bool empty() const { return count == 0; }
+
+            // Bytes used by the journal, original bytes included
+            size_t memory() const { return arena.size(); }
+
+            mark_type mark() const { return mark_type { arena.size(), count, last }; }
+
+            // Saves the @size bytes at @at, before they get patched
+            void save(memory_pointer_tr at, size_t size)
+            {
+                uintptr_t addr = at.as_int();
+                int64_t delta = int64_t(addr - last);
+                put_varint((uint64_t(delta) << 1) ^ uint64_t(delta >> 63));      // Zigzag
+                put_varint(size);
+                arena.insert(arena.end(), (const uint8_t*) addr, (const uint8_t*) addr + size);
+                arena.push_back(0);                                             // No registry claim
+                last = addr;
+                ++count;
+            }
+
+        private:
+            // Forgets the patches saved after @m, they weren't done
+            void forget(const mark_type& m)
+            {
+                arena.resize(m.offset);
+                count = m.count;
+                last = m.last;
+            }
+
+            // Saves the @size bytes at @at then does the code patch @fn over them, claiming them like the Make* functions
+            // Nothing is saved if the registry refuses the patch or @fn fails
+            template<class F>
+            bool patch(memory_pointer_tr at, size_t size, F fn)
+            {
+                auto m = mark();
+                save(at, size);
+            #ifdef INJECTOR_PATCH_REGISTRY
+                uint64_t claim = patch_registry::instance().claim(at.as_int(), size);
+                if(claim && !fn()) patch_registry::instance().release(claim, at.as_int(), size), claim = 0;
+                if(!claim) return forget(m), false;
+                arena.pop_back();
+                put_varint(claim);
+            #else
+                if(!fn()) return forget(m), false;
+            #endif
+                return true;
+            }
+
+        public:
+
+            // Forgets everything saved, the patches stay
+            void clear()
+            {
+                arena.clear();
+                count = 0;
+                last = 0;
+            }
+
+            // Restores what was saved after @m (newest first), returns the number of restores which failed
+            size_t rollback_to(const mark_type& m)
+            {
+                struct saved { uintptr_t addr; const uint8_t* bytes; size_t size; uint64_t claim; };
+                std::vector<saved> entries;
+                entries.reserve(count - m.count);
+
+                uintptr_t addr = m.last;
+                for(const uint8_t* p = arena.data() + m.offset; p < arena.data() + arena.size(); )
+                {
+                    uint64_t z = get_varint(p);
+                    addr += uintptr_t((z >> 1) ^ (~(z & 1) + 1));
+                    size_t size = size_t(get_varint(p));
+                    const uint8_t* bytes = p;
+                    p += size;
+                    entries.push_back(saved { addr, bytes, size, get_varint(p) });
+                }
+
+                // Newest first, so bytes patched more than once end up with their oldest saved content
+                patch_batch batch;
+                for(size_t i = entries.size(); i-- > 0; )
+                {
+                    auto& e = entries[i];
+                    if(INJECTOR_RELEASE_PATCH(e.claim, memory_pointer_raw(e.addr), e.size))
+                        batch.add(e.addr, e.bytes, e.size);
+                }
+                size_t failed = batch.commit();
+
+                arena.resize(m.offset);
+                count = m.count;
+                last = m.last;
+                return failed;
+            }
+
+            // Restores everything saved, returns the number of restores which failed
+            size_t rollback()
+            {
+                return rollback_to(mark_type { 0, 0, 0 });
+            }
+
+            /*
+             *  The usual patching functions, saving the bytes they overwrite first
+             */
+            bool write_raw(memory_pointer_tr at, void* value, size_t size, bool vp = true, bool exec = true)
+            {
+                auto m = mark();
+                save(at, size);
+                if(!process_memory().write_raw(at.as_int(), value, size, vp, exec)) return forget(m), false;
+                return true;
+            }
+
+            template<class T>
+            bool write(memory_pointer_tr at, T value, bool vp = true, bool exec = false)
+            {
+                return write_raw(at, &value, sizeof(T), vp, exec);
+            }
+
+            memory_pointer_raw make_b(memory_pointer_tr at, memory_pointer_tr dest, bool vp = true)
+            {
+                uintptr_t prev = 0;
+                if(!process_memory::can_b(at.as_int(), dest.as_int())) return nullptr;
+                bool ok = patch(at, sizeof(uint32_t), [&] { return process_memory().make_b(at.as_int(), dest.as_int(), &prev, vp); });
+                return memory_pointer_raw(ok? prev : 0);
+            }
+
+            memory_pointer_raw make_bl(memory_pointer_tr at, memory_pointer_tr dest, bool vp = true)
+            {
+                uintptr_t prev = 0;
+                if(!process_memory::can_b(at.as_int(), dest.as_int())) return nullptr;
+                bool ok = patch(at, sizeof(uint32_t), [&] { return process_memory().make_bl(at.as_int(), dest.as_int(), &prev, vp); });
+                return memory_pointer_raw(ok? prev : 0);
+            }
+
+            bool make_br(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
+            {
+                if(!process_memory::can_br(at.as_int(), dest.as_int())) return false;
+                return patch(at, 3 * sizeof(uint32_t), [&] { return process_memory().make_br(at.as_int(), dest.as_int(), vp); });
+            }
+
+            bool make_blr(memory_pointer_tr at, memory_pointer_raw dest, bool vp = true)
+            {
+                if(!process_memory::can_br(at.as_int(), dest.as_int())) return false;
+                return patch(at, 3 * sizeof(uint32_t), [&] { return process_memory().make_blr(at.as_int(), dest.as_int(), vp); });
+            }
+
+            bool make_nop(memory_pointer_tr at, size_t count = 1, bool vp = true)
+            {
+                if(at.as_int() % 4) return false;
+                return patch(at, count * sizeof(uint32_t), [&] { return process_memory().make_nop(at.as_int(), count, vp); });
+            }
+
+            bool make_ret(memory_pointer_tr at, bool vp = true)
+            {
+                if(at.as_int() % 4) return false;
+                return patch(at, sizeof(uint32_t), [&] { return process_memory().make_ret(at.as_int(), vp); });
+            }
+    };
+}
@@ -0,0 +1,391 @@
+/*
+ *  Injectors - Lazy Patching
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Patches applied on the first execution of their page: arm() drops PROT_EXEC from the code pages with queued
+ *  writes (they stay readable, literal pools and the like still work) and a SIGSEGV handler installs the writes
+ *  of a page when something first tries to run it. Patches of code the session never runs cost nothing but the
+ *  bookkeeping, so the startup time follows the code actually used.
+ *
+ *      auto& lazy = lazy_patcher::instance();
+ *      lazy.add(addr, code, sizeof(code));
+ *      ...
+ *      lazy.arm();                 // Writes to non executable memory are done right away
+ *
+ *  The handler chains to the SIGSEGV handler installed before the first arm(), faults which aren't about an
+ *  armed page go there. A handler installed afterwards (e.g. a crash reporter) has to chain to it as well.
+ *  Writes queued for a page still armed by a previous arm() make it install that page first.
+ *  So do the other ways of patching (WriteMemory, the Make* functions, patch_batch, safepoint_patcher... through
+ *  before_write_hook), the lazy writes go in before theirs and the page gets its execute permission back. A page
+ *  written or reprotected behind the library's back (a plain mprotect) loses its lazy writes.
+ *  The armed tables are never freed, the handler may be reading them at any time.
+ */
+#pragma once
+#include "injector.hpp"
+#include "batch.hpp"
+#include "maps.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <signal.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+namespace injector
+{
+    /*
+     *  lazy_patcher
+     *      Queued writes to code, done when their page first runs
+     *      Addresses are absolute (already translated). There's one per process, see instance().
+     */
+    class lazy_patcher
+    {
+        private:
+            enum : int { armed, installing, installed };
+
+            // The writes of an armed page are pieces[first, first + count)
+            struct page_entry
+            {
+                uintptr_t           page;
+                int                 prot;       // Original protection
+                uint32_t            first;
+                uint32_t            count;
+                std::atomic<int>    state;
+            };
+
+            struct piece
+            {
+                uintptr_t   addr;
+                uint32_t    offset;             // Into bytes
+                uint32_t    size;
+            };
+
+            // What an arm() armed, immutable but for the page states
+            struct table
+            {
+                std::unique_ptr<page_entry[]>   pages;          // Sorted by page
+                size_t                          page_count = 0;
+                std::vector<piece>              pieces;
+                std::vector<uint8_t>            bytes;
+                uintptr_t                       page_size = 0;
+                table*                          next = nullptr;
+            };
+
+            struct pending_write
+            {
+                uintptr_t   addr;
+                size_t      offset;             // Into staging
+                size_t      size;
+            };
+
+            std::vector<pending_write>  pending;
+            std::vector<uint8_t>        staging;
+            std::mutex                  mutex;
+            std::atomic<table*>         tables { nullptr };    // Newest first
+            std::atomic<size_t>         armed_count { 0 };
+            std::atomic<size_t>         installed_count { 0 };
+            struct sigaction            previous;
+            bool                        hooked = false;
+            uintptr_t                   page_size = 0;
+
+            lazy_patcher() = default;
+            lazy_patcher(const lazy_patcher&) = delete;
+
+            // The entry of @page in @t, or null
+            static page_entry* find(table* t, uintptr_t page)
+            {
+                size_t lo = 0, hi = t->page_count;
+                while(lo < hi)
+                {
+                    size_t mid = (lo + hi) / 2;
+                    if(t->pages[mid].page < page) lo = mid + 1;
+                    else hi = mid;
+                }
+                return (lo < t->page_count && t->pages[lo].page == page)? &t->pages[lo] : nullptr;
+            }
+
+            // Installs the writes of @e, or waits for whoever is doing it. Async-signal-safe.
+            // Returns false if it was installed already.
+            bool install(table* t, page_entry& e)
+            {
+                int expected = armed;
+                if(!e.state.compare_exchange_strong(expected, installing, std::memory_order_acq_rel))
+                {
+                    if(expected == installed) return false;
+                    while(e.state.load(std::memory_order_acquire) != installed)
+                        sched_yield();
+                    return true;
+                }
+
+                mprotect((void*) e.page, t->page_size, PROT_READ | PROT_WRITE);
+                for(uint32_t i = e.first; i < e.first + e.count; ++i)
+                {
+                    const piece& p = t->pieces[i];
+                    memcpy((void*) p.addr, t->bytes.data() + p.offset, p.size);
+                }
+                mprotect((void*) e.page, t->page_size, e.prot);
+                __builtin___clear_cache((char*) e.page, (char*) e.page + t->page_size);
+
+                e.state.store(installed, std::memory_order_release);
+                armed_count.fetch_sub(1, std::memory_order_relaxed);
+                installed_count.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+
+            // Installs @page from every table arming it
+            // Returns 0 if no table has it, 1 if it was armed, 2 if it was installed already
+            int install_page(uintptr_t page)
+            {
+                bool seen = false, was_armed = false;
+                for(table* t = tables.load(std::memory_order_acquire); t; t = t->next)
+                {
+                    if(page_entry* e = find(t, page & ~(t->page_size - 1)))
+                    {
+                        seen = true;
+                        if(install(t, *e)) was_armed = true;
+                    }
+                }
+                return was_armed? 1 : seen? 2 : 0;
+            }
+
+            // The address of the instruction which faulted, @fallback where the context isn't known
+            static uintptr_t fault_pc(void* context, uintptr_t fallback)
+            {
+                auto uc = (ucontext_t*) context;
+                (void) uc, (void) fallback;
+            #if defined(__aarch64__)
+                return uintptr_t(uc->uc_mcontext.pc);
+            #elif defined(__x86_64__)
+                return uintptr_t(uc->uc_mcontext.gregs[REG_RIP]);
+            #else
+                return fallback;
+            #endif
+            }
+
+            // The before_write_hook, installs the armed pages of [@addr, @addr + @size)
+            static bool before_write(uintptr_t addr, size_t size)
+            {
+                auto& self = instance();
+                if(self.armed_count.load(std::memory_order_relaxed) == 0) return false;
+
+                bool changed = false;
+                uintptr_t page = self.page_size;
+                for(uintptr_t p = addr & ~(page - 1); p < addr + size; p += page)
+                    changed |= (self.install_page(p) == 1);
+                return changed;
+            }
+
+            static void handler(int sig, siginfo_t* info, void* context)
+            {
+                int saved_errno = errno;
+                auto& self = instance();
+                if(info && info->si_code == SEGV_ACCERR)
+                {
+                    // A page installed by another thread meanwhile only counts if this was an instruction fetch,
+                    // otherwise it's a genuine fault (e.g. a write to code) at an already patched page
+                    uintptr_t addr = uintptr_t(info->si_addr);
+                    int state = self.install_page(addr);
+                    uintptr_t page = self.page_size;
+                    if(state == 1 || (state == 2 && (fault_pc(context, addr) & ~(page - 1)) == (addr & ~(page - 1))))
+                    {
+                        errno = saved_errno;
+                        return;     // Runs the faulting instruction again, now patched
+                    }
+                }
+                errno = saved_errno;
+
+                // Not ours
+                const struct sigaction& prev = self.previous;
+                if(prev.sa_flags & SA_SIGINFO)
+                    prev.sa_sigaction(sig, info, context);
+                else if(prev.sa_handler == SIG_DFL || prev.sa_handler == SIG_IGN)
+                    sigaction(sig, &prev, nullptr);      // The fault happens again and kills the process as it should
+                else
+                    prev.sa_handler(sig);
+            }
+
+        public:
+            static lazy_patcher& instance()
+            {
+                static lazy_patcher patcher;
+                return patcher;
+            }
+
+            // Queues writing @size bytes from @in at @addr, until the next arm()
+            void add(uintptr_t addr, const void* in, size_t size)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.push_back(pending_write { addr, staging.size(), size });
+                staging.insert(staging.end(), (const uint8_t*) in, (const uint8_t*) in + size);
+            }
+
+            // Queues writing the object @value at @addr
+            template<class T>
+            void add(uintptr_t addr, const T& value)
+            {
+                this->add(addr, &value, sizeof(T));
+            }
+
+            // Arms the code pages of the queued writes, the writes to other memory are done now
+            // Returns the number of pages armed, or (size_t) -1 if the handler couldn't be installed.
+            size_t arm()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                const uintptr_t page = injector::page_size();
+                page_size = page;
+
+                if(!hooked)
+                {
+                    struct sigaction sa;
+                    memset(&sa, 0, sizeof(sa));
+                    sa.sa_sigaction = &lazy_patcher::handler;
+                    sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK | SA_NODEFER;
+                    sigemptyset(&sa.sa_mask);
+                    if(sigaction(SIGSEGV, &sa, &previous) != 0)
+                        return size_t(-1);
+                    before_write_hook().store(&lazy_patcher::before_write, std::memory_order_release);
+                    hooked = true;
+                }
+
+                // Split the writes by page, in the order they were added
+                std::vector<piece> pieces;
+                for(auto& w : pending)
+                {
+                    for(size_t done = 0; done < w.size; )
+                    {
+                        uintptr_t at = w.addr + done;
+                        size_t n = std::min(w.size - done, size_t(((at & ~(page - 1)) + page) - at));
+                        pieces.push_back(piece { at, uint32_t(w.offset + done), uint32_t(n) });
+                        done += n;
+                    }
+                }
+                std::stable_sort(pieces.begin(), pieces.end(), [&](const piece& a, const piece& b) {
+                    return (a.addr & ~(page - 1)) < (b.addr & ~(page - 1));
+                });
+
+                // Pages still armed by a previous arm() are installed first, so the writes stack in order
+                for(size_t i = 0; i < pieces.size(); ++i)
+                {
+                    if(i == 0 || (pieces[i].addr & ~(page - 1)) != (pieces[i - 1].addr & ~(page - 1)))
+                        install_page(pieces[i].addr & ~(page - 1));
+                }
+
+                memory_map maps;
+                maps.read();
+
+                auto t = std::unique_ptr<table>(new table());
+                t->page_size = page;
+                t->bytes = std::move(staging);
+                t->pages.reset(new page_entry[pieces.size()]);
+
+                patch_batch now;
+                for(size_t i = 0; i < pieces.size(); )
+                {
+                    uintptr_t p = pieces[i].addr & ~(page - 1);
+                    size_t first = i;
+                    while(i < pieces.size() && (pieces[i].addr & ~(page - 1)) == p) ++i;
+
+                    auto region = maps.find(p);
+                    if(region == nullptr || !(region->prot & PROT_EXEC))
+                    {
+                        // Nothing to wait for (or no mapping, the batch reports it)
+                        for(size_t k = first; k < i; ++k)
+                            now.add(pieces[k].addr, t->bytes.data() + pieces[k].offset, pieces[k].size);
+                        continue;
+                    }
+
+                    page_entry& e = t->pages[t->page_count++];
+                    e.page = p;
+                    e.prot = int(region->prot);
+                    e.state.store(armed, std::memory_order_relaxed);
+
+                    // Keep this page's pieces together at the front
+                    e.first = uint32_t(t->pieces.size());
+                    t->pieces.insert(t->pieces.end(), pieces.begin() + first, pieces.begin() + i);
+                    e.count = uint32_t(i - first);
+                }
+                now.commit(nullptr, &maps);
+
+                pending.clear();
+                staging.clear();
+                size_t count = t->page_count;
+                if(count == 0)
+                    return 0;
+
+                // Publish before dropping the execute permission, the handler must know the page when it faults
+                table* raw = t.release();
+                raw->next = tables.load(std::memory_order_relaxed);
+                tables.store(raw, std::memory_order_release);
+                armed_count.fetch_add(count, std::memory_order_relaxed);
+
+                // One mprotect per run of adjacent pages
+                for(size_t i = 0, j; i < count; i = j)
+                {
+                    const page_entry& first = raw->pages[i];
+                    for(j = i + 1; j < count && raw->pages[j].page == first.page + (j - i) * page && raw->pages[j].prot == first.prot; ++j) {}
+                    if(mprotect((void*) first.page, (j - i) * page, first.prot & ~PROT_EXEC) != 0)
+                        for(size_t k = i; k < j; ++k) install(raw, raw->pages[k]);
+                }
+                return count;
+            }
+
+            // Installs every armed page now (e.g. before the code gets unloaded), returns the number of pages
+            size_t install_all()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                size_t count = 0;
+                for(table* t = tables.load(std::memory_order_acquire); t; t = t->next)
+                {
+                    for(size_t i = 0; i < t->page_count; ++i)
+                    {
+                        if(t->pages[i].state.load(std::memory_order_acquire) != installed)
+                            install(t, t->pages[i]), ++count;
+                    }
+                }
+                return count;
+            }
+
+            // Pages waiting for their first execution
+            size_t armed_pages() const { return armed_count.load(std::memory_order_relaxed); }
+
+            // Pages installed since the start (by a fault, arm() or install_all())
+            size_t installed_pages() const { return installed_count.load(std::memory_order_relaxed); }
+
+            // Writes queued for the next arm()
+            size_t size()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return pending.size();
+            }
+    };
+}
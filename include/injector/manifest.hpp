@@ -0,0 +1,724 @@
+/*
+ *  Injectors - Patch Manifests
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Patch sets as data: a compact binary manifest (header, string table, payload bytes and patch records sorted by
+ *  address) which is mapped and applied in one pass, so patches can be shipped without recompiling.
+ *
+ *  Applying a manifest validates every record first (alignment, branch range, target mapped, expected original
+ *  bytes), spread over a few threads for large manifests, then writes the valid ones through a patch_batch: the
+ *  cost scales with the pages touched rather than with the number of patches.
+ *
+ *  The text form, compiled by compile_manifest (or the injector_manifestc tool) and read by injector_elfpatch too
+ *  (parse_manifest_line), has one patch per line:
+ *
+ *      module libgame.so                   # addresses are relative to this module (default: translated as usual)
+ *      b     0x123450 0x200000             # MakeB
+ *      bl    0x123454 @my_hook             # MakeBL to an exported symbol (dlsym)
+ *      b     @game_update+0x10 @my_hook    # Addresses may be symbols too, with an optional offset
+ *      br    0x123460 @my_hook             # MakeBR (ADRP/ADD/BR X16)
+ *      nop   0x123470 2                    # MakeNOP
+ *      ret   0x123480                      # MakeRET
+ *      u32   0x300000 1000                 # WriteMemory (u8, u16, u32, u64)
+ *      bytes 0x300010 0011aabb             # WriteMemoryRaw
+ *
+ *  Any patch may end with "expect <hex bytes>", the original bytes at its address; the patch is rejected when
+ *  the memory doesn't have them (e.g. a different game version).
+ */
+#pragma once
+#include "injector.hpp"
+#include "arm64.hpp"
+#include "batch.hpp"
+#include "maps.hpp"
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace injector
+{
+    enum class manifest_kind : uint8_t
+    {
+        b       = 1,
+        bl      = 2,
+        br      = 3,
+        nop     = 4,
+        ret     = 5,
+        bytes   = 6,
+    };
+
+    enum manifest_flags : uint8_t
+    {
+        manifest_dest_symbol = 1,       // value is the string table offset of the destination symbol
+        manifest_at_symbol   = 2,       // address is the string table offset of the patched symbol
+    };
+
+    // Why a record wasn't applied
+    enum class manifest_error : uint8_t
+    {
+        none = 0,
+        bad_record,             // Unknown kind, payload out of the file...
+        unresolved,             // Address or destination symbol not found
+        misaligned,
+        out_of_range,           // Branch destination too far
+        unmapped,               // Target not mapped or not readable
+        mismatch,               // The original bytes aren't the expected ones
+        write_failed,
+        conflict,               // Refused by the patch registry (see registry.hpp)
+    };
+
+    inline const char* manifest_error_string(manifest_error e)
+    {
+        switch(e)
+        {
+            case manifest_error::none:          return "ok";
+            case manifest_error::bad_record:    return "bad record";
+            case manifest_error::unresolved:    return "unresolved symbol";
+            case manifest_error::misaligned:    return "misaligned";
+            case manifest_error::out_of_range:  return "branch out of range";
+            case manifest_error::unmapped:      return "unmapped";
+            case manifest_error::mismatch:      return "original bytes mismatch";
+            case manifest_error::write_failed:  return "write failed";
+            case manifest_error::conflict:      return "conflicting patch";
+        }
+        return "unknown";
+    }
+
+    struct manifest_header
+    {
+        char        magic[8];           // "INJPATCH"
+        uint32_t    version;
+        uint32_t    record_size;
+        uint32_t    record_count;
+        uint32_t    records_offset;
+        uint32_t    strings_offset;
+        uint32_t    strings_size;
+        uint32_t    payload_offset;
+        uint32_t    payload_size;
+        uint32_t    module;             // String table offset of the module name, 0 for none
+        uint32_t    reserved;
+        uint64_t    file_size;
+
+        static const uint32_t current_version = 1;
+    };
+
+    struct manifest_record
+    {
+        manifest_kind   kind;
+        uint8_t         flags;          // manifest_flags
+        uint16_t        reserved;
+        uint32_t        count;          // NOP count
+        uint64_t        address;        // Relative to the module, or translated (see manifest_at_symbol)
+        uint64_t        value;          // Branch destination (see manifest_dest_symbol)
+        uint32_t        payload;        // Offset into the payload of the bytes written (bytes)
+        uint32_t        payload_size;
+        uint32_t        expect;         // Offset into the payload of the expected original bytes
+        uint32_t        expect_size;
+    };
+
+    /*
+     *  manifest_builder
+     *      Builds the binary form of a manifest
+     */
+    class manifest_builder
+    {
+        private:
+            std::vector<manifest_record>    records;
+            std::string                     strings = std::string(1, '\0');
+            std::vector<uint8_t>            payload;
+            uint32_t                        module = 0;
+
+        public:
+            // Adds @s to the string table, returns its offset
+            uint32_t add_string(const std::string& s)
+            {
+                auto pos = strings.find(s + '\0');
+                if(pos != std::string::npos) return uint32_t(pos);
+                strings.append(s).push_back('\0');
+                return uint32_t(strings.size() - s.size() - 1);
+            }
+
+            // Adds @size bytes to the payload, returns their offset
+            uint32_t add_payload(const void* data, size_t size)
+            {
+                payload.insert(payload.end(), (const uint8_t*) data, (const uint8_t*) data + size);
+                return uint32_t(payload.size() - size);
+            }
+
+            void set_module(const std::string& name) { module = name.empty()? 0 : add_string(name); }
+
+            // Adds a patch, @expect (@expect_size bytes) are the expected original bytes
+            void add(manifest_record r, const void* expect = nullptr, size_t expect_size = 0)
+            {
+                if(expect_size) r.expect = add_payload(expect, expect_size), r.expect_size = uint32_t(expect_size);
+                records.push_back(r);
+            }
+
+            void add_branch(manifest_kind kind, uint64_t at, uint64_t dest, const char* symbol = nullptr)
+            {
+                manifest_record r = { };
+                r.kind = kind, r.address = at, r.value = dest;
+                if(symbol) r.flags |= manifest_dest_symbol, r.value = add_string(symbol);
+                add(r);
+            }
+
+            void add_bytes(uint64_t at, const void* data, size_t size)
+            {
+                manifest_record r = { };
+                r.kind = manifest_kind::bytes, r.address = at;
+                r.payload = add_payload(data, size), r.payload_size = uint32_t(size);
+                add(r);
+            }
+
+            size_t size() const { return records.size(); }
+
+            // Serializes the manifest, records sorted by address (stable, so same address patches keep their order)
+            // The ones patching a symbol can't be placed before resolving it, they go last
+            std::vector<uint8_t> build() const
+            {
+                auto sorted = records;
+                std::stable_sort(sorted.begin(), sorted.end(), [](const manifest_record& a, const manifest_record& b) {
+                    bool sa = (a.flags & manifest_at_symbol) != 0, sb = (b.flags & manifest_at_symbol) != 0;
+                    return sa != sb? sb : !sa && a.address < b.address;
+                });
+
+                auto align8 = [](size_t n) { return (n + 7) & ~size_t(7); };
+                manifest_header h = { };
+                memcpy(h.magic, "INJPATCH", 8);
+                h.version        = manifest_header::current_version;
+                h.record_size    = sizeof(manifest_record);
+                h.record_count   = uint32_t(sorted.size());
+                h.records_offset = uint32_t(align8(sizeof(h)));
+                h.strings_offset = uint32_t(h.records_offset + sorted.size() * sizeof(manifest_record));
+                h.strings_size   = uint32_t(strings.size());
+                h.payload_offset = uint32_t(align8(h.strings_offset + strings.size()));
+                h.payload_size   = uint32_t(payload.size());
+                h.module         = module;
+                h.file_size      = h.payload_offset + payload.size();
+
+                std::vector<uint8_t> out(size_t(h.file_size));
+                memcpy(out.data(), &h, sizeof(h));
+                if(!sorted.empty())  memcpy(out.data() + h.records_offset, sorted.data(), sorted.size() * sizeof(manifest_record));
+                memcpy(out.data() + h.strings_offset, strings.data(), strings.size());
+                if(!payload.empty()) memcpy(out.data() + h.payload_offset, payload.data(), payload.size());
+                return out;
+            }
+    };
+
+    // An address of the text form: a number, or @symbol[+offset]
+    struct manifest_operand
+    {
+        std::string     symbol;         // Empty for a plain number
+        uint64_t        value = 0;      // The number, or the offset from the symbol
+
+        // The symbol string stored in a manifest, "symbol" or "symbol+offset"
+        std::string symbol_string() const
+        {
+            return value? symbol + "+" + std::to_string(value) : symbol;
+        }
+    };
+
+    // A line of the text form, as parsed by parse_manifest_line
+    struct manifest_line
+    {
+        std::string             op;             // Empty for blank lines, "module" or the patch kind as written
+        manifest_kind           kind = manifest_kind::bytes;
+        manifest_operand        at;
+        manifest_operand        dest;           // b, bl, br
+        uint32_t                count = 1;      // nop
+        std::vector<uint8_t>    bytes;          // The bytes written by u8..u64 and bytes
+        std::vector<uint8_t>    expect;         // The expected original bytes, if any
+        std::string             module;         // module
+    };
+
+    // Splits @line into words, stopping at a # comment
+    inline std::vector<std::string> split_manifest_line(const std::string& line)
+    {
+        std::vector<std::string> words;
+        for(size_t i = 0; i < line.size(); )
+        {
+            while(i < line.size() && isspace((unsigned char) line[i])) ++i;
+            if(i >= line.size() || line[i] == '#') break;
+            size_t j = i;
+            while(j < line.size() && !isspace((unsigned char) line[j])) ++j;
+            words.push_back(line.substr(i, j - i));
+            i = j;
+        }
+        return words;
+    }
+
+    /*
+     *  parse_manifest_line
+     *      Parses a line of the text form (see the top of this file) into @out, a blank line leaves out.op empty
+     *      On failure returns false and describes the problem in @error
+     */
+    inline bool parse_manifest_line(const std::string& line, manifest_line& out, std::string& error)
+    {
+        auto number = [](const std::string& s, uint64_t& v) {
+            char* end;
+            errno = 0;
+            v = strtoull(s.c_str(), &end, 0);
+            return !s.empty() && errno == 0 && *end == 0;
+        };
+        auto operand = [&](const std::string& s, manifest_operand& v) {
+            if(s[0] != '@') return v.symbol.clear(), number(s, v.value);
+            size_t plus = s.find('+');
+            v.symbol = s.substr(1, plus == std::string::npos? std::string::npos : plus - 1), v.value = 0;
+            return !v.symbol.empty() && (plus == std::string::npos || number(s.substr(plus + 1), v.value));
+        };
+        auto hex = [](const std::string& s, std::vector<uint8_t>& v) {
+            if(s.empty() || s.size() % 2) return false;
+            for(size_t i = 0; i < s.size(); i += 2)
+            {
+                char pair[3] = { s[i], s[i + 1], 0 }, *end;
+                v.push_back(uint8_t(strtoul(pair, &end, 16)));
+                if(*end) return false;
+            }
+            return true;
+        };
+        auto fail = [&](const char* what) {
+            error = what;
+            return false;
+        };
+
+        out = manifest_line();
+        auto w = split_manifest_line(line);
+        if(w.empty()) return true;
+        out.op = w[0];
+
+        if(w[0] == "module")
+        {
+            if(w.size() != 2) return fail("module takes a name");
+            out.module = w[1];
+            return true;
+        }
+
+        // The optional trailing "expect <hex>"
+        if(w.size() >= 2 && w[w.size() - 2] == "expect")
+        {
+            if(!hex(w.back(), out.expect)) return fail("bad expected bytes");
+            w.resize(w.size() - 2);
+        }
+
+        if(w.size() < 2 || !operand(w[1], out.at)) return fail("bad address");
+
+        uint64_t v = 1;
+        const std::string& op = w[0];
+        if(op == "b" || op == "bl" || op == "br")
+        {
+            if(w.size() != 3) return fail("branches take an address and a destination");
+            if(!operand(w[2], out.dest)) return fail("bad destination");
+            out.kind = op == "b"? manifest_kind::b : op == "bl"? manifest_kind::bl : manifest_kind::br;
+        }
+        else if(op == "nop" || op == "ret")
+        {
+            if(op == "ret"? w.size() != 2 : (w.size() > 3 || (w.size() == 3 && !number(w[2], v)) || v == 0 || v > 0xFFFFFFFF))
+                return fail("bad arguments");
+            out.kind  = op == "nop"? manifest_kind::nop : manifest_kind::ret;
+            out.count = uint32_t(v);
+        }
+        else if(op == "u8" || op == "u16" || op == "u32" || op == "u64")
+        {
+            size_t n = op == "u8"? 1 : op == "u16"? 2 : op == "u32"? 4 : 8;
+            if(w.size() != 3 || !number(w[2], v) || (n < 8 && (v >> (n * 8)))) return fail("bad value");
+            out.kind = manifest_kind::bytes;
+            out.bytes.assign((const uint8_t*) &v, (const uint8_t*) &v + n);
+        }
+        else if(op == "bytes")
+        {
+            if(w.size() != 3 || !hex(w[2], out.bytes)) return fail("bad hex bytes");
+            out.kind = manifest_kind::bytes;
+        }
+        else
+            return fail("unknown patch kind");
+
+        return true;
+    }
+
+    /*
+     *  compile_manifest
+     *      Compiles the text form of a manifest (see the top of this file) into @out
+     *      On failure returns false and describes the problem (with the line number) in @error
+     */
+    inline bool compile_manifest(const std::string& text, manifest_builder& out, std::string& error)
+    {
+        size_t line_no = 0;
+        manifest_line l;
+        for(size_t pos = 0; pos < text.size(); )
+        {
+            size_t eol = text.find('\n', pos);
+            if(eol == std::string::npos) eol = text.size();
+            std::string line = text.substr(pos, eol - pos);
+            pos = eol + 1, ++line_no;
+
+            if(!parse_manifest_line(line, l, error))
+            {
+                error = "line " + std::to_string(line_no) + ": " + error;
+                return false;
+            }
+            if(l.op.empty()) continue;
+            if(l.op == "module")
+            {
+                out.set_module(l.module);
+                continue;
+            }
+
+            manifest_record r = { };
+            r.kind = l.kind;
+            if(l.kind == manifest_kind::nop || l.kind == manifest_kind::ret) r.count = l.count;
+            if(l.at.symbol.empty()) r.address = l.at.value;
+            else                    r.flags |= manifest_at_symbol, r.address = out.add_string(l.at.symbol_string());
+            if(l.dest.symbol.empty()) r.value = l.dest.value;
+            else                      r.flags |= manifest_dest_symbol, r.value = out.add_string(l.dest.symbol_string());
+            if(!l.bytes.empty())
+                r.payload = out.add_payload(l.bytes.data(), l.bytes.size()), r.payload_size = uint32_t(l.bytes.size());
+
+            out.add(r, l.expect.data(), l.expect.size());
+        }
+        return true;
+    }
+
+    /*
+     *  manifest_view
+     *      A binary manifest, mapped from a file or pointing into memory
+     */
+    class manifest_view
+    {
+        private:
+            const uint8_t*  data = nullptr;
+            size_t          size = 0;
+            bool            mapped = false;
+
+        public:
+            manifest_view() = default;
+            manifest_view(const void* data, size_t size) { this->assign(data, size); }
+
+            ~manifest_view()
+            {
+                this->close();
+            }
+
+            manifest_view(const manifest_view&) = delete;
+            manifest_view& operator=(const manifest_view&) = delete;
+
+            // Uses the manifest at @data (not copied), returns false if it isn't a valid manifest
+            bool assign(const void* data, size_t size)
+            {
+                this->close();
+                this->data = (const uint8_t*) data, this->size = size;
+                if(!valid()) this->data = nullptr, this->size = 0;
+                return this->data != nullptr;
+            }
+
+            // Maps the manifest file at @path, returns false on failure or if it isn't a valid manifest
+            bool open(const char* path)
+            {
+                this->close();
+                int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+                if(fd == -1) return false;
+
+                struct stat st;
+                if(fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(manifest_header))
+                {
+                    void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                    if(p != MAP_FAILED)
+                        this->data = (const uint8_t*) p, this->size = size_t(st.st_size), this->mapped = true;
+                }
+                ::close(fd);
+
+                if(data && !valid()) this->close();
+                return this->data != nullptr;
+            }
+
+            void close()
+            {
+                if(mapped) munmap((void*) data, size);
+                data = nullptr, size = 0, mapped = false;
+            }
+
+            bool is_open() const { return data != nullptr; }
+
+            const manifest_header& header() const { return *(const manifest_header*) data; }
+            size_t count() const { return header().record_count; }
+            const manifest_record* records() const { return (const manifest_record*)(data + header().records_offset); }
+
+            // String at the string table offset @off, nullptr if out of the table
+            const char* string(uint32_t off) const
+            {
+                return off < header().strings_size? (const char*)(data + header().strings_offset + off) : nullptr;
+            }
+
+            // @n payload bytes at @off, nullptr if out of the payload
+            const uint8_t* payload(uint32_t off, uint32_t n) const
+            {
+                return (off <= header().payload_size && n <= header().payload_size - off)? data + header().payload_offset + off : nullptr;
+            }
+
+        private:
+            bool valid() const
+            {
+                if(size < sizeof(manifest_header)) return false;
+                auto& h = header();
+                auto in = [&](uint64_t off, uint64_t n) { return off <= size && n <= size - off; };
+                return memcmp(h.magic, "INJPATCH", 8) == 0 && h.version == manifest_header::current_version
+                    && h.record_size == sizeof(manifest_record) && h.file_size == size
+                    && h.records_offset % alignof(manifest_record) == 0
+                    && in(h.records_offset, uint64_t(h.record_count) * sizeof(manifest_record))
+                    && in(h.strings_offset, h.strings_size) && h.strings_size > 0
+                    && data[h.strings_offset + h.strings_size - 1] == 0
+                    && in(h.payload_offset, h.payload_size);
+            }
+    };
+
+    // Resolves the symbol string of a record ("symbol" or "symbol+offset") with dlsym, 0 if it isn't found
+    inline uintptr_t resolve_manifest_symbol(const char* s)
+    {
+        if(!s) return 0;
+        const char* plus = strchr(s, '+');
+        uintptr_t sym = uintptr_t(dlsym(RTLD_DEFAULT, plus? std::string(s, plus).c_str() : s));
+        return sym && plus? sym + uintptr_t(strtoull(plus + 1, nullptr, 0)) : sym;
+    }
+
+    // The outcome of apply_manifest
+    struct manifest_result
+    {
+        size_t                      applied = 0;
+        size_t                      rejected = 0;
+        size_t                      page_runs = 0;      // Protection changes done
+        std::vector<manifest_error> errors;             // Per record
+    };
+
+    /*
+     *  apply_manifest
+     *      Validates and applies the records of @m, returns what happened to each of them
+     *      Addresses are relative to the manifest's module when it names one, otherwise they're translated as
+     *      usual (memory_pointer_tr). With @all_or_nothing nothing is written if any record is invalid.
+     */
+    inline manifest_result apply_manifest(const manifest_view& m, bool all_or_nothing = false, unsigned threads = 0)
+    {
+        manifest_result result;
+        if(!m.is_open()) return result;
+
+        const size_t n = m.count();
+        const manifest_record* records = m.records();
+        result.errors.assign(n, manifest_error::none);
+
+        memory_map map;
+        map.read();
+
+        // The base of the module, the first mapping of its file
+        bool relative = m.header().module != 0;
+        uintptr_t base = 0;
+        if(relative)
+        {
+            const char* name = m.string(m.header().module);
+            size_t len = name? strlen(name) : 0;
+            for(auto& r : map.get())
+            {
+                if(len && r.offset == 0 && r.path.size() >= len && r.path.compare(r.path.size() - len, len, name) == 0
+                && (r.path.size() == len || r.path[r.path.size() - len - 1] == '/'))
+                {
+                    base = r.begin;
+                    break;
+                }
+            }
+            if(!base)
+            {
+                result.errors.assign(n, manifest_error::unmapped);
+                result.rejected = n;
+                return result;
+            }
+        }
+
+        auto address = [&](uint64_t a) -> uintptr_t {
+            return relative? base + uintptr_t(a) : memory_pointer_tr(uintptr_t(a)).as_int();
+        };
+
+        // The destination of each branch and the bytes each record writes are computed while validating
+        std::vector<uintptr_t> targets(n), dests(n);
+
+        auto size_of = [&](const manifest_record& r) -> size_t {
+            switch(r.kind)
+            {
+                case manifest_kind::b: case manifest_kind::bl: case manifest_kind::ret: return 4;
+                case manifest_kind::br:     return 12;
+                case manifest_kind::nop:    return size_t(r.count) * 4;
+                case manifest_kind::bytes:  return r.payload_size;
+            }
+            return 0;
+        };
+
+        auto validate = [&](size_t first, size_t last)
+        {
+            for(size_t i = first; i < last; ++i)
+            {
+                auto& r = records[i];
+                auto& e = result.errors[i];
+                size_t size = size_of(r);
+                bool at_symbol = (r.flags & manifest_at_symbol) != 0;
+                uintptr_t at = targets[i] = at_symbol? resolve_manifest_symbol(m.string(uint32_t(r.address))) : address(r.address);
+                if(at_symbol && !at) { e = manifest_error::unresolved; continue; }
+
+                if(size == 0 || (r.kind == manifest_kind::bytes && !m.payload(r.payload, r.payload_size))
+                || (r.expect_size && !m.payload(r.expect, r.expect_size)))
+                {
+                    e = manifest_error::bad_record;
+                    continue;
+                }
+
+                bool code = r.kind != manifest_kind::bytes;
+                if(code && at % 4) { e = manifest_error::misaligned; continue; }
+
+                if(r.kind == manifest_kind::b || r.kind == manifest_kind::bl || r.kind == manifest_kind::br)
+                {
+                    uintptr_t dest;
+                    if(r.flags & manifest_dest_symbol)
+                    {
+                        dest = resolve_manifest_symbol(m.string(uint32_t(r.value)));
+                        if(!dest) { e = manifest_error::unresolved; continue; }
+                    }
+                    else
+                        dest = address(r.value);
+
+                    dests[i] = dest;
+                    if(dest % 4) { e = manifest_error::misaligned; continue; }
+                    if(r.kind == manifest_kind::br? !arm64::is_adrp_range(at, dest) : !arm64::is_b_range(at, dest))
+                    {
+                        e = manifest_error::out_of_range;
+                        continue;
+                    }
+                }
+
+                // Every byte (written or compared) must be mapped and readable
+                size_t span = std::max<size_t>(size, r.expect_size);
+                bool mapped = true;
+                for(uintptr_t p = at; mapped && p < at + span; )
+                {
+                    auto region = map.find(p);
+                    mapped = region && (region->prot & PROT_READ);
+                    if(mapped) p = region->end;
+                }
+                if(!mapped) { e = manifest_error::unmapped; continue; }
+
+                if(r.expect_size && memcmp((const void*) at, m.payload(r.expect, r.expect_size), r.expect_size) != 0)
+                    e = manifest_error::mismatch;
+            }
+        };
+
+        // Validation only reads, so large manifests are split over a few threads
+        if(threads == 0) threads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+        size_t chunk = std::max<size_t>(4096, (n + threads - 1) / threads);
+        if(n <= chunk)
+            validate(0, n);
+        else
+        {
+            std::vector<std::thread> pool;
+            for(size_t first = chunk; first < n; first += chunk)
+                pool.emplace_back(validate, first, std::min(n, first + chunk));
+            validate(0, chunk);
+            for(auto& t : pool) t.join();
+        }
+
+        for(auto e : result.errors)
+            if(e != manifest_error::none) ++result.rejected;
+
+        // The valid records claim their range, one the registry refuses is rejected as well
+        std::vector<uint64_t> claims(n, 0);
+    #ifdef INJECTOR_PATCH_REGISTRY
+        for(size_t i = 0; i < n && !(all_or_nothing && result.rejected); ++i)
+        {
+            if(result.errors[i] != manifest_error::none) continue;
+            claims[i] = patch_registry::instance().claim(targets[i], size_of(records[i]));
+            if(!claims[i]) result.errors[i] = manifest_error::conflict, ++result.rejected;
+        }
+    #endif
+        auto unclaim = [&](size_t i) {
+            if(claims[i]) (void) INJECTOR_RELEASE_PATCH(claims[i], raw_ptr(targets[i]), size_of(records[i]));
+        };
+
+        if(all_or_nothing && result.rejected)
+        {
+            for(size_t i = 0; i < n; ++i) unclaim(i);
+            return result;
+        }
+
+        // Then everything valid is written in one batch
+        patch_batch batch;
+        std::vector<size_t> batched;            // Record of each write
+        std::vector<uint32_t> code;
+        for(size_t i = 0; i < n; ++i)
+        {
+            if(result.errors[i] != manifest_error::none) continue;
+            auto& r = records[i];
+            uintptr_t at = targets[i];
+            switch(r.kind)
+            {
+                case manifest_kind::b:   code = { arm64::b(at, dests[i]) }; break;
+                case manifest_kind::bl:  code = { arm64::bl(at, dests[i]) }; break;
+                case manifest_kind::ret: code = { arm64::ret() }; break;
+                case manifest_kind::nop: code.assign(r.count, arm64::nop()); break;
+                case manifest_kind::br:
+                    code = {
+                        arm64::adrp(arm64::ip0, at, dests[i]),
+                        arm64::add_imm(arm64::ip0, arm64::ip0, uint32_t(dests[i] & 0xFFF)),
+                        arm64::br(arm64::ip0),
+                    };
+                    break;
+                case manifest_kind::bytes:
+                    code.clear();
+                    break;
+            }
+
+            if(r.kind == manifest_kind::bytes) batch.add(at, m.payload(r.payload, r.payload_size), r.payload_size);
+            else                               batch.add(at, code.data(), code.size() * sizeof(uint32_t));
+            batched.push_back(i);
+        }
+
+        std::vector<size_t> failed;
+        batch.commit(&failed, &map);
+        for(auto w : failed)
+        {
+            result.errors[batched[w]] = manifest_error::write_failed;
+            unclaim(batched[w]);
+        }
+
+        result.page_runs = batch.runs();
+        result.rejected += failed.size();
+        result.applied = n - result.rejected;
+        return result;
+    }
+}
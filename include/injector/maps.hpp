@@ -0,0 +1,161 @@
+/*
+ *  Injectors - Process Memory Map
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+namespace injector
+{
+    /*
+     *  memory_region
+     *      A single line of /proc/<pid>/maps
+     */
+    struct memory_region
+    {
+        uintptr_t       begin;
+        uintptr_t       end;
+        unsigned int    prot;           // PROT_* flags
+        bool            shared;
+        uint64_t        offset;         // Offset into the mapped file
+        std::string     path;
+
+        bool contains(uintptr_t addr) const { return addr >= begin && addr < end; }
+    };
+
+    /*
+     *  memory_map
+     *      Snapshot of the mappings of a process (sorted by address, as given by the kernel)
+     *      Reading is a syscall-heavy operation, so take one snapshot and query it many times.
+     */
+    class memory_map
+    {
+        private:
+            std::vector<memory_region> regions;
+
+        public:
+            memory_map() = default;
+            explicit memory_map(pid_t pid) { read(pid); }
+
+            // Reads the maps of the process @pid (0 for ourselves)
+            bool read(pid_t pid = 0)
+            {
+                char path[64], line[512 + 256];
+                if(pid) snprintf(path, sizeof(path), "/proc/%d/maps", (int) pid);
+                else    snprintf(path, sizeof(path), "/proc/self/maps");
+
+                regions.clear();
+                FILE* f = fopen(path, "r");
+                if(f == nullptr)
+                    return false;
+
+                while(fgets(line, sizeof(line), f))
+                {
+                    unsigned long begin, end; unsigned long long offset;
+                    char perms[8] = { 0 };
+                    int name_pos = 0;
+
+                    if(sscanf(line, "%lx-%lx %7s %llx %*s %*s %n", &begin, &end, perms, &offset, &name_pos) < 4)
+                        continue;
+
+                    memory_region r;
+                    r.begin  = begin;
+                    r.end    = end;
+                    r.offset = offset;
+                    r.shared = (perms[3] == 's');
+                    r.prot   = (perms[0] == 'r'? PROT_READ : 0) | (perms[1] == 'w'? PROT_WRITE : 0) | (perms[2] == 'x'? PROT_EXEC : 0);
+                    if(name_pos > 0)
+                    {
+                        r.path = line + name_pos;
+                        while(!r.path.empty() && (r.path.back() == '\n' || r.path.back() == ' '))
+                            r.path.pop_back();
+                    }
+                    regions.emplace_back(std::move(r));
+                }
+
+                fclose(f);
+                return true;
+            }
+
+            const std::vector<memory_region>& get() const { return regions; }
+
+            // Finds the region containing @addr, returns nullptr if unmapped
+            const memory_region* find(uintptr_t addr) const
+            {
+                auto it = std::upper_bound(regions.begin(), regions.end(), addr,
+                                           [](uintptr_t a, const memory_region& r) { return a < r.end; });
+                return (it != regions.end() && it->contains(addr))? &*it : nullptr;
+            }
+
+            // Gets the protection at @addr, or -1 if unmapped
+            int protection(uintptr_t addr) const
+            {
+                auto r = find(addr);
+                return r? int(r->prot) : -1;
+            }
+
+            // Finds an unmapped @size bytes area (aligned to @align) as close as possible to @near, which must stay within @range bytes
+            // Returns 0 when there's no such area
+            uintptr_t find_free(uintptr_t near, size_t size, uintptr_t range, size_t align = 0x1000) const
+            {
+                uintptr_t lo  = near > range? near - range : align;
+                uintptr_t hi  = near + range < near? UINTPTR_MAX : near + range;
+                uintptr_t best = 0, best_dist = UINTPTR_MAX;
+
+                auto consider = [&](uintptr_t gap_begin, uintptr_t gap_end)
+                {
+                    gap_begin = std::max(gap_begin, lo);
+                    gap_end   = std::min(gap_end, hi);
+                    if(gap_begin >= gap_end || gap_end - gap_begin < size)
+                        return;
+
+                    // Closest aligned position inside the gap
+                    uintptr_t first = (gap_begin + align - 1) & ~(uintptr_t(align) - 1);
+                    uintptr_t last  = (gap_end - size) & ~(uintptr_t(align) - 1);
+                    if(first > last) return;
+
+                    uintptr_t pos  = near <= first? first : near >= last? last : (near & ~(uintptr_t(align) - 1));
+                    uintptr_t dist = pos > near? pos - near : near - pos;
+                    if(dist < best_dist) best = pos, best_dist = dist;
+                };
+
+                uintptr_t prev_end = align;
+                for(auto& r : regions)
+                {
+                    consider(prev_end, r.begin);
+                    prev_end = r.end;
+                }
+                consider(prev_end, hi);
+                return best;
+            }
+    };
+}
@@ -0,0 +1,312 @@
+/*
+ *  Injectors - Hook Profiling
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Call counters and inclusive/exclusive time of hooks.
+ *  The hook dispatch (function_hooker_manager::call_hooks) is instrumented when INJECTOR_HOOK_PROFILING is defined,
+ *  anything else can be instrumented with a profile_scope.
+ *
+ *  Every thread records into its own block of counters, nothing is shared on the hot path.
+ *  The blocks are only summed up when a snapshot is requested.
+ *
+ *  Each site also gets a per-thread latency_histogram of its inclusive time, merged by snapshot() into percentiles.
+ */
+#pragma once
+#include "histogram.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace injector
+{
+    /*
+     *  ReadTimestamp
+     *      Reads the virtual counter (CNTVCT_EL0) on arm64, a monotonic clock in nanoseconds elsewhere
+     */
+    inline uint64_t ReadTimestamp()
+    {
+    #if defined(__aarch64__)
+        uint64_t v;
+        asm volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(v) :: "memory");
+        return v;
+    #else
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000u + uint64_t(ts.tv_nsec);
+    #endif
+    }
+
+    /*
+     *  GetTimestampFrequency
+     *      Ticks per second of ReadTimestamp
+     */
+    inline uint64_t GetTimestampFrequency()
+    {
+    #if defined(__aarch64__)
+        uint64_t v;
+        asm volatile("mrs %0, cntfrq_el0" : "=r"(v));
+        return v;
+    #else
+        return 1000000000u;
+    #endif
+    }
+
+    /*
+     *  hook_profiler
+     *      Registry of the profiled sites and of the per-thread counter blocks
+     */
+    class hook_profiler
+    {
+        public:
+            // Counters of a site in a single thread, times in timestamp ticks
+            struct alignas(32) counters
+            {
+                uint64_t calls;
+                uint64_t inclusive;
+                uint64_t exclusive;
+                latency_histogram* histogram;       // Inclusive times, allocated on the first call
+            };
+
+            // Aggregated counters of a site, as given by snapshot()
+            struct entry
+            {
+                std::string name;
+                uint64_t    calls;
+                uint64_t    inclusive_ns;
+                uint64_t    exclusive_ns;
+                uint64_t    p50_ns;                 // Percentiles of the inclusive time of a call
+                uint64_t    p99_ns;
+                uint64_t    p999_ns;
+                uint64_t    max_ns;
+            };
+
+            static const size_t chunk_size = 64;        // Counters per chunk
+            static const size_t max_chunks = 64;        // Limits the amount of ids to 4096
+
+            // The counters of a thread, allocated in chunks as new ids get used
+            struct thread_block
+            {
+                struct alignas(64) chunk { counters c[chunk_size]; };
+
+                chunk*  chunks[max_chunks] = { };
+                bool    in_use = true;
+
+                counters* get(uint32_t id)
+                {
+                    auto& ch = chunks[id / chunk_size];
+                    if(ch == nullptr)
+                        __atomic_store_n(&ch, new chunk(), __ATOMIC_RELEASE);  // First use only
+                    return &ch->c[id % chunk_size];
+                }
+
+                latency_histogram* histogram(counters* c)
+                {
+                    if(c->histogram == nullptr)
+                        __atomic_store_n(&c->histogram, new latency_histogram(), __ATOMIC_RELEASE);  // First use only
+                    return c->histogram;
+                }
+            };
+
+        private:
+            std::mutex                  mutex;
+            std::vector<std::string>    names;
+            std::vector<thread_block*>  blocks;
+
+            hook_profiler() = default;
+            hook_profiler(const hook_profiler&) = delete;
+
+        public:
+            // Registers @count consecutive ids, the first one named @name and the next ones @name + @suffixes[i - 1]
+            uint32_t register_ids(const std::string& name, size_t count = 1, const char* const* suffixes = nullptr)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                uint32_t id = uint32_t(names.size());
+                if(id + count > chunk_size * max_chunks)
+                    return uint32_t(chunk_size * max_chunks - 1);   // Out of ids, lump into the last one
+                for(size_t i = 0; i < count; ++i)
+                    names.push_back(i == 0 || suffixes == nullptr? name : name + suffixes[i - 1]);
+                return id;
+            }
+
+            // Gets a counter block for a new thread (recycling the ones from dead threads, their counts are kept)
+            thread_block* acquire_block()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for(auto b : blocks)
+                    if(!b->in_use) return b->in_use = true, b;
+                blocks.push_back(new thread_block());
+                return blocks.back();
+            }
+
+            void release_block(thread_block* b)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                b->in_use = false;
+            }
+
+            // Sums up the counters of every thread
+            std::vector<entry> snapshot()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::vector<entry> result(names.size());
+                double ns = 1e9 / double(GetTimestampFrequency());
+
+                for(size_t id = 0; id < names.size(); ++id)
+                {
+                    counters sum = { };
+                    latency_histogram hist;
+                    for(auto b : blocks)
+                    {
+                        auto ch = __atomic_load_n(&b->chunks[id / chunk_size], __ATOMIC_ACQUIRE);
+                        if(ch == nullptr) continue;
+                        auto& c = ch->c[id % chunk_size];
+                        sum.calls     += __atomic_load_n(&c.calls, __ATOMIC_RELAXED);
+                        sum.inclusive += __atomic_load_n(&c.inclusive, __ATOMIC_RELAXED);
+                        sum.exclusive += __atomic_load_n(&c.exclusive, __ATOMIC_RELAXED);
+                        if(auto h = __atomic_load_n(&c.histogram, __ATOMIC_ACQUIRE)) hist.merge(*h);
+                    }
+
+                    result[id].name         = names[id];
+                    result[id].calls        = sum.calls;
+                    result[id].inclusive_ns = uint64_t(double(sum.inclusive) * ns);
+                    result[id].exclusive_ns = uint64_t(double(sum.exclusive) * ns);
+                    result[id].p50_ns       = uint64_t(double(hist.percentile(50.0)) * ns);
+                    result[id].p99_ns       = uint64_t(double(hist.percentile(99.0)) * ns);
+                    result[id].p999_ns      = uint64_t(double(hist.percentile(99.9)) * ns);
+                    result[id].max_ns       = uint64_t(double(hist.maximum()) * ns);
+                }
+                return result;
+            }
+
+            // Zeroes every counter (counts racing with this may get lost)
+            void reset()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for(auto b : blocks)
+                    for(auto ch : b->chunks)
+                        if(ch) for(auto& c : ch->c)
+                        {
+                            __atomic_store_n(&c.calls, 0, __ATOMIC_RELAXED);
+                            __atomic_store_n(&c.inclusive, 0, __ATOMIC_RELAXED);
+                            __atomic_store_n(&c.exclusive, 0, __ATOMIC_RELAXED);
+                            if(auto h = __atomic_load_n(&c.histogram, __ATOMIC_ACQUIRE)) h->reset();
+                        }
+            }
+
+            // Merges the histograms of the id @id from every thread, values in timestamp ticks
+            latency_histogram histogram(uint32_t id)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                latency_histogram result;
+                for(auto b : blocks)
+                {
+                    auto ch = __atomic_load_n(&b->chunks[id / chunk_size], __ATOMIC_ACQUIRE);
+                    if(ch == nullptr) continue;
+                    if(auto h = __atomic_load_n(&ch->c[id % chunk_size].histogram, __ATOMIC_ACQUIRE))
+                        result.merge(*h);
+                }
+                return result;
+            }
+
+            // Writes a snapshot to @f, one line per site
+            void dump(FILE* f)
+            {
+                for(auto& e : snapshot())
+                {
+                    if(e.calls == 0) continue;
+                    fprintf(f, "%-40s calls=%-10llu incl=%lluns excl=%lluns avg=%lluns p50=%lluns p99=%lluns "
+                               "p99.9=%lluns max=%lluns\n", e.name.c_str(),
+                            (unsigned long long) e.calls, (unsigned long long) e.inclusive_ns,
+                            (unsigned long long) e.exclusive_ns, (unsigned long long)(e.inclusive_ns / e.calls),
+                            (unsigned long long) e.p50_ns, (unsigned long long) e.p99_ns,
+                            (unsigned long long) e.p999_ns, (unsigned long long) e.max_ns);
+                }
+            }
+
+            static hook_profiler& singleton()
+            {
+                static hook_profiler p;
+                return p;
+            }
+    };
+
+    /*
+     *  profile_scope
+     *      Counts a call of the id @id and measures the time until destruction
+     *      Scopes nest (per thread), the time of inner scopes is taken out of the exclusive time of the outer one.
+     */
+    class profile_scope
+    {
+        private:
+            // State of the current thread
+            struct thread_state
+            {
+                hook_profiler::thread_block* block = hook_profiler::singleton().acquire_block();
+                profile_scope*               current = nullptr;
+
+                ~thread_state() { hook_profiler::singleton().release_block(block); }
+            };
+
+            static thread_state& state()
+            {
+                static thread_local thread_state s;
+                return s;
+            }
+
+            thread_state&   ts;
+            profile_scope*  parent;
+            uint32_t        id;
+            uint64_t        start;
+            uint64_t        children = 0;
+
+        public:
+            explicit profile_scope(uint32_t id) : ts(state()), parent(ts.current), id(id)
+            {
+                ts.current = this;
+                start = ReadTimestamp();
+            }
+
+            ~profile_scope()
+            {
+                uint64_t elapsed = ReadTimestamp() - start;
+                auto c = ts.block->get(id);
+                __atomic_store_n(&c->calls, c->calls + 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&c->inclusive, c->inclusive + elapsed, __ATOMIC_RELAXED);
+                __atomic_store_n(&c->exclusive, c->exclusive + (elapsed - children), __ATOMIC_RELAXED);
+                ts.block->histogram(c)->record(elapsed);
+                if(parent) parent->children += elapsed;
+                ts.current = parent;
+            }
+
+            profile_scope(const profile_scope&) = delete;
+            profile_scope& operator=(const profile_scope&) = delete;
+    };
+}
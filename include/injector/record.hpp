@@ -0,0 +1,406 @@
+/*
+ *  Injectors - Call Recording and Replay
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Records the arguments and return value of every call of a hooked function into a binary log, and replays them.
+ *
+ *      call_recorder rec; rec.open("calls.bin");
+ *      hook.make_call(MakeCallRecorder<decltype(hook)>(rec));
+ *      ...
+ *      call_log log; log.load("calls.bin");
+ *      auto r = replay<int(Obj*, float)>::run(log, hook.addr, raw_ptr(fn));
+ *
+ *  Trivially copyable types are copied as they are (notice pointers are recorded as addresses, not what they point to),
+ *  std::string gets its contents copied, anything else needs a record_traits specialization.
+ *
+ *  Log format: "INJCALLS", version (u32), then one frame per call: payload size (u32), site (u64), payload.
+ *  The payload is every argument in order followed by the return value (if not void).
+ */
+#pragma once
+#include "injector.hpp"
+#include "calling.hpp"
+#include "profiling.hpp"        // for ReadTimestamp
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace injector
+{
+    /*
+     *  record_buffer / record_cursor
+     *      Output and input byte streams of the serializers
+     */
+    class record_buffer
+    {
+        public:
+            std::vector<uint8_t> bytes;
+
+            void write(const void* p, size_t size)
+            {
+                auto b = (const uint8_t*) p;
+                bytes.insert(bytes.end(), b, b + size);
+            }
+    };
+
+    class record_cursor
+    {
+        private:
+            const uint8_t*  p;
+            const uint8_t*  end;
+            bool            good = true;
+
+        public:
+            record_cursor(const void* p, size_t size) : p((const uint8_t*) p), end((const uint8_t*) p + size)
+            {}
+
+            // Reads @size bytes into @out, zeroes it and fails the cursor on a short read
+            void read(void* out, size_t size)
+            {
+                if(size_t(end - p) < size)
+                {
+                    memset(out, 0, size);
+                    good = false;
+                    p = end;
+                    return;
+                }
+                memcpy(out, p, size);
+                p += size;
+            }
+
+            bool ok() const { return good; }
+    };
+
+    /*
+     *  record_traits
+     *      Serializer of the type T, specialize it for types which aren't trivially copyable:
+     *          static void write(record_buffer&, const T&);
+     *          static T    read(record_cursor&);
+     */
+    template<class T, class = void>
+    struct record_traits
+    {
+        static_assert(sizeof(T) == 0, "record_traits must be specialized for non trivially copyable types");
+    };
+
+    template<class T>
+    struct record_traits<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type>
+    {
+        static void write(record_buffer& b, const T& v)
+        {
+            b.write(&v, sizeof(T));
+        }
+
+        static T read(record_cursor& c)
+        {
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+            c.read(&storage, sizeof(T));
+            T v;
+            memcpy((void*) &v, &storage, sizeof(T));
+            return v;
+        }
+    };
+
+    template<>
+    struct record_traits<std::string>
+    {
+        static void write(record_buffer& b, const std::string& v)
+        {
+            uint32_t size = uint32_t(v.size());
+            b.write(&size, sizeof(size));
+            b.write(v.data(), size);
+        }
+
+        static std::string read(record_cursor& c)
+        {
+            uint32_t size = 0;
+            c.read(&size, sizeof(size));
+            std::string v;
+            if(c.ok())
+            {
+                v.resize(size);
+                c.read(&v[0], size);
+            }
+            return v;
+        }
+    };
+
+    template<class T>
+    inline void RecordValue(record_buffer& b, const T& v)
+    {
+        record_traits<typename std::decay<T>::type>::write(b, v);
+    }
+
+    /*
+     *  call_recorder
+     *      Writes the call frames into a log file
+     */
+    class call_recorder
+    {
+        private:
+            FILE*       file = nullptr;
+            std::mutex  mutex;
+
+        public:
+            static constexpr const char* signature = "INJCALLS";
+            static const uint32_t current_version = 1;
+
+            call_recorder() = default;
+            call_recorder(const call_recorder&) = delete;
+            call_recorder& operator=(const call_recorder&) = delete;
+
+            ~call_recorder()
+            {
+                this->close();
+            }
+
+            // Starts a new log at @path, returns false on failure
+            bool open(const char* path)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(file) fclose(file);
+                file = fopen(path, "wb");
+                if(file == nullptr) return false;
+
+                uint32_t version = current_version;
+                fwrite(signature, 1, 8, file);
+                fwrite(&version, sizeof(version), 1, file);
+                return true;
+            }
+
+            void close()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(file) fclose(file), file = nullptr;
+            }
+
+            void flush()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(file) fflush(file);
+            }
+
+            bool is_open() const
+            {
+                return file != nullptr;
+            }
+
+            // Writes the frame of a call of @site, with the serialized arguments and return value in @payload
+            void commit(uint64_t site, const record_buffer& payload)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(file == nullptr) return;
+
+                uint32_t size = uint32_t(payload.bytes.size());
+                fwrite(&size, sizeof(size), 1, file);
+                fwrite(&site, sizeof(site), 1, file);
+                fwrite(payload.bytes.data(), 1, size, file);
+            }
+    };
+
+    /*
+     *  MakeCallRecorder
+     *      Makes a functor for Hooker::make_call which records each call into @rec (under the site Hooker::addr) and
+     *      then forwards it. The arguments are captured before being forwarded, the return value after.
+     */
+    template<class Functor>
+    struct call_recorder_functor;
+
+    template<class Ret, class ...Args>
+    struct call_recorder_functor<std::function<Ret(std::function<Ret(Args...)>, Args&...)>>
+    {
+        using functor_type = std::function<Ret(std::function<Ret(Args...)>, Args&...)>;
+
+        static functor_type make(call_recorder& rec, uint64_t site)
+        {
+            return [&rec, site](std::function<Ret(Args...)> next, Args&... args) -> Ret
+            {
+                if(!rec.is_open())
+                    return next(args...);
+
+                record_buffer payload;
+                (void) std::initializer_list<int>{ (RecordValue(payload, args), 0)... };
+
+                if constexpr(std::is_void<Ret>::value)
+                {
+                    next(args...);
+                    rec.commit(site, payload);
+                }
+                else
+                {
+                    Ret r = next(args...);
+                    RecordValue(payload, r);
+                    rec.commit(site, payload);
+                    return r;
+                }
+            };
+        }
+    };
+
+    template<class Hooker>
+    inline typename Hooker::functor_type MakeCallRecorder(call_recorder& rec)
+    {
+        return call_recorder_functor<typename Hooker::functor_type>::make(rec, Hooker::addr);
+    }
+
+    /*
+     *  call_log
+     *      A loaded log, split in frames
+     */
+    class call_log
+    {
+        public:
+            struct frame
+            {
+                uint64_t    site;
+                size_t      offset;         // Of the payload in data
+                uint32_t    size;
+            };
+
+            std::vector<uint8_t>    data;
+            std::vector<frame>      frames;
+
+            // Loads the log at @path, returns false if it's not a log (a truncated last frame is dropped)
+            bool load(const char* path)
+            {
+                data.clear(), frames.clear();
+                FILE* f = fopen(path, "rb");
+                if(f == nullptr) return false;
+
+                uint8_t chunk[4096];
+                size_t n;
+                while((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+                    data.insert(data.end(), chunk, chunk + n);
+                fclose(f);
+
+                const size_t header_size = 8 + sizeof(uint32_t);
+                uint32_t version = 0;
+                if(data.size() < header_size || memcmp(data.data(), call_recorder::signature, 8) != 0)
+                    return false;
+                memcpy(&version, &data[8], sizeof(version));
+                if(version != call_recorder::current_version)
+                    return false;
+
+                for(size_t off = header_size; off + 12 <= data.size(); )
+                {
+                    frame fr;
+                    memcpy(&fr.size, &data[off], sizeof(fr.size));
+                    memcpy(&fr.site, &data[off + 4], sizeof(fr.site));
+                    fr.offset = off + 12;
+                    if(fr.offset + fr.size > data.size()) break;
+                    frames.push_back(fr);
+                    off = fr.offset + fr.size;
+                }
+                return true;
+            }
+
+            record_cursor cursor(const frame& fr) const
+            {
+                return record_cursor(&data[fr.offset], fr.size);
+            }
+    };
+
+    /*
+     *  replay
+     *      Calls a function with the arguments recorded for a site, through cstd<Ret(Args...)>
+     */
+    template<class T, class = void>
+    struct replay_is_comparable : std::false_type {};
+
+    template<class T>
+    struct replay_is_comparable<T, decltype(void(std::declval<const T&>() == std::declval<const T&>()))> : std::true_type {};
+
+    struct replay_result
+    {
+        size_t      calls       = 0;        // Frames replayed
+        size_t      mismatches  = 0;        // Calls whose return value differs from the recorded one
+        size_t      bad_frames  = 0;        // Frames which failed to decode
+        uint64_t    elapsed_ns  = 0;        // Time spent inside the function (decoding not included)
+    };
+
+    template<class Prototype>
+    struct replay;
+
+    template<class Ret, class ...Args>
+    struct replay<Ret(Args...)>
+    {
+        // Replays every frame of @site in @log on the function at @fn, @repeat times each
+        static replay_result run(const call_log& log, uint64_t site, memory_pointer_tr fn, size_t repeat = 1)
+        {
+            replay_result result;
+            uint64_t ticks = 0;
+            for(auto& fr : log.frames)
+            {
+                if(fr.site != site) continue;
+                auto cur = log.cursor(fr);
+                auto args = std::tuple<typename std::decay<Args>::type...> {
+                    record_traits<typename std::decay<Args>::type>::read(cur)...
+                };
+                if(!cur.ok()) { ++result.bad_frames; continue; }
+
+                for(size_t i = 0; i < repeat; ++i)
+                {
+                    auto args_copy = args;          // The function may modify its arguments
+                    ticks += call(fn, args_copy, cur, result, std::index_sequence_for<Args...>());
+                    ++result.calls;
+                }
+            }
+            result.elapsed_ns = uint64_t(double(ticks) * 1e9 / double(GetTimestampFrequency()));
+            return result;
+        }
+
+    private:
+        template<class Tuple, size_t ...I>
+        static uint64_t call(memory_pointer_tr fn, Tuple& args, record_cursor cur, replay_result& result, std::index_sequence<I...>)
+        {
+            uint64_t start = ReadTimestamp();
+            if constexpr(std::is_void<Ret>::value)
+            {
+                cstd<Ret(Args...)>::call(fn, std::get<I>(args)...);
+                return ReadTimestamp() - start;
+            }
+            else
+            {
+                using R = typename std::decay<Ret>::type;
+                R r = cstd<Ret(Args...)>::call(fn, std::get<I>(args)...);
+                uint64_t ticks = ReadTimestamp() - start;
+
+                if constexpr(replay_is_comparable<R>::value)
+                {
+                    R recorded = record_traits<R>::read(cur);
+                    if(cur.ok() && !(recorded == r)) ++result.mismatches;
+                }
+                return ticks;
+            }
+        }
+    };
+}
@@ -0,0 +1,368 @@
+/*
+ *  Injectors - Patch Registry
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Process-wide registry of the patched byte ranges, to catch two mods patching the same code.
+ *
+ *  When INJECTOR_PATCH_REGISTRY is defined these claim the range they write:
+ *      the code patching functions (MakeB, MakeBL, MakeBR, MakeNOP, MakeRET and family), MakeInline, MakeExitHook
+ *      scoped_nop, scoped_jmp, scoped_call and function_hooker (through the above), released by their restore
+ *          with the id of their own claim (see last_patch_claim)
+ *      patch_journal and live_patch_set, released by their rollback/revert
+ *      apply_manifest, whose refused records fail with manifest_error::conflict
+ *  These write without claiming, they're raw writes (or build on them) and whoever uses them for code patches
+ *  should claim the range itself:
+ *      WriteMemory, WriteMemoryRaw, MemoryFill, WriteObject, scoped_write, scoped_fill and the
+ *          basic_memory_access primitives
+ *      patch_batch and async_patcher (which applies patch_batches)
+ *      lazy_patcher and safepoint_patcher
+ *  A claim whose write fails is released. An overlap with a range claimed before is a conflict, handled by the
+ *  policy:
+ *      reject  the new patch isn't written (and a restore which would undo a newer patch isn't done)
+ *      stack   a patch over exactly the range of the previous ones is let through without a report, partial
+ *              overlaps are rejected. It only overwrites their bytes (restoring in reverse order brings them
+ *              back), calling the previous code is up to the new patch, e.g. function_hooker reads the
+ *              previous call destination before replacing it
+ *      warn    everything goes through, conflicts are only reported
+ *  Conflicts are reported to the handler (stderr by default) with the owners of both patches, see
+ *  scoped_patch_owner.
+ *
+ *  The claimed bytes are indexed as disjoint segments (ordered by address) each listing the claims covering it, so
+ *  an overlap query is O(log n) plus the segments it meets whatever the size of the claims: a claim over a whole
+ *  module doesn't slow down the queries of the small patches inside it.
+ */
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace injector
+{
+    enum class conflict_policy : uint8_t
+    {
+        reject,
+        stack,
+        warn,
+    };
+
+    // A patched range [begin, end)
+    struct patch_claim
+    {
+        uintptr_t   begin;
+        uintptr_t   end;
+        const char* owner;          // See scoped_patch_owner, nullptr if unknown
+        uint64_t    id;             // Increasing, newer claims have greater ids
+    };
+
+    struct patch_conflict
+    {
+        patch_claim     existing;
+        patch_claim     incoming;
+        bool            on_release; // A release of @incoming would undo the newer @existing
+        bool            allowed;    // Did the policy let it through?
+    };
+
+    // The owner of the patches done by this thread, nullptr if unknown
+    inline const char*& current_patch_owner()
+    {
+        static thread_local const char* owner = nullptr;
+        return owner;
+    }
+
+    // The id of the newest claim tried by this thread, 0 if the policy rejected it
+    // The patching functions don't return their claim, whoever restores their patch later takes it from here
+    inline uint64_t& last_patch_claim()
+    {
+        static thread_local uint64_t id = 0;
+        return id;
+    }
+
+    /*
+     *  scoped_patch_owner
+     *      Names the owner (e.g. the mod) of the patches done by this thread while it's alive
+     */
+    class scoped_patch_owner
+    {
+        private:
+            const char* previous;
+
+        public:
+            explicit scoped_patch_owner(const char* owner) : previous(current_patch_owner())
+            {
+                current_patch_owner() = owner;
+            }
+
+            ~scoped_patch_owner()
+            {
+                current_patch_owner() = previous;
+            }
+
+            scoped_patch_owner(const scoped_patch_owner&) = delete;
+            scoped_patch_owner& operator=(const scoped_patch_owner&) = delete;
+    };
+
+    /*
+     *  patch_registry
+     *      The patched ranges of the process
+     */
+    class patch_registry
+    {
+        public:
+            using handler_type = std::function<void(const patch_conflict&)>;
+
+        private:
+            // Bytes [begin, end) covered by the same claims, begin is its key in segments
+            struct segment
+            {
+                uintptr_t               end;
+                std::vector<uint64_t>   ids;    // Oldest first
+            };
+
+            std::map<uintptr_t, segment>                segments;       // Disjoint, only the claimed bytes
+            std::unordered_map<uint64_t, patch_claim>   claims;         // By id
+            uint64_t                                    next_id = 1;
+            size_t                                      conflicts = 0;
+            conflict_policy                             policy = conflict_policy::warn;
+            handler_type                                handler;
+            mutable std::mutex                          mutex;
+
+            using segment_iterator = std::map<uintptr_t, segment>::iterator;
+
+            // The first segment ending after @addr
+            segment_iterator first_after(uintptr_t addr)
+            {
+                auto it = segments.upper_bound(addr);
+                if(it != segments.begin() && std::prev(it)->second.end > addr) --it;
+                return it;
+            }
+
+            // Makes @addr a segment boundary, returns the segment starting there (or the next one)
+            segment_iterator split(uintptr_t addr)
+            {
+                auto it = first_after(addr);
+                if(it == segments.end() || it->first >= addr) return it;
+                segment tail = it->second;
+                it->second.end = addr;
+                return segments.emplace_hint(std::next(it), addr, std::move(tail));
+            }
+
+            // Merges the segment starting at @addr (if any) into the one before when they're covered alike
+            void merge(uintptr_t addr)
+            {
+                auto it = segments.find(addr);
+                if(it == segments.end() || it == segments.begin()) return;
+                auto prev = std::prev(it);
+                if(prev->second.end == addr && prev->second.ids == it->second.ids)
+                    prev->second.end = it->second.end, segments.erase(it);
+            }
+
+            // Calls @fn for every claim overlapping [begin, end), oldest first
+            template<class F>
+            void overlapping(uintptr_t begin, uintptr_t end, F fn)
+            {
+                std::vector<uint64_t> ids;
+                for(auto it = first_after(begin); it != segments.end() && it->first < end; ++it)
+                    ids.insert(ids.end(), it->second.ids.begin(), it->second.ids.end());
+                std::sort(ids.begin(), ids.end());
+                ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+                for(auto id : ids) fn(claims.at(id));
+            }
+
+            void add(const patch_claim& c)
+            {
+                claims.emplace(c.id, c);
+                auto it = split(c.begin);
+                split(c.end);
+
+                // Cover the gaps between the existing segments too
+                for(uintptr_t at = c.begin; at < c.end; )
+                {
+                    if(it == segments.end() || it->first > at)
+                    {
+                        uintptr_t gap_end = it == segments.end()? c.end : std::min(c.end, it->first);
+                        segments.emplace_hint(it, at, segment { gap_end, { c.id } });
+                        at = gap_end;
+                        continue;
+                    }
+                    it->second.ids.push_back(c.id);
+                    at = it->second.end;
+                    ++it;
+                }
+                merge(c.begin);
+                merge(c.end);
+            }
+
+            void remove(const patch_claim& c)
+            {
+                for(auto it = first_after(c.begin); it != segments.end() && it->first < c.end; )
+                {
+                    auto& ids = it->second.ids;
+                    ids.erase(std::remove(ids.begin(), ids.end(), c.id), ids.end());
+                    it = ids.empty()? segments.erase(it) : std::next(it);
+                }
+                merge(c.begin);
+                merge(c.end);
+                claims.erase(c.id);
+            }
+
+            void report(const patch_conflict& c)
+            {
+                ++conflicts;
+                if(handler)
+                    handler(c);
+                else
+                    fprintf(stderr, "injector: %s of [%#lx, %#lx) by %s %s the patch at [%#lx, %#lx) by %s\n",
+                            c.on_release? "restore" : "patch", (unsigned long) c.incoming.begin, (unsigned long) c.incoming.end,
+                            c.incoming.owner? c.incoming.owner : "?",
+                            c.on_release? (c.allowed? "undoes" : "refused, it would undo") : (c.allowed? "overlaps" : "refused, it overlaps"),
+                            (unsigned long) c.existing.begin, (unsigned long) c.existing.end, c.existing.owner? c.existing.owner : "?");
+            }
+
+        public:
+            static patch_registry& instance()
+            {
+                static patch_registry registry;
+                return registry;
+            }
+
+            void set_policy(conflict_policy p)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                this->policy = p;
+            }
+
+            conflict_policy get_policy() const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return policy;
+            }
+
+            // Sets the function called on conflicts (with the registry locked, don't patch from there)
+            void set_handler(handler_type h)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                this->handler = std::move(h);
+            }
+
+            // Claims [@addr, @addr + @size) for @owner, returns the claim id or 0 if the policy rejects it
+            uint64_t claim(uintptr_t addr, size_t size, const char* owner = current_patch_owner())
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                patch_claim incoming = { addr, addr + (size? size : 1), owner, next_id };
+
+                // Under stack a patch may only go exactly over the previous patches of its range
+                bool allowed = true, exact = true;
+                std::vector<patch_claim> hits;
+                overlapping(incoming.begin, incoming.end, [&](const patch_claim& c) {
+                    hits.push_back(c);
+                    exact = exact && c.begin == incoming.begin && c.end == incoming.end;
+                });
+
+                if(!hits.empty())
+                {
+                    allowed = policy == conflict_policy::warn || (policy == conflict_policy::stack && exact);
+                    // A stacked patch isn't a problem worth reporting
+                    if(!(policy == conflict_policy::stack && exact))
+                        for(auto& h : hits) report(patch_conflict { h, incoming, false, allowed });
+                }
+
+                if(!allowed) return last_patch_claim() = 0;
+                add(incoming);
+                return last_patch_claim() = next_id++;
+            }
+
+            // Releases the claim @id of [@addr, @addr + @size), when the memory is about to be restored
+            // @id is 0 for a restore of memory written without a claim, anything over it then counts as newer
+            // Returns false if the restore shouldn't be done (a newer overlapping patch would be undone, under reject)
+            bool release(uint64_t id, uintptr_t addr, size_t size)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = id? claims.find(id) : claims.end();
+                bool mine = it != claims.end() && it->second.begin == addr;
+
+                patch_claim incoming = mine? it->second : patch_claim { addr, addr + (size? size : 1), current_patch_owner(), id };
+                incoming.end = std::max(incoming.end, addr + size);
+
+                // Anything newer over the restored bytes gets undone
+                std::vector<patch_claim> newer;
+                overlapping(incoming.begin, incoming.end, [&](const patch_claim& c) {
+                    if(c.id > incoming.id) newer.push_back(c);
+                });
+
+                bool allowed = newer.empty() || policy != conflict_policy::reject;
+                for(auto& n : newer) report(patch_conflict { n, incoming, true, allowed });
+
+                if(allowed && mine) remove(it->second);
+                return allowed;
+            }
+
+            // Is anything in [@addr, @addr + @size) claimed?
+            bool is_claimed(uintptr_t addr, size_t size = 1)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                bool found = false;
+                overlapping(addr, addr + (size? size : 1), [&](const patch_claim&) { found = true; });
+                return found;
+            }
+
+            // The claims overlapping [@addr, @addr + @size), oldest first
+            std::vector<patch_claim> find(uintptr_t addr, size_t size = 1)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::vector<patch_claim> out;
+                overlapping(addr, addr + (size? size : 1), [&](const patch_claim& c) { out.push_back(c); });
+                return out;
+            }
+
+            size_t size() const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return claims.size();
+            }
+
+            size_t conflict_count() const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return conflicts;
+            }
+
+            void clear()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                segments.clear();
+                claims.clear();
+                conflicts = 0;
+            }
+    };
+}
@@ -0,0 +1,334 @@
+/*
+ *  Injectors - Patch Set Hot Reload
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Reloading a patch set (e.g. an edited mod configuration) without undoing and redoing all of it: the new set is
+ *  diffed against the applied one, by address and bytes, and only the differences are written, in one patch_batch
+ *  commit. Entries gone from the set get their original bytes back, new entries are written (their original bytes
+ *  saved first), entries whose bytes changed are rewritten, and the unchanged ones aren't touched.
+ *
+ *      live_patch_set live;
+ *      patch_set set;
+ *      set.add_b(0x123450, 0x200000);
+ *      set.add_nop(0x123460, 2);
+ *      live.reload(set);               // Applies everything
+ *      ...
+ *      live.reload(edited);            // Only what changed
+ *
+ *  Addresses are absolute (already translated). The entries of a set mustn't overlap each other (the last one
+ *  added at an address replaces the previous ones there), entries of the applied and the new set may.
+ *  With INJECTOR_PATCH_REGISTRY new entries are claimed and removed ones released.
+ */
+#pragma once
+#include "injector.hpp"
+#include "arm64.hpp"
+#include "batch.hpp"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifdef INJECTOR_PATCH_REGISTRY
+#include "registry.hpp"
+#endif
+
+namespace injector
+{
+    /*
+     *  patch_set
+     *      The bytes to write at some addresses, a patch set as a whole
+     */
+    class patch_set
+    {
+        public:
+            struct entry
+            {
+                uintptr_t   addr;
+                size_t      offset;         // Into the bytes
+                size_t      size;
+            };
+
+        private:
+            std::vector<entry>      entries;
+            std::vector<uint8_t>    arena;
+            bool                    sorted = true;
+
+        public:
+            // Adds writing @size bytes from @in at @addr
+            void add(uintptr_t addr, const void* in, size_t size)
+            {
+                if(!entries.empty() && addr <= entries.back().addr) sorted = false;
+                entries.push_back(entry { addr, arena.size(), size });
+                arena.insert(arena.end(), (const uint8_t*) in, (const uint8_t*) in + size);
+            }
+
+            // Adds writing the object @value at @addr
+            template<class T>
+            void add(uintptr_t addr, const T& value)
+            {
+                this->add(addr, &value, sizeof(T));
+            }
+
+            void add_b(uintptr_t at, uintptr_t dest)    { this->add(at, arm64::b(at, dest)); }
+            void add_bl(uintptr_t at, uintptr_t dest)   { this->add(at, arm64::bl(at, dest)); }
+            void add_ret(uintptr_t at)                  { this->add(at, arm64::ret()); }
+
+            void add_nop(uintptr_t at, size_t count = 1)
+            {
+                std::vector<uint32_t> nops(count, arm64::nop());
+                this->add(at, nops.data(), count * sizeof(uint32_t));
+            }
+
+            // The entries sorted by address, one per address (the last added)
+            const std::vector<entry>& sorted_entries()
+            {
+                if(!sorted)
+                {
+                    std::stable_sort(entries.begin(), entries.end(), [](const entry& a, const entry& b) { return a.addr < b.addr; });
+                    size_t kept = 0;
+                    for(size_t i = 0; i < entries.size(); ++i)
+                    {
+                        if(kept && entries[kept - 1].addr == entries[i].addr) entries[kept - 1] = entries[i];
+                        else entries[kept++] = entries[i];
+                    }
+                    entries.resize(kept);
+                    sorted = true;
+                }
+                return entries;
+            }
+
+            const uint8_t* bytes(const entry& e) const { return arena.data() + e.offset; }
+
+            size_t size() const { return entries.size(); }
+            bool empty() const { return entries.empty(); }
+
+            void clear()
+            {
+                entries.clear();
+                arena.clear();
+                sorted = true;
+            }
+    };
+
+    struct reload_result
+    {
+        size_t      kept        = 0;        // Entries already applied as they are
+        size_t      added       = 0;        // New entries written
+        size_t      changed     = 0;        // Entries rewritten with other bytes
+        size_t      reverted    = 0;        // Entries gone from the set, restored
+        size_t      rejected    = 0;        // New entries refused by the patch registry
+        size_t      failed      = 0;        // Writes which failed (unmapped or unprotectable memory)
+        size_t      page_runs   = 0;        // See patch_batch::runs
+    };
+
+    /*
+     *  live_patch_set
+     *      The patch set applied to the process, with the original bytes of every entry
+     */
+    class live_patch_set
+    {
+        private:
+            struct applied
+            {
+                uintptr_t   addr;
+                size_t      size;
+                size_t      patched;        // Offset of the written bytes into the arena
+                size_t      original;       // Offset of the original bytes into the arena
+                uint64_t    claim;          // Registry claim of the entry, 0 if none
+            };
+
+            std::vector<applied>    entries;    // Sorted by address
+            std::vector<uint8_t>    arena;
+            size_t                  garbage = 0;    // Bytes of the arena no entry uses anymore
+
+            // Appends @size bytes from @in to the arena, returns their offset
+            size_t store(const uint8_t* in, size_t size)
+            {
+                size_t at = arena.size();
+                arena.insert(arena.end(), in, in + size);
+                return at;
+            }
+
+            // Drops the unused bytes once they're most of the arena
+            void compact()
+            {
+                if(garbage <= arena.size() / 2) return;
+                std::vector<uint8_t> old = std::move(arena);
+                arena.clear();
+                for(auto& e : entries)
+                {
+                    e.patched = store(old.data() + e.patched, e.size);
+                    e.original = store(old.data() + e.original, e.size);
+                }
+                garbage = 0;
+            }
+
+            // Copies the original bytes of [addr, addr + size) into @out, as they'll be once @reverts are restored
+            void read_original(uintptr_t addr, size_t size, const std::vector<const applied*>& reverts, uint8_t* out) const
+            {
+                memcpy(out, (const void*) addr, size);
+                for(auto r : reverts)
+                {
+                    uintptr_t lo = std::max(addr, r->addr), hi = std::min(addr + size, r->addr + r->size);
+                    if(lo < hi) memcpy(out + (lo - addr), arena.data() + r->original + (lo - r->addr), hi - lo);
+                }
+            }
+
+        public:
+            // Number of entries applied
+            size_t size() const { return entries.size(); }
+            bool empty() const { return entries.empty(); }
+
+            // Makes @next the applied set, writing only the differences
+            reload_result reload(patch_set& next)
+            {
+                reload_result result;
+                const auto& want = next.sorted_entries();
+
+                // Diff both sorted sets, entries resized count as removed and added again
+                std::vector<const applied*> reverts;
+                std::vector<const applied*> keeps;
+                std::vector<std::pair<const applied*, const patch_set::entry*>> changes;
+                std::vector<const patch_set::entry*> adds;
+                for(size_t i = 0, j = 0; i < entries.size() || j < want.size(); )
+                {
+                    if(j == want.size() || (i < entries.size() && entries[i].addr < want[j].addr))
+                        reverts.push_back(&entries[i++]);
+                    else if(i == entries.size() || want[j].addr < entries[i].addr)
+                        adds.push_back(&want[j++]);
+                    else
+                    {
+                        const applied& a = entries[i++];
+                        const patch_set::entry& w = want[j++];
+                        if(a.size != w.size)
+                            reverts.push_back(&a), adds.push_back(&w);
+                        else if(memcmp(arena.data() + a.patched, next.bytes(w), w.size) != 0)
+                            changes.emplace_back(&a, &w);
+                        else
+                            keeps.push_back(&a);
+                    }
+                }
+                result.kept = keeps.size();
+
+                // Restores first, then the writes, so overlapping new entries land over the restored bytes
+                // The arena is only appended to, the kept entries don't move
+                patch_batch batch;
+                std::vector<applied> next_entries;
+                std::vector<size_t> add_index;       // Write index of every add, to drop those which failed
+                std::vector<const applied*> restored;
+
+                for(auto r : reverts)
+                {
+                #ifdef INJECTOR_PATCH_REGISTRY
+                    if(!patch_registry::instance().release(r->claim, r->addr, r->size))
+                    {
+                        // A newer patch sits on it, keep the entry applied
+                        keeps.push_back(r);
+                        continue;
+                    }
+                #endif
+                    batch.add(r->addr, arena.data() + r->original, r->size);
+                    restored.push_back(r);
+                    garbage += 2 * r->size;
+                    ++result.reverted;
+                }
+
+                // Three runs sorted by address: kept, changed, added
+                next_entries.reserve(keeps.size() + changes.size() + adds.size());
+                for(auto k : keeps)
+                    next_entries.push_back(*k);
+                if(keeps.size() != result.kept)     // Refused restores were appended out of order
+                    std::sort(next_entries.begin(), next_entries.end(), [](const applied& a, const applied& b) { return a.addr < b.addr; });
+                size_t first_change = next_entries.size();
+
+                for(auto& c : changes)
+                {
+                    batch.add(c.second->addr, next.bytes(*c.second), c.second->size);
+                    next_entries.push_back(applied { c.first->addr, c.first->size, store(next.bytes(*c.second), c.second->size), c.first->original, c.first->claim });
+                    garbage += c.first->size;
+                    ++result.changed;
+                }
+                size_t first_add = next_entries.size();
+
+                std::vector<uint8_t> original;
+                for(auto a : adds)
+                {
+                    uint64_t claim = 0;
+                #ifdef INJECTOR_PATCH_REGISTRY
+                    if((claim = patch_registry::instance().claim(a->addr, a->size)) == 0)
+                    {
+                        ++result.rejected;
+                        continue;
+                    }
+                #endif
+                    original.resize(a->size);
+                    read_original(a->addr, a->size, restored, original.data());
+                    add_index.push_back(batch.add(a->addr, next.bytes(*a), a->size));
+                    size_t patched = store(next.bytes(*a), a->size);
+                    next_entries.push_back(applied { a->addr, a->size, patched, store(original.data(), a->size), claim });
+                    ++result.added;
+                }
+
+                std::vector<size_t> failed;
+                result.failed = batch.commit(&failed);
+                result.page_runs = batch.runs();
+
+                // Added entries which couldn't be written aren't applied
+                if(!failed.empty())
+                {
+                    std::sort(failed.begin(), failed.end());
+                    for(size_t k = add_index.size(); k-- > 0; )
+                    {
+                        if(std::binary_search(failed.begin(), failed.end(), add_index[k]))
+                        {
+                        #ifdef INJECTOR_PATCH_REGISTRY
+                            auto& e = next_entries[first_add + k];
+                            patch_registry::instance().release(e.claim, e.addr, e.size);
+                        #endif
+                            garbage += 2 * next_entries[first_add + k].size;
+                            next_entries.erase(next_entries.begin() + ptrdiff_t(first_add + k));
+                            --result.added;
+                        }
+                    }
+                }
+
+                auto by_address = [](const applied& a, const applied& b) { return a.addr < b.addr; };
+                std::inplace_merge(next_entries.begin(), next_entries.begin() + ptrdiff_t(first_change), next_entries.begin() + ptrdiff_t(first_add), by_address);
+                std::inplace_merge(next_entries.begin(), next_entries.begin() + ptrdiff_t(first_add), next_entries.end(), by_address);
+                entries = std::move(next_entries);
+                compact();
+                return result;
+            }
+
+            // Restores every entry, returns the number of restores which failed
+            size_t revert_all()
+            {
+                patch_set none;
+                return reload(none).failed;
+            }
+    };
+}
@@ -0,0 +1,484 @@
+/*
+ *  Injectors - Safe-Point Patching
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Patching a running process without tearing: before the writes every other thread is parked in a real-time
+ *  signal handler which records where it was (the PC and, on arm64, LR from its ucontext). Patches whose range
+ *  contains one of these addresses are deferred and retried a bit later, the others are written while everyone is
+ *  parked, then the threads are released.
+ *
+ *      safepoint_patcher patcher;
+ *      patcher.add(addr, code, sizeof(code));      // e.g. a MakeBR sequence
+ *      auto r = patcher.commit();                  // r.deferred patches are still queued, commit() again later
+ *
+ *  The pause is bounded (safepoint_options::timeout_us): if a thread doesn't park in time (it blocks the signal,
+ *  or it's stopped), or there are more threads than the session has slots for, nothing is written and the attempt
+ *  is retried. The writes are grouped beforehand into runs of pages of one mapping, like patch_batch does, so a
+ *  run costs one protection change whatever its number of writes, and the runs written per pause are bounded too
+ *  (safepoint_options::write_budget_us), the remaining ones wait for the next attempt. Everything done while the
+ *  threads are parked is async-signal-safe, since a parked thread may hold any lock (malloc's, stdio's...): the threads are found
+ *  with getdents64, the mappings are read and the bytes staged beforehand, and the writes are plain
+ *  mprotect/memcpy. A thread whose code is only on the stack (a return address deeper than LR) isn't seen, so
+ *  don't patch in the middle of functions which may be waiting for a callee.
+ */
+#pragma once
+#include "injector.hpp"
+#include "maps.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace injector
+{
+    struct safepoint_options
+    {
+        uint64_t    timeout_us      = 500;      // Longest time to wait for the threads to park, per attempt
+        uint64_t    write_budget_us = 500;      // Time after which no other page run is written, per attempt
+        int         attempts        = 8;        // Attempts before giving up on the deferred patches
+        uint64_t    retry_delay_us  = 200;      // Time the threads run between two attempts
+        int         signal          = 0;        // The real-time signal used to park threads, 0 for SIGRTMIN + 4
+    };
+
+    struct safepoint_result
+    {
+        size_t      applied     = 0;            // Patches written
+        size_t      deferred    = 0;            // Patches left in the queue, a thread was inside them or out of budget
+        size_t      failed      = 0;            // Patches dropped (unmapped or unprotectable memory)
+        size_t      page_runs   = 0;            // Page runs written (one protection change each)
+        size_t      threads     = 0;            // Threads parked by the last attempt
+        size_t      unresponsive = 0;           // Threads which didn't park in time (or didn't fit in the session), at the last attempt
+        int         attempts    = 0;
+        uint64_t    max_pause_ns = 0;           // Longest time the threads were kept parked
+    };
+
+    namespace injector_safepoint
+    {
+        static const size_t max_threads = 2048;
+
+        struct slot
+        {
+            std::atomic<pid_t>      tid;
+            std::atomic<int>        parked;
+            uintptr_t               pc;
+            uintptr_t               lr;
+        };
+
+        // Shared with the signal handler, the session is odd while threads are asked to park
+        struct state_t
+        {
+            std::atomic<uint32_t>   session;    // Also a futex, parked threads sleep on it
+            std::atomic<size_t>     count;      // Slots in use by the session
+            slot                    slots[max_threads];
+        };
+
+        inline state_t& state()
+        {
+            static state_t s;
+            return s;
+        }
+
+        inline pid_t gettid()
+        {
+            return pid_t(syscall(SYS_gettid));
+        }
+
+        inline uint64_t now_ns()
+        {
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return uint64_t(ts.tv_sec) * 1000000000ull + uint64_t(ts.tv_nsec);
+        }
+
+        inline void handler(int, siginfo_t*, void* context)
+        {
+            int saved_errno = errno;
+            auto& s = state();
+            uint32_t session = s.session.load(std::memory_order_acquire);
+            if(session & 1)
+            {
+                pid_t self = gettid();
+                size_t n = s.count.load(std::memory_order_acquire);
+                for(size_t i = 0; i < n; ++i)
+                {
+                    slot& t = s.slots[i];
+                    if(t.tid.load(std::memory_order_relaxed) != self)
+                        continue;
+
+                    auto uc = (ucontext_t*) context;
+                #if defined(__aarch64__)
+                    t.pc = uintptr_t(uc->uc_mcontext.pc);
+                    t.lr = uintptr_t(uc->uc_mcontext.regs[30]);
+                #elif defined(__x86_64__)
+                    t.pc = uintptr_t(uc->uc_mcontext.gregs[REG_RIP]);
+                    t.lr = 0;
+                #else
+                    (void) uc;
+                    t.pc = t.lr = 0;
+                #endif
+                    t.parked.store(1, std::memory_order_release);
+
+                    // Parked until the session ends, a stale signal from an older session falls through
+                    while(s.session.load(std::memory_order_acquire) == session)
+                        syscall(SYS_futex, &s.session, FUTEX_WAIT_PRIVATE, session, nullptr, nullptr, 0);
+                    break;
+                }
+            }
+            errno = saved_errno;
+        }
+    }
+
+    /*
+     *  safepoint_patcher
+     *      Queued writes to the running process, done by commit() while no thread executes them
+     *      Addresses are absolute (already translated).
+     */
+    class safepoint_patcher
+    {
+        private:
+            struct pending_write
+            {
+                uintptr_t       addr;
+                size_t          offset;         // Into staging
+                size_t          size;
+                int             prot;           // Of the mapping, -1 if unmapped (filled by commit)
+            };
+
+            // Writes within contiguous pages of one mapping, done with one protection change
+            struct page_run
+            {
+                uintptr_t       begin, end;     // Page aligned
+                int             prot;
+                size_t          first, last;    // Range of order
+            };
+
+            // Untouched pages a run of pages may span
+            static const size_t max_hole_pages = 16;
+
+            std::vector<pending_write>  pending;
+            std::vector<uint8_t>        staging;
+            std::vector<size_t>         order;  // Indices into pending, by run, queue order within a run
+            std::vector<page_run>       runs;
+
+            // Installs the handler for @sig once
+            static bool install(int sig)
+            {
+                static std::atomic<int> installed[64];
+                if(sig <= 0 || sig >= 64) return false;
+                if(installed[sig].load()) return true;
+
+                struct sigaction sa;
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_sigaction = &injector_safepoint::handler;
+                sa.sa_flags = SA_SIGINFO | SA_RESTART;
+                sigemptyset(&sa.sa_mask);
+                if(sigaction(sig, &sa, nullptr) != 0) return false;
+                installed[sig].store(1);
+                return true;
+            }
+
+            // Adds the threads of the process not in the session yet to it (and signals them), returns how many
+            // The threads which don't fit in the session (more than max_threads) are counted in @overflow
+            // Async-signal-safe, the session slots are static
+            size_t gather(int sig, pid_t pid, pid_t self, size_t& overflow)
+            {
+                overflow = 0;
+                auto& s = injector_safepoint::state();
+                int fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if(fd == -1) return 0;
+
+                struct dirent64_t { uint64_t ino; int64_t off; unsigned short reclen; unsigned char type; char name[1]; };
+                alignas(8) char buffer[4096];
+                size_t added = 0;
+                for(long n; (n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0; )
+                {
+                    for(long pos = 0; pos < n; )
+                    {
+                        auto d = (const dirent64_t*) (buffer + pos);
+                        pos += d->reclen;
+
+                        pid_t tid = 0;
+                        for(const char* c = d->name; *c >= '0' && *c <= '9'; ++c) tid = tid * 10 + (*c - '0');
+                        if(tid <= 0 || tid == self) continue;
+
+                        size_t count = s.count.load(std::memory_order_relaxed);
+                        bool known = false;
+                        for(size_t i = 0; i < count && !known; ++i) known = (s.slots[i].tid.load(std::memory_order_relaxed) == tid);
+                        if(known) continue;
+                        if(count == injector_safepoint::max_threads) { ++overflow; continue; }
+
+                        s.slots[count].parked.store(0, std::memory_order_relaxed);
+                        s.slots[count].tid.store(tid, std::memory_order_relaxed);
+                        s.count.store(count + 1, std::memory_order_release);
+                        syscall(SYS_tgkill, pid, tid, sig);
+                        ++added;
+                    }
+                }
+                close(fd);
+                return added;
+            }
+
+            // Waits until every thread of the session is parked, returns the number which didn't in time
+            size_t wait_parked(uint64_t deadline)
+            {
+                auto& s = injector_safepoint::state();
+                for(;;)
+                {
+                    size_t missing = 0, count = s.count.load(std::memory_order_acquire);
+                    for(size_t i = 0; i < count; ++i)
+                    {
+                        // A thread which exited won't park, don't wait for it
+                        if(!s.slots[i].parked.load(std::memory_order_acquire)
+                        && syscall(SYS_tgkill, getpid(), s.slots[i].tid.load(std::memory_order_relaxed), 0) == 0)
+                            ++missing;
+                    }
+                    if(missing == 0 || injector_safepoint::now_ns() >= deadline)
+                        return missing;
+                    sched_yield();      // Let them run, there may be fewer cores than threads
+                }
+            }
+
+            // Is a parked thread executing [addr, addr + size)?
+            static bool is_busy(uintptr_t addr, size_t size)
+            {
+                auto& s = injector_safepoint::state();
+                size_t count = s.count.load(std::memory_order_acquire);
+                for(size_t i = 0; i < count; ++i)
+                {
+                    const auto& t = s.slots[i];
+                    if(!t.parked.load(std::memory_order_acquire)) continue;
+                    if((t.pc >= addr && t.pc < addr + size) || (t.lr > addr && t.lr < addr + size))
+                        return true;
+                }
+                return false;
+            }
+
+            // Groups the writes not done yet into page runs, marks the unmapped ones failed (2 in @done)
+            // Done before the threads are parked, it allocates
+            void plan(const memory_map& maps, std::vector<uint8_t>& done, uintptr_t page)
+            {
+                order.clear();
+                runs.clear();
+                for(size_t i = 0; i < pending.size(); ++i)
+                {
+                    if(done[i]) continue;
+                    if(pending[i].prot == -1) done[i] = 2;
+                    else                      order.push_back(i);
+                }
+                std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                    return pending[a].addr < pending[b].addr || (pending[a].addr == pending[b].addr && a < b);
+                });
+
+                for(size_t i = 0; i < order.size(); )
+                {
+                    auto region = maps.find(pending[order[i]].addr);
+                    uintptr_t last = pending[order[i]].addr + pending[order[i]].size;
+                    page_run r = { pending[order[i]].addr & ~(page - 1), (last + page - 1) & ~(page - 1), pending[order[i]].prot, i, i };
+                    for(; i < order.size(); ++i)
+                    {
+                        const auto& w = pending[order[i]];
+                        if(w.addr >= r.end + max_hole_pages * page || w.addr + w.size > region->end) break;
+                        last = std::max(last, w.addr + w.size);
+                        r.end = (last + page - 1) & ~(page - 1);
+                    }
+                    r.last = i;
+                    std::sort(order.begin() + r.first, order.begin() + r.last);
+                    runs.push_back(r);
+                }
+            }
+
+            // Writes what no parked thread executes in @r, returns the number of writes deferred
+            size_t write(const page_run& r, std::vector<uint8_t>& done)
+            {
+                // The busy ones are marked 3 for the time of the run
+                size_t busy = 0;
+                for(size_t k = r.first; k < r.last; ++k)
+                {
+                    const auto& w = pending[order[k]];
+                    if(is_busy(w.addr, w.size)) done[order[k]] = 3, ++busy;
+                }
+
+                bool writable = (r.prot & PROT_WRITE) != 0;
+                bool ok = busy == r.last - r.first
+                       || writable || mprotect((void*) r.begin, r.end - r.begin, r.prot | PROT_READ | PROT_WRITE) == 0;
+                for(size_t k = r.first; k < r.last; ++k)
+                {
+                    const auto& w = pending[order[k]];
+                    if(done[order[k]] == 3) { done[order[k]] = 0; continue; }
+                    if(ok) memcpy((void*) w.addr, staging.data() + w.offset, w.size);
+                    done[order[k]] = ok? 1 : 2;
+                }
+                if(busy == r.last - r.first) return busy;
+                if(!ok) return busy;
+
+                if(!writable) mprotect((void*) r.begin, r.end - r.begin, r.prot);
+                if(r.prot & PROT_EXEC)
+                {
+                    for(size_t k = r.first; k < r.last; ++k)
+                    {
+                        const auto& w = pending[order[k]];
+                        if(done[order[k]] == 1) __builtin___clear_cache((char*) w.addr, (char*) w.addr + w.size);
+                    }
+                }
+                return busy;
+            }
+
+        public:
+            // Queues writing @size bytes from @in at @addr
+            void add(uintptr_t addr, const void* in, size_t size)
+            {
+                pending.push_back(pending_write { addr, staging.size(), size, -1 });
+                staging.insert(staging.end(), (const uint8_t*) in, (const uint8_t*) in + size);
+            }
+
+            // Queues writing the object @value at @addr
+            template<class T>
+            void add(uintptr_t addr, const T& value)
+            {
+                this->add(addr, &value, sizeof(T));
+            }
+
+            size_t size() const { return pending.size(); }
+            bool empty() const { return pending.empty(); }
+
+            // Drops the queued writes
+            void clear()
+            {
+                pending.clear();
+                staging.clear();
+            }
+
+            // Does the queued writes no thread is executing, retrying the others up to @options.attempts times
+            // The deferred writes stay queued, the others (done or failed) are removed.
+            safepoint_result commit(const safepoint_options& options = safepoint_options())
+            {
+                safepoint_result result;
+                int sig = options.signal? options.signal : SIGRTMIN + 4;
+                if(pending.empty() || !install(sig))
+                {
+                    result.deferred = pending.size();
+                    return result;
+                }
+
+                // Process-wide, only one safe-point at a time
+                static std::mutex mutex;
+                std::lock_guard<std::mutex> lock(mutex);
+
+                const uintptr_t page = page_size();
+                const pid_t pid = getpid(), self = injector_safepoint::gettid();
+                auto& s = injector_safepoint::state();
+                std::vector<uint8_t> done(pending.size(), 0);
+
+                memory_map maps;
+                for(int attempt = 0; attempt < options.attempts; ++attempt)
+                {
+                    if(attempt) usleep(useconds_t(options.retry_delay_us));
+                    ++result.attempts;
+
+                    // Armed lazy pages are installed before reading their protection
+                    for(size_t i = 0; i < pending.size(); ++i)
+                        if(!done[i]) run_before_write_hook(pending[i].addr, pending[i].size);
+
+                    // Nothing may allocate or lock from here until the threads are released
+                    maps.read();
+                    for(auto& w : pending)
+                    {
+                        auto r = maps.find(w.addr);
+                        w.prot = (r && w.addr + w.size <= r->end)? int(r->prot) : -1;
+                    }
+                    plan(maps, done, page);
+
+                    s.count.store(0, std::memory_order_relaxed);
+                    s.session.fetch_add(1, std::memory_order_acq_rel);        // Odd, threads park
+                    uint64_t start = injector_safepoint::now_ns();
+                    uint64_t deadline = start + options.timeout_us * 1000;
+
+                    // Threads may be created meanwhile, look again until no new one shows up
+                    // Those which don't fit in the session can't be parked, they're as unresponsive as the late ones
+                    size_t late = 0, overflow = 0;
+                    while(gather(sig, pid, self, overflow) != 0)
+                    {
+                        late = wait_parked(deadline);
+                        if(late) break;
+                    }
+                    size_t missing = late + overflow;
+
+                    // At least one run per attempt, the ones past the budget wait for the next attempt
+                    size_t deferred = 0;
+                    if(missing == 0)
+                    {
+                        uint64_t budget = injector_safepoint::now_ns() + options.write_budget_us * 1000;
+                        for(size_t k = 0; k < runs.size(); ++k)
+                        {
+                            if(k && injector_safepoint::now_ns() >= budget)
+                            {
+                                deferred += order.size() - runs[k].first;
+                                break;
+                            }
+                            size_t busy = write(runs[k], done);
+                            deferred += busy;
+                            if(busy < runs[k].last - runs[k].first) ++result.page_runs;
+                        }
+                    }
+
+                    s.session.fetch_add(1, std::memory_order_acq_rel);        // Even, threads go on
+                    syscall(SYS_futex, &s.session, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+                    uint64_t pause = injector_safepoint::now_ns() - start;
+                    result.max_pause_ns = std::max(result.max_pause_ns, pause);
+                    result.threads = s.count.load(std::memory_order_relaxed) - late;
+                    result.unresponsive = missing;
+
+                    if(missing == 0 && deferred == 0)
+                        break;
+                }
+
+                // Keep the deferred writes queued
+                size_t kept = 0;
+                for(size_t i = 0; i < pending.size(); ++i)
+                {
+                    if(done[i] == 1)        ++result.applied;
+                    else if(done[i] == 2)   ++result.failed;
+                    else                    pending[kept++] = pending[i];
+                }
+                pending.resize(kept);
+                result.deferred = kept;
+                if(kept == 0) staging.clear();
+                return result;
+            }
+    };
+}
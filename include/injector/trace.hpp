@@ -0,0 +1,451 @@
+/*
+ *  Injectors - Function Tracing
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Entry/exit tracing of hooked functions into a memory mapped file.
+ *  The hook dispatch (function_hooker_manager::call_hooks) is traced when INJECTOR_HOOK_TRACING is defined, anything
+ *  else (e.g. a MakeInline hook passing regs.x0..x3) can be traced with TraceEntry/TraceExit or a trace_scope.
+ *
+ *  The file is split in rings, each one owned by a single thread while it lives. Writing a record is a few stores
+ *  into the shared mapping, the writer never blocks nor makes syscalls (besides gettid once per thread, when it
+ *  claims its ring). Rings overwrite their oldest records when full.
+ *  Since the mapping is shared with the file, the records written before a crash are still in the page cache and
+ *  end up in the file, trace_reader decodes them.
+ */
+#pragma once
+#include "profiling.hpp"        // for ReadTimestamp
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+namespace injector
+{
+    enum class trace_kind : uint32_t
+    {
+        entry = 1,
+        exit  = 2,
+    };
+
+    static const size_t trace_max_args = 4;     // Arguments kept per record
+
+    // A record, one cache line
+    struct alignas(64) trace_record
+    {
+        uint64_t    seq;                // Index of the record in its ring plus one, zero while being written
+        uint64_t    timestamp;          // ReadTimestamp ticks
+        uint64_t    site;               // Hooked address (or any user id)
+        uint32_t    tid;
+        trace_kind  kind;
+        uint64_t    args[trace_max_args];
+    };
+
+    // Header of a ring
+    struct alignas(64) trace_ring
+    {
+        uint64_t    head;               // Records written so far
+        uint32_t    tid;                // Last owner
+        uint32_t    in_use;
+    };
+
+    // Header of the file, followed by the ring headers and then the records of each ring
+    struct alignas(64) trace_file_header
+    {
+        char        magic[8];
+        uint32_t    version;
+        uint32_t    record_size;
+        uint32_t    ring_count;
+        uint32_t    ring_capacity;      // Records per ring, a power of two
+        uint64_t    frequency;          // Ticks per second of the timestamps
+        uint32_t    arg_count;
+
+        static constexpr const char* signature = "INJTRACE";
+        static const uint32_t current_version = 1;
+
+        size_t file_size() const
+        {
+            return sizeof(trace_file_header) + size_t(ring_count) * sizeof(trace_ring)
+                 + size_t(ring_count) * ring_capacity * sizeof(trace_record);
+        }
+
+        trace_ring* rings() const
+        {
+            return (trace_ring*)(uintptr_t(this) + sizeof(trace_file_header));
+        }
+
+        trace_record* records(uint32_t ring) const
+        {
+            return (trace_record*)(uintptr_t(rings() + ring_count) + size_t(ring) * ring_capacity * sizeof(trace_record));
+        }
+    };
+
+    /*
+     *  trace_arg
+     *      Converts an argument to its traced value: integers, enums and pointers as is, floating point by their bits,
+     *      anything else as zero
+     */
+    template<class T>
+    inline uint64_t trace_arg(const T& v)
+    {
+        using U = typename std::decay<T>::type;
+        if constexpr(std::is_integral<U>::value || std::is_enum<U>::value)
+            return uint64_t(v);
+        else if constexpr(std::is_pointer<U>::value)
+            return uint64_t(uintptr_t(v));
+        else if constexpr(std::is_floating_point<U>::value && sizeof(U) <= sizeof(uint64_t))
+        {
+            uint64_t bits = 0;
+            memcpy(&bits, &v, sizeof(U));
+            return bits;
+        }
+        else
+            return 0;
+    }
+
+    /*
+     *  hook_tracer
+     *      Owns the trace file and hands out its rings to the threads
+     */
+    class hook_tracer
+    {
+        private:
+            // Ring claimed by the current thread, given back when the thread exits
+            struct thread_state
+            {
+                trace_file_header*  file = nullptr;
+                trace_ring*         ring = nullptr;
+                trace_record*       records = nullptr;
+                uint64_t            mask = 0;
+                uint32_t            tid = 0;
+
+                ~thread_state()
+                {
+                    if(ring) __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+                }
+            };
+
+            trace_file_header*  file = nullptr;     // Current file, null if not tracing
+            uint64_t            dropped = 0;        // Records lost because no ring was free
+            std::mutex          mutex;
+
+            hook_tracer() = default;
+            hook_tracer(const hook_tracer&) = delete;
+
+            static thread_state& state()
+            {
+                static thread_local thread_state s;
+                return s;
+            }
+
+            // Claims a free ring of @f for the current thread, returns false if all are taken
+            // The thread stays without a file then, so its next record tries again.
+            static bool claim(thread_state& s, trace_file_header* f)
+            {
+                if(s.ring) __atomic_store_n(&s.ring->in_use, 0, __ATOMIC_RELEASE);  // From a previous file
+                s.file = nullptr, s.ring = nullptr;
+
+                auto rings = f->rings();
+                for(uint32_t i = 0; i < f->ring_count; ++i)
+                {
+                    uint32_t expected = 0;
+                    if(__atomic_compare_exchange_n(&rings[i].in_use, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                    {
+                        if(s.tid == 0) s.tid = uint32_t(syscall(SYS_gettid));
+                        s.file    = f;
+                        s.ring    = &rings[i];
+                        s.records = f->records(i);
+                        s.mask    = f->ring_capacity - 1;
+                        __atomic_store_n(&rings[i].tid, s.tid, __ATOMIC_RELAXED);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+        public:
+            // Starts tracing into a new file at @path with @ring_count rings of @ring_capacity records (rounded up to
+            // a power of two). Returns false on failure. The previous file, if any, is closed.
+            bool open(const char* path, uint32_t ring_count = 64, uint32_t ring_capacity = 16384)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                close_unlocked();
+
+                uint32_t cap = 1;
+                while(cap < ring_capacity) cap <<= 1;
+
+                trace_file_header h = { };
+                memcpy(h.magic, trace_file_header::signature, sizeof(h.magic));
+                h.version       = trace_file_header::current_version;
+                h.record_size   = sizeof(trace_record);
+                h.ring_count    = ring_count;
+                h.ring_capacity = cap;
+                h.frequency     = GetTimestampFrequency();
+                h.arg_count     = trace_max_args;
+
+                int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if(fd == -1) return false;
+
+                size_t size = h.file_size();
+                void* p = MAP_FAILED;
+                if(ftruncate(fd, off_t(size)) == 0)
+                    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ::close(fd);
+                if(p == MAP_FAILED) return false;
+
+                memcpy(p, &h, sizeof(h));
+                __atomic_store_n(&file, (trace_file_header*) p, __ATOMIC_RELEASE);
+                return true;
+            }
+
+            // Stops tracing and flushes the file. The mapping is kept alive since other threads may still be
+            // in the middle of writing a record.
+            void close()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                close_unlocked();
+            }
+
+            bool is_open() const
+            {
+                return __atomic_load_n(&file, __ATOMIC_RELAXED) != nullptr;
+            }
+
+            // Records lost because every ring was taken
+            uint64_t get_dropped() const
+            {
+                return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+            }
+
+            // Writes a record, @n arguments from @args (extra ones are ignored)
+            void record(trace_kind kind, uint64_t site, const uint64_t* args, size_t n)
+            {
+                auto f = __atomic_load_n(&file, __ATOMIC_ACQUIRE);
+                if(f == nullptr) return;
+
+                auto& s = state();
+                if(s.file != f && !claim(s, f))
+                {
+                    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+                    return;
+                }
+
+                uint64_t idx = s.ring->head;
+                trace_record& r = s.records[idx & s.mask];
+                __atomic_store_n(&r.seq, 0, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+
+                r.timestamp = ReadTimestamp();
+                r.site      = site;
+                r.tid       = s.tid;
+                r.kind      = kind;
+                for(size_t i = 0; i < trace_max_args; ++i)
+                    r.args[i] = i < n? args[i] : 0;
+
+                __atomic_store_n(&r.seq, idx + 1, __ATOMIC_RELEASE);
+                __atomic_store_n(&s.ring->head, idx + 1, __ATOMIC_RELEASE);
+            }
+
+            static hook_tracer& singleton()
+            {
+                static hook_tracer t;
+                return t;
+            }
+
+        private:
+            void close_unlocked()
+            {
+                if(auto f = file)
+                {
+                    __atomic_store_n(&file, (trace_file_header*) nullptr, __ATOMIC_RELEASE);
+                    msync(f, f->file_size(), MS_ASYNC);
+                }
+            }
+    };
+
+    /*
+     *  TraceEntry / TraceExit
+     *      Records the entry or exit of @site with the first trace_max_args values of @args
+     */
+    template<class ...Args>
+    inline void TraceEntry(uint64_t site, const Args&... args)
+    {
+        const uint64_t a[sizeof...(Args) + 1] = { trace_arg(args)..., 0 };
+        hook_tracer::singleton().record(trace_kind::entry, site, a, sizeof...(Args));
+    }
+
+    template<class ...Args>
+    inline void TraceExit(uint64_t site, const Args&... args)
+    {
+        const uint64_t a[sizeof...(Args) + 1] = { trace_arg(args)..., 0 };
+        hook_tracer::singleton().record(trace_kind::exit, site, a, sizeof...(Args));
+    }
+
+    /*
+     *  trace_scope
+     *      Records the entry of @site on construction and its exit on destruction
+     */
+    class trace_scope
+    {
+        private:
+            uint64_t site;
+
+        public:
+            template<class ...Args>
+            explicit trace_scope(uint64_t site, const Args&... args) : site(site)
+            {
+                TraceEntry(site, args...);
+            }
+
+            ~trace_scope()
+            {
+                TraceExit(site);
+            }
+
+            trace_scope(const trace_scope&) = delete;
+            trace_scope& operator=(const trace_scope&) = delete;
+    };
+
+    /*
+     *  trace_reader
+     *      Decodes a trace file, including one left behind by a crashed process
+     */
+    class trace_reader
+    {
+        private:
+            std::unique_ptr<trace_record[]> data;   // Record sized blocks, to keep everything aligned
+            size_t size = 0;
+
+        public:
+            // Loads the file at @path, returns false if it's not a trace file
+            bool load(const char* path)
+            {
+                data.reset(), size = 0;
+                FILE* f = fopen(path, "rb");
+                if(f == nullptr) return false;
+
+                fseek(f, 0, SEEK_END);
+                long fsize = ftell(f);
+                fseek(f, 0, SEEK_SET);
+                if(fsize > 0)
+                {
+                    size = size_t(fsize);
+                    data.reset(new trace_record[(size + sizeof(trace_record) - 1) / sizeof(trace_record)]);
+                    if(fread(data.get(), 1, size, f) != size) data.reset(), size = 0;
+                }
+                fclose(f);
+
+                auto h = header();
+                if(h == nullptr || memcmp(h->magic, trace_file_header::signature, sizeof(h->magic)) != 0
+                || h->version != trace_file_header::current_version || h->record_size != sizeof(trace_record)
+                || h->ring_capacity == 0 || size < h->file_size())
+                {
+                    data.reset(), size = 0;
+                    return false;
+                }
+                return true;
+            }
+
+            const trace_file_header* header() const
+            {
+                if(size < sizeof(trace_file_header)) return nullptr;
+                return (const trace_file_header*) data.get();
+            }
+
+            // Gets the complete records of the ring @ring, oldest first
+            std::vector<trace_record> ring(uint32_t ring) const
+            {
+                std::vector<trace_record> result;
+                auto h = header();
+                if(h == nullptr || ring >= h->ring_count) return result;
+
+                auto records = h->records(ring);
+                uint64_t mask = h->ring_capacity - 1;
+                for(uint64_t i = 0; i < h->ring_capacity; ++i)
+                {
+                    // A record being written when the process died has no seq, an overwritten one has a seq
+                    // that doesn't match its slot
+                    auto& r = records[i];
+                    if(r.seq != 0 && ((r.seq - 1) & mask) == i)
+                        result.push_back(r);
+                }
+
+                std::sort(result.begin(), result.end(), [](const trace_record& a, const trace_record& b) {
+                    return a.seq < b.seq;
+                });
+                return result;
+            }
+
+            // Gets the records of every ring, sorted by timestamp
+            std::vector<trace_record> records() const
+            {
+                std::vector<trace_record> result;
+                auto h = header();
+                if(h == nullptr) return result;
+
+                for(uint32_t i = 0; i < h->ring_count; ++i)
+                {
+                    auto r = ring(i);
+                    result.insert(result.end(), r.begin(), r.end());
+                }
+                std::stable_sort(result.begin(), result.end(), [](const trace_record& a, const trace_record& b) {
+                    return a.timestamp < b.timestamp;
+                });
+                return result;
+            }
+
+            // Writes every record to @f as text, one per line, timestamps in nanoseconds since the first record
+            void dump(FILE* f) const
+            {
+                auto h = header();
+                if(h == nullptr) return;
+
+                auto all = records();
+                double ns = 1e9 / double(h->frequency? h->frequency : 1);
+                uint64_t base = all.empty()? 0 : all.front().timestamp;
+                for(auto& r : all)
+                {
+                    fprintf(f, "%14.0f tid=%-6u %-5s site=0x%llx", double(r.timestamp - base) * ns, r.tid,
+                            r.kind == trace_kind::entry? "entry" : "exit", (unsigned long long) r.site);
+                    if(r.kind == trace_kind::entry)
+                        for(size_t i = 0; i < trace_max_args; ++i)
+                            fprintf(f, " 0x%llx", (unsigned long long) r.args[i]);
+                    fputc('\n', f);
+                }
+            }
+    };
+}
@@ -0,0 +1,307 @@
+/*
+ *  Injectors - Trampoline Memory
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+#pragma once
+#include "injector.hpp"
+#include "arm64.hpp"
+#include "maps.hpp"
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000    // Older kernels ignore it and treat the address as a hint, which we check anyway
+#endif
+
+namespace injector
+{
+    /*
+     *  dual_mapping
+     *      The same pages (a memfd) mapped twice: read+exec where the code runs, read+write somewhere else where it
+     *      gets written. Code in it is generated and patched without any mprotect (so without TLB shootdowns) and
+     *      the memory is never writable and executable at the same address.
+     *      Writes through rw() still need FlushInstructionCache on the rx() addresses.
+     */
+    class dual_mapping
+    {
+        private:
+            uintptr_t   exec = 0;
+            uintptr_t   write = 0;
+            size_t      length = 0;
+
+        public:
+            dual_mapping() = default;
+
+            // Maps @size bytes, the executable view at @hint exactly if not null (MAP_FIXED_NOREPLACE)
+            explicit dual_mapping(size_t size, uintptr_t hint = 0)
+            {
+                this->map(size, hint);
+            }
+
+            ~dual_mapping()
+            {
+                this->unmap();
+            }
+
+            dual_mapping(const dual_mapping&) = delete;
+            dual_mapping& operator=(const dual_mapping&) = delete;
+
+            dual_mapping(dual_mapping&& rhs) : exec(rhs.exec), write(rhs.write), length(rhs.length)
+            {
+                rhs.exec = rhs.write = 0, rhs.length = 0;
+            }
+
+            dual_mapping& operator=(dual_mapping&& rhs)
+            {
+                if(this != &rhs)
+                {
+                    this->unmap();
+                    exec = rhs.exec, write = rhs.write, length = rhs.length;
+                    rhs.exec = rhs.write = 0, rhs.length = 0;
+                }
+                return *this;
+            }
+
+            // Maps @size bytes (rounded up to pages), returns false on failure (e.g. no memfd_create)
+            bool map(size_t size, uintptr_t hint = 0)
+            {
+                this->unmap();
+                size = (size + page_size() - 1) & ~(page_size() - 1);
+
+                int fd = int(syscall(SYS_memfd_create, "injector-code", 1u /* MFD_CLOEXEC */));
+                if(fd == -1) return false;
+
+                void* x = MAP_FAILED;
+                void* w = MAP_FAILED;
+                if(ftruncate(fd, off_t(size)) == 0)
+                {
+                    x = mmap((void*) hint, size, PROT_READ | PROT_EXEC, MAP_SHARED | (hint? MAP_FIXED_NOREPLACE : 0), fd, 0);
+                    if(x != MAP_FAILED && hint && uintptr_t(x) != hint)
+                        munmap(x, size), x = MAP_FAILED;
+                    if(x != MAP_FAILED)
+                        w = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                }
+                ::close(fd);
+
+                if(w == MAP_FAILED)
+                {
+                    if(x != MAP_FAILED) munmap(x, size);
+                    return false;
+                }
+
+                exec = uintptr_t(x), write = uintptr_t(w), length = size;
+                return true;
+            }
+
+            void unmap()
+            {
+                if(length) munmap((void*) exec, length), munmap((void*) write, length);
+                exec = write = 0, length = 0;
+            }
+
+            bool is_mapped() const { return length != 0; }
+            size_t size() const { return length; }
+
+            // The executable view and the writable view
+            uintptr_t rx() const { return exec; }
+            uintptr_t rw() const { return write; }
+
+            bool contains(uintptr_t p) const { return p >= exec && p < exec + length; }
+
+            // The writable alias of the executable address @p
+            uintptr_t to_rw(uintptr_t p) const { return write + (p - exec); }
+
+            // Writes @size bytes of code at the executable address @p, through the writable view
+            void write_code(uintptr_t p, const void* data, size_t size)
+            {
+                memcpy((void*) to_rw(p), data, size);
+                __builtin___clear_cache((char*) p, (char*) p + size);
+            }
+    };
+
+    /*
+     *  trampoline_allocator
+     *      Bump allocator of executable memory for the generated code (inline stubs, relocated instructions, etc)
+     *      Memory can be requested near a given address so that a single B instruction (+/-128MB) can reach it.
+     *      Memory is never given back to the system, stubs are expected to live as long as the process.
+     *      Chunks are dual mappings (see dual_mapping), the code is written through writable(), falling back to
+     *      read+write+exec memory when memfd_create isn't available (or with INJECTOR_RWX_TRAMPOLINES defined).
+     */
+    class trampoline_allocator
+    {
+        private:
+            struct chunk
+            {
+                uintptr_t base;
+                size_t    size;
+                size_t    used;
+                uintptr_t alias;        // Writable view of base (base itself if it's read+write+exec)
+            };
+
+            std::vector<chunk>          chunks;
+            std::vector<dual_mapping>   mappings;
+            bool                        dual = true;
+            std::mutex                  mutex;
+
+            trampoline_allocator() = default;
+            trampoline_allocator(const trampoline_allocator&) = delete;
+
+            // Checks if the whole [p, p + size) is within B range of @near
+            static bool is_reachable(uintptr_t p, size_t size, uintptr_t near)
+            {
+                return near == 0 || (arm64::is_b_range(near, p) && arm64::is_b_range(near, p + size));
+            }
+
+            // Maps a new chunk with at least @size bytes near @near
+            chunk* new_chunk(size_t size, uintptr_t near)
+            {
+                size = (size + chunk_size - 1) & ~(chunk_size - 1);
+
+                // Maps @size bytes at @hint (anywhere if 0), returns the executable and writable views
+                auto map = [&](uintptr_t hint, uintptr_t& rw) -> void* {
+                #ifndef INJECTOR_RWX_TRAMPOLINES
+                    if(dual)
+                    {
+                        dual_mapping m;
+                        if(m.map(size, hint))
+                        {
+                            rw = m.rw();
+                            uintptr_t rx = m.rx();
+                            mappings.push_back(std::move(m));
+                            return (void*) rx;
+                        }
+                        dual = (hint != 0);     // Failing without a hint means there's no memfd, stop trying
+                    }
+                #endif
+                    void* p = mmap((void*) hint, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | (hint? MAP_FIXED_NOREPLACE : 0), -1, 0);
+                    if(p != MAP_FAILED && hint && uintptr_t(p) != hint)
+                        munmap(p, size), p = MAP_FAILED;
+                    rw = uintptr_t(p);
+                    return p;
+                };
+
+                void* p = MAP_FAILED;
+                uintptr_t rw = 0;
+                if(near == 0)
+                {
+                    p = map(0, rw);
+                }
+                else
+                {
+                    // The gap may be taken by someone else between reading the maps and mapping, so try a few times
+                    for(int attempt = 0; attempt < 4 && p == MAP_FAILED; ++attempt)
+                    {
+                        uintptr_t hint = memory_map(0).find_free(near, size, max_distance - size, chunk_size);
+                        if(hint == 0) break;
+
+                        p = map(hint, rw);
+                        if(p != MAP_FAILED && !is_reachable((uintptr_t) p, size, near))
+                        {
+                            // Not reachable, forget it
+                            if(uintptr_t(p) == rw) munmap(p, size);
+                            else mappings.pop_back();
+                            p = MAP_FAILED;
+                        }
+                    }
+                }
+
+                if(p == MAP_FAILED)
+                    return nullptr;
+
+                chunks.push_back(chunk { (uintptr_t) p, size, 0, rw });
+                return &chunks.back();
+            }
+
+        public:
+            static const size_t chunk_size   = 0x10000;
+            static const size_t max_distance = 0x8000000;   // B range
+
+            // Allocates @size bytes of executable memory which can be reached by a B instruction placed at @near
+            // If @near is null the memory can be anywhere. Returns null on failure.
+            memory_pointer_raw allocate(size_t size, memory_pointer_raw near = nullptr)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                uintptr_t n = near.as_int();
+                size = (size + 15) & ~size_t(15);
+
+                chunk* c = nullptr;
+                for(auto& it : chunks)
+                {
+                    if(it.size - it.used >= size && is_reachable(it.base + it.used, size, n))
+                    { c = &it; break; }
+                }
+
+                if(c == nullptr && (c = new_chunk(size, n)) == nullptr)
+                    return nullptr;
+
+                uintptr_t p = c->base + c->used;
+                c->used += size;
+                return memory_pointer_raw(p);
+            }
+
+            // The writable alias of the trampoline memory at @p (@p itself if it isn't dual mapped)
+            memory_pointer_raw writable(memory_pointer_raw p)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                uintptr_t a = p.as_int();
+                for(auto& c : chunks)
+                {
+                    if(a >= c.base && a < c.base + c.size)
+                        return memory_pointer_raw(c.alias + (a - c.base));
+                }
+                return p;
+            }
+
+            // Allocator singleton
+            static trampoline_allocator& singleton()
+            {
+                static trampoline_allocator a;
+                return a;
+            }
+    };
+
+    /*
+     *  AllocateTrampoline
+     *      Allocates @size bytes of executable memory reachable by a B placed at @near (anywhere if null)
+     */
+    inline memory_pointer_raw AllocateTrampoline(size_t size, memory_pointer_raw near = nullptr)
+    {
+        return trampoline_allocator::singleton().allocate(size, near);
+    }
+
+    /*
+     *  WritableTrampoline
+     *      The address to write the trampoline memory at @p through (see trampoline_allocator)
+     */
+    inline memory_pointer_raw WritableTrampoline(memory_pointer_raw p)
+    {
+        return trampoline_allocator::singleton().writable(p);
+    }
+}
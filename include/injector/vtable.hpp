@@ -0,0 +1,270 @@
+/*
+ *  Injectors - Shadow Virtual Table Hooking
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+*   Injectors - arm64-v8a + Linux port by Xan/Tenjoin
+*/
+
+/*
+ *  Hooks virtual methods of individual objects instead of patching the (shared, read-only) vtable of their class.
+ *  The vtable of the object gets copied into a shadow vtable with some slots replaced, and the object's vptr is
+ *  swapped to point to it. Every object of the same class hooked by the same vtable_hook shares one shadow vtable,
+ *  so hooking an object is a single pointer write and unhooking it is another one.
+ */
+#pragma once
+#include "injector.hpp"
+#include "calling.hpp"
+#include "maps.hpp"
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include <sys/mman.h>
+
+namespace injector
+{
+    /*
+     *  shadow_vtable_pool
+     *      Memory for the shadow vtables, never given back since objects may still point to the tables
+     */
+    class shadow_vtable_pool
+    {
+        private:
+            static const size_t block_size = 0x10000;
+
+            uintptr_t   cur = 0;
+            size_t      left = 0;
+            std::mutex  mutex;
+
+            shadow_vtable_pool() = default;
+            shadow_vtable_pool(const shadow_vtable_pool&) = delete;
+
+        public:
+            // Allocates @count pointers, returns null on failure
+            void** allocate(size_t count)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                size_t size = count * sizeof(void*);
+                if(size > left)
+                {
+                    size_t bsize = size > block_size? (size + block_size - 1) & ~(block_size - 1) : block_size;
+                    void* p = mmap(nullptr, bsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                    if(p == MAP_FAILED) return nullptr;
+                    cur = (uintptr_t) p, left = bsize;
+                }
+
+                void** p = (void**) cur;
+                cur += size, left -= size;
+                return p;
+            }
+
+            static shadow_vtable_pool& singleton()
+            {
+                static shadow_vtable_pool pool;
+                return pool;
+            }
+    };
+
+    /*
+     *  GetVirtualTableSize
+     *      Counts the slots of the vtable @vtbl by looking for the first entry which doesn't point into executable memory
+     *      (this is where the next vtable's offset-to-top / RTTI starts). Costly, reads the process maps.
+     */
+    inline size_t GetVirtualTableSize(memory_pointer_raw vtbl, size_t max = 4096)
+    {
+        memory_map map(0);
+        auto slots = vtbl.get<void*>();
+        size_t i = 0;
+        while(i < max && map.protection(uintptr_t(slots[i])) > 0 && (map.protection(uintptr_t(slots[i])) & PROT_EXEC))
+            ++i;
+        return i;
+    }
+
+    /*
+     *  vtable_hook
+     *      A set of replaced virtual methods, to be applied on individual objects
+     *      The shadow vtables are created on demand, one for each different vtable (class) the hook gets applied to.
+     */
+    class vtable_hook
+    {
+        private:
+            struct shadow
+            {
+                void**  original;       // Original vptr
+                void**  table;          // Shadow vptr
+            };
+
+            size_t                  count;          // Amount of slots to copy (0 to find out per class)
+            size_t                  prefix;         // Entries before the vptr (offset-to-top, RTTI, ...) to copy as well
+            std::vector<std::pair<size_t, void*>> slots;    // Replaced slots
+            std::vector<shadow>     shadows;
+            mutable std::mutex      mutex;
+
+            static void**& vptr(void* object) { return *(void***) object; }
+
+            // Finds the shadow with vptr @table, returns null if it's not one of ours
+            const shadow* find_shadow(void** table) const
+            {
+                for(auto& s : shadows)
+                    if(s.table == table) return &s;
+                return nullptr;
+            }
+
+            // Gets (or makes) the shadow of the vtable @original
+            void** get_shadow(void** original)
+            {
+                for(auto& s : shadows)
+                    if(s.original == original) return s.table;
+
+                size_t n = count? count : GetVirtualTableSize(raw_ptr(original));
+                for(auto& r : slots)
+                    if(r.first >= n) return nullptr;        // The class doesn't have such a method
+
+                void** block = shadow_vtable_pool::singleton().allocate(prefix + n);
+                if(block == nullptr) return nullptr;
+
+                memcpy(block, original - prefix, (prefix + n) * sizeof(void*));
+                void** table = block + prefix;
+                for(auto& r : slots)
+                    table[r.first] = r.second;
+
+                shadows.push_back(shadow { original, table });
+                return table;
+            }
+
+        public:
+            // @count is the amount of virtual methods in the vtable of the hooked objects (0 to find it out, per class)
+            // It must cover the most derived class of every hooked object. @prefix are the entries before the vptr to
+            // keep (2 for offset-to-top and RTTI, more when the class has virtual bases).
+            explicit vtable_hook(size_t count = 0, size_t prefix = 2) : count(count), prefix(prefix)
+            {}
+
+            vtable_hook(const vtable_hook&) = delete;
+            vtable_hook& operator=(const vtable_hook&) = delete;
+
+            // Replaces the method at index @i with @fn, must be called before the hook is applied to any object
+            vtable_hook& set(size_t i, memory_pointer_raw fn)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slots.emplace_back(i, fn.get());
+                return *this;
+            }
+
+            // Hooks the object @object (swaps its vptr), returns false on failure
+            bool apply(void* object)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                void** cur = vptr(object);
+                if(find_shadow(cur)) return true;           // Already hooked
+
+                void** table = get_shadow(cur);
+                if(table == nullptr) return false;
+                __atomic_store_n(&vptr(object), table, __ATOMIC_RELEASE);
+                return true;
+            }
+
+            // Unhooks the object @object (puts its original vptr back)
+            void remove(void* object)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(auto s = find_shadow(vptr(object)))
+                    __atomic_store_n(&vptr(object), s->original, __ATOMIC_RELEASE);
+            }
+
+            // Checks whether @object is hooked by this
+            bool is_hooked(const void* object) const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return find_shadow(*(void***) object) != nullptr;
+            }
+
+            // Gets the original vtable of @object (hooked or not)
+            void** original_vtable(const void* object) const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                void** cur = *(void***) object;
+                auto s = find_shadow(cur);
+                return s? s->original : cur;
+            }
+
+            // Gets the original method at index @i of @object, to be called by the hooks
+            memory_pointer_raw original(const void* object, size_t i) const
+            {
+                return raw_ptr(original_vtable(object)[i]);
+            }
+
+            // Calls the original method at index @i of the object @a[0], through thiscall
+            template<class Ret, class ...Args>
+            Ret call_original(size_t i, Args... a) const
+            {
+                auto obj = raw_ptr(std::get<0>(std::forward_as_tuple(a...)));
+                return thiscall<Ret(Args...)>::call(original(obj.template get<void>(), i), std::forward<Args>(a)...);
+            }
+    };
+
+    /*
+     *  scoped_vtable_hook
+     *      RAII wrapper applying a vtable_hook on a object
+     */
+    class scoped_vtable_hook
+    {
+        private:
+            vtable_hook*    hook   = nullptr;
+            void*           object = nullptr;
+
+        public:
+            scoped_vtable_hook() = default;
+            scoped_vtable_hook(vtable_hook& hook, void* object)
+            {
+                if(hook.apply(object)) this->hook = &hook, this->object = object;
+            }
+
+            ~scoped_vtable_hook()
+            {
+                this->restore();
+            }
+
+            scoped_vtable_hook(const scoped_vtable_hook&) = delete;
+            scoped_vtable_hook& operator=(const scoped_vtable_hook&) = delete;
+            scoped_vtable_hook(scoped_vtable_hook&& rhs) : hook(rhs.hook), object(rhs.object)
+            {
+                rhs.hook = nullptr;
+            }
+            scoped_vtable_hook& operator=(scoped_vtable_hook&& rhs)
+            {
+                this->restore();
+                this->hook = rhs.hook, this->object = rhs.object;
+                rhs.hook = nullptr;
+                return *this;
+            }
+
+            void restore()
+            {
+                if(this->hook)
+                {
+                    this->hook->remove(this->object);
+                    this->hook = nullptr;
+                }
+            }
+    };
+}
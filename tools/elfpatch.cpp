@@ -0,0 +1,177 @@
+/*
+ *  Injectors - Offline ELF patcher
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+ *  Bakes patches into an arm64 shared object on disk (see elf.hpp).
+ *
+ *      injector_elfpatch <input.so> [-o <output.so>] [-f <patch file>]... [<patch>]...
+ *
+ *  Without -o the input is patched in place. Patches are one per line in the files (# starts a comment) or one
+ *  per argument, in the text form of the manifests (see manifest.hpp): addresses are virtual addresses or
+ *  @symbol[+offset], "module" lines are ignored (the addresses of a shared object are already relative to it)
+ *  and patches ending with "expect <hex bytes>" fail when the file doesn't have those bytes.
+ *
+ *      b     <at> <dest>           MakeB
+ *      bl    <at> <dest>           MakeBL
+ *      br    <at> <dest>           MakeBR (ADRP/ADD/BR X16)
+ *      nop   <at> [count]          MakeNOP
+ *      ret   <at>                  MakeRET
+ *      u8|u16|u32|u64 <at> <value> WriteMemory
+ *      bytes <at> <hex bytes>      WriteMemoryRaw
+ */
+#include <injector/elf.hpp>
+#include <injector/manifest.hpp>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace injector;
+
+namespace
+{
+    // Resolves an address of the text form against the symbols of @so
+    bool resolve(elf_memory& so, const manifest_operand& a, uintptr_t& out)
+    {
+        if(a.symbol.empty())
+            return out = uintptr_t(a.value), true;
+        uintptr_t sym = so.get_backend().symbol(a.symbol.c_str());
+        return sym? (out = sym + uintptr_t(a.value), true) : false;
+    }
+
+    // Applies the patch @line, returns an error message or nullptr
+    const char* apply(elf_memory& so, const manifest_line& l)
+    {
+        uintptr_t at, dest;
+        if(!resolve(so, l.at, at))
+            return "unknown address symbol";
+
+        if(!l.expect.empty())
+        {
+            std::vector<uint8_t> original(l.expect.size());
+            if(!so.read_raw(at, original.data(), original.size())) return "not in the file";
+            if(original != l.expect) return "original bytes mismatch";
+        }
+
+        switch(l.kind)
+        {
+            case manifest_kind::b: case manifest_kind::bl: case manifest_kind::br:
+            {
+                if(!resolve(so, l.dest, dest)) return "unknown destination symbol";
+                bool ok = l.kind == manifest_kind::b? so.make_b(at, dest) : l.kind == manifest_kind::bl? so.make_bl(at, dest) : so.make_br(at, dest);
+                return ok? nullptr : "misaligned, out of range or not in the file";
+            }
+            case manifest_kind::nop:
+                return so.make_nop(at, l.count)? nullptr : "misaligned or not in the file";
+            case manifest_kind::ret:
+                return so.make_ret(at)? nullptr : "misaligned or not in the file";
+            case manifest_kind::bytes:
+                return so.write_raw(at, l.bytes.data(), l.bytes.size())? nullptr : "not in the file";
+        }
+        return "unknown patch kind";
+    }
+
+    int usage()
+    {
+        fprintf(stderr, "usage: injector_elfpatch <input.so> [-o <output.so>] [-f <patch file>]... [<patch>]...\n");
+        return 2;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* input = nullptr;
+    const char* output = nullptr;
+    std::vector<const char*> files, inline_patches;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "-o") && i + 1 < argc)      output = argv[++i];
+        else if(!strcmp(argv[i], "-f") && i + 1 < argc) files.push_back(argv[++i]);
+        else if(!input)                                 input = argv[i];
+        else                                            inline_patches.push_back(argv[i]);
+    }
+    if(!input) return usage();
+
+    if(output && !elf_backend::copy(input, output))
+    {
+        fprintf(stderr, "%s: can't copy to %s: %s\n", input, output, strerror(errno));
+        return 1;
+    }
+
+    const char* target = output? output : input;
+    elf_memory so(target, true);
+    if(!so.get_backend().is_open())
+    {
+        fprintf(stderr, "%s: can't open or not an ELF64 file\n", target);
+        return 1;
+    }
+    if(so.get_backend().header()->e_machine != EM_AARCH64)
+    {
+        fprintf(stderr, "%s: not an arm64 file\n", target);
+        return 1;
+    }
+
+    size_t applied = 0, failed = 0;
+    manifest_line l;
+    std::string parse_error;
+    auto run = [&](const char* where, size_t line_no, const std::string& line)
+    {
+        const char* error = parse_manifest_line(line, l, parse_error)? nullptr : parse_error.c_str();
+        if(!error && (l.op.empty() || l.op == "module")) return;
+        if(error || (error = apply(so, l)))
+            fprintf(stderr, "%s:%zu: %s: %s\n", where, line_no, error, line.c_str()), ++failed;
+        else
+            ++applied;
+    };
+
+    for(auto path : files)
+    {
+        FILE* f = fopen(path, "r");
+        if(!f)
+        {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        char buf[1024];
+        for(size_t n = 1; fgets(buf, sizeof(buf), f); ++n)
+        {
+            buf[strcspn(buf, "\r\n")] = 0;
+            run(path, n, buf);
+        }
+        fclose(f);
+    }
+    for(size_t i = 0; i < inline_patches.size(); ++i)
+        run("<args>", i + 1, inline_patches[i]);
+
+    if(!so.get_backend().sync())
+    {
+        fprintf(stderr, "%s: can't write the changes\n", target);
+        return 1;
+    }
+
+    printf("%s: %zu patches applied, %zu failed\n", target, applied, failed);
+    return failed? 1 : 0;
+}
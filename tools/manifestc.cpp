@@ -0,0 +1,135 @@
+/*
+ *  Injectors - Patch manifest compiler
+ *
+ *  This software is provided 'as-is', without any express or implied
+ *  warranty. In no event will the authors be held liable for any damages
+ *  arising from the use of this software.
+ *
+ *  Permission is granted to anyone to use this software for any purpose,
+ *  including commercial applications, and to alter it and redistribute it
+ *  freely, subject to the following restrictions:
+ *
+ *     1. The origin of this software must not be misrepresented; you must not
+ *     claim that you wrote the original software. If you use this software
+ *     in a product, an acknowledgment in the product documentation would be
+ *     appreciated but is not required.
+ *
+ *     2. Altered source versions must be plainly marked as such, and must not be
+ *     misrepresented as being the original software.
+ *
+ *     3. This notice may not be removed or altered from any source
+ *     distribution.
+ *
+ */
+
+/*
+ *  Compiles the text form of a patch manifest into its binary form, or prints a binary manifest (see manifest.hpp).
+ *
+ *      injector_manifestc <input.txt> -o <output.bin>
+ *      injector_manifestc --dump <manifest.bin>
+ */
+#include <injector/manifest.hpp>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace injector;
+
+namespace
+{
+    int usage()
+    {
+        fprintf(stderr, "usage: injector_manifestc <input.txt> -o <output.bin>\n"
+                        "       injector_manifestc --dump <manifest.bin>\n");
+        return 2;
+    }
+
+    void print_hex(const uint8_t* p, uint32_t n)
+    {
+        for(uint32_t i = 0; i < n; ++i) printf("%02x", p[i]);
+    }
+
+    // The string at @offset, or a placeholder if it's out of the string table
+    const char* string_or_placeholder(const manifest_view& m, uint32_t offset)
+    {
+        const char* s = m.string(offset);
+        return s? s : "<invalid string>";
+    }
+
+    int dump(const char* path)
+    {
+        manifest_view m;
+        if(!m.open(path))
+        {
+            fprintf(stderr, "%s: can't open or not a manifest\n", path);
+            return 1;
+        }
+
+        static const char* names[] = { "?", "b", "bl", "br", "nop", "ret", "bytes" };
+        if(m.header().module) printf("module %s\n", string_or_placeholder(m, m.header().module));
+        for(size_t i = 0; i < m.count(); ++i)
+        {
+            auto& r = m.records()[i];
+            unsigned kind = unsigned(r.kind) < 7? unsigned(r.kind) : 0;
+            if(r.flags & manifest_at_symbol) printf("%-5s @%s", names[kind], string_or_placeholder(m, uint32_t(r.address)));
+            else                             printf("%-5s 0x%" PRIx64, names[kind], r.address);
+
+            if(r.kind == manifest_kind::b || r.kind == manifest_kind::bl || r.kind == manifest_kind::br)
+            {
+                if(r.flags & manifest_dest_symbol) printf(" @%s", string_or_placeholder(m, uint32_t(r.value)));
+                else                               printf(" 0x%" PRIx64, r.value);
+            }
+            else if(r.kind == manifest_kind::nop && r.count != 1)
+                printf(" %u", r.count);
+            else if(r.kind == manifest_kind::bytes && m.payload(r.payload, r.payload_size))
+                printf(" "), print_hex(m.payload(r.payload, r.payload_size), r.payload_size);
+
+            if(r.expect_size && m.payload(r.expect, r.expect_size))
+                printf(" expect "), print_hex(m.payload(r.expect, r.expect_size), r.expect_size);
+            printf("\n");
+        }
+        return 0;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if(argc == 3 && !strcmp(argv[1], "--dump"))
+        return dump(argv[2]);
+    if(argc != 4 || strcmp(argv[2], "-o"))
+        return usage();
+
+    FILE* in = fopen(argv[1], "rb");
+    if(!in)
+    {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    std::string text;
+    char buf[1 << 16];
+    for(size_t n; (n = fread(buf, 1, sizeof(buf), in)) != 0; )
+        text.append(buf, n);
+    fclose(in);
+
+    manifest_builder builder;
+    std::string error;
+    if(!compile_manifest(text, builder, error))
+    {
+        fprintf(stderr, "%s: %s\n", argv[1], error.c_str());
+        return 1;
+    }
+
+    auto bin = builder.build();
+    FILE* out = fopen(argv[3], "wb");
+    if(!out || fwrite(bin.data(), 1, bin.size(), out) != bin.size() || fclose(out) != 0)
+    {
+        fprintf(stderr, "%s: can't write the manifest\n", argv[3]);
+        return 1;
+    }
+
+    printf("%s: %zu patches, %zu bytes\n", argv[3], builder.size(), bin.size());
+    return 0;
+}